@@ -20,13 +20,15 @@
 
 #include "BlockFileIO.h"
 
-#include <cstring>  // for memset, memcpy, NULL
+#include <cerrno>   // for EOPNOTSUPP, EINVAL, EIO
+#include <cstring>  // for memset, memcpy, NULL, strerror
 
 #include "Error.h"
 #include "FSConfig.h"    // for FSConfigPtr
 #include "FileIO.h"      // for IORequest, FileIO
 #include "FileUtils.h"   // for EncFS_Opts
 #include "MemoryPool.h"  // for MemBlock, release, allocation
+#include "Mutex.h"       // for Lock
 
 namespace encfs {
 
@@ -46,11 +48,13 @@ BlockFileIO::BlockFileIO(int blockSize, const FSConfigPtr &cfg)
   CHECK(_blockSize > 1);
   _cache.data = new unsigned char[_blockSize];
   _noCache = cfg->opts->noCache;
+  pthread_mutex_init(&_cacheMutex, 0);
 }
 
 BlockFileIO::~BlockFileIO() {
   clearCache(_cache, _blockSize);
   delete[] _cache.data;
+  pthread_mutex_destroy(&_cacheMutex);
 }
 
 /**
@@ -68,41 +72,68 @@ ssize_t BlockFileIO::cacheReadOneBlock(const IORequest &req) const {
    * in the last block of a file, which may be smaller than the blocksize.
    * For reverse encryption, the cache must not be used at all, because
    * the lower file may have changed behind our back. */
-  if ((_noCache == false) && (req.offset == _cache.offset) &&
-      (_cache.dataLen != 0)) {
-    // satisfy request from cache
-    int len = req.dataLen;
-    if (_cache.dataLen < len) len = _cache.dataLen;  // Don't read past EOF
-    memcpy(req.data, _cache.data, len);
-    return len;
+  if (_noCache == false) {
+    Lock _lock(_cacheMutex);
+    if ((req.offset == _cache.offset) && (_cache.dataLen != 0)) {
+      // satisfy request from cache
+      int len = req.dataLen;
+      if (_cache.dataLen < len) len = _cache.dataLen;  // Don't read past EOF
+      memcpy(req.data, _cache.data, len);
+      return len;
+    }
+  }
+
+  // issue reads for full blocks.  The read is done outside of the cache
+  // lock, so that concurrent readers of other blocks don't wait on it.
+  MemBlock mb;
+  IORequest tmp;
+  tmp.offset = req.offset;
+  tmp.dataLen = _blockSize;
+  if (req.dataLen == _blockSize) {
+    tmp.data = req.data;
   } else {
-    if (_cache.dataLen > 0) clearCache(_cache, _blockSize);
-
-    // cache results of read -- issue reads for full blocks
-    IORequest tmp;
-    tmp.offset = req.offset;
-    tmp.data = _cache.data;
-    tmp.dataLen = _blockSize;
-    ssize_t result = readOneBlock(tmp);
-    if (result > 0) {
+    mb = MemoryPool::allocate(_blockSize);
+    tmp.data = mb.data;
+  }
+
+  ssize_t result = readOneBlock(tmp);
+  if (result > 0) {
+    // cache results of read
+    if (_noCache == false) {
+      Lock _lock(_cacheMutex);
+      memcpy(_cache.data, tmp.data, result);
       _cache.offset = req.offset;
       _cache.dataLen = result;  // the amount we really have
-      if (result > req.dataLen)
-        result = req.dataLen;  // only as much as requested
-      memcpy(req.data, _cache.data, result);
     }
-    return result;
+    if (result > req.dataLen) result = req.dataLen;  // only as much as requested
+    if (tmp.data != req.data) memcpy(req.data, tmp.data, result);
   }
+
+  if (mb.data) MemoryPool::release(mb);
+  return result;
 }
 
 bool BlockFileIO::cacheWriteOneBlock(const IORequest &req) {
+  // a full block of zeros reads back as zeros when stored as a hole, so
+  // there is no need to encode it at all.
+  bool hole = _allowHoles && req.dataLen == _blockSize &&
+              isZeroBlock(req.data, req.dataLen) && writeHole(req.offset);
+
   // cache results of write (before pass-thru, because it may be modified
   // in-place)
-  memcpy(_cache.data, req.data, req.dataLen);
-  _cache.offset = req.offset;
-  _cache.dataLen = req.dataLen;
+  {
+    Lock _lock(_cacheMutex);
+    memcpy(_cache.data, req.data, req.dataLen);
+    _cache.offset = req.offset;
+    _cache.dataLen = req.dataLen;
+  }
+  if (hole) return true;
+
   bool ok = writeOneBlock(req);
-  if (!ok) clearCache(_cache, _blockSize);
+  if (!ok) {
+    Lock _lock(_cacheMutex);
+    if (_cache.offset == req.offset) clearCache(_cache, _blockSize);
+  }
   return ok;
 }
 
@@ -147,7 +178,11 @@ ssize_t BlockFileIO::read(const IORequest &req) const {
         blockReq.data = mb.data;
       }
 
-      ssize_t readSize = cacheReadOneBlock(blockReq);
+      // full blocks are decoded straight into the output, the cache only
+      // pays off for partial blocks which are likely to be read again.
+      ssize_t readSize = (blockReq.data == out && size > (size_t)_blockSize)
+                             ? readOneBlock(blockReq)
+                             : cacheReadOneBlock(blockReq);
       if (readSize <= partialOffset) break;  // didn't get enough bytes
 
       int cpySize = min((size_t)(readSize - partialOffset), size);
@@ -397,4 +432,144 @@ int BlockFileIO::truncateBase(FUSE_OFF_T size, FileIO *base) {
   return res;
 }
 
+int BlockFileIO::allocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length) {
+  const int supported =
+      FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE;
+  if (mode & ~supported) return -EOPNOTSUPP;
+  // as fallocate(2): a hole never changes the size, and is never also a
+  // zeroed range
+  if (mode & FALLOC_FL_PUNCH_HOLE) {
+    if (mode & FALLOC_FL_ZERO_RANGE) return -EINVAL;
+    if (!(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+  }
+  if (offset < 0 || length <= 0) return -EINVAL;
+
+  FUSE_OFF_T fileSize = getSize();
+  if (fileSize < 0) return -EIO;
+  FUSE_OFF_T end = offset + length;
+
+  if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+    // an all-zero block only reads back as zeros if holes are allowed
+    if (!_allowHoles) return -EOPNOTSUPP;
+
+    int res = zeroRange(offset, min(end, fileSize));
+    if (res < 0) return res;
+
+    // zeroing past the end of file extends it, the same as truncate()
+    if ((mode & FALLOC_FL_KEEP_SIZE) || end <= fileSize) return 0;
+
+    // .. unless the extension is block aligned, in which case it can be
+    // left as a hole in the base file
+    if (fileSize % _blockSize == 0 && end % _blockSize == 0)
+      return baseAllocate(FALLOC_FL_ZERO_RANGE, fileSize, end - fileSize);
+    return truncate(end);
+  }
+
+  // reserve the space in the base file first, so that extending the file
+  // below doesn't have to (and on hole-friendly volumes, won't) write it.
+  int res = baseAllocate(FALLOC_FL_KEEP_SIZE, offset, length);
+  if (res < 0 && res != -EOPNOTSUPP) return res;
+
+  if ((mode & FALLOC_FL_KEEP_SIZE) || end <= fileSize) return 0;
+  return truncate(end);
+}
+
+/**
+ * Zero out [offset, end), where end is no further than the end of file.
+ * Full blocks are punched out of the base file, since the read path leaves
+ * all-zero blocks alone.  Partial blocks at either edge (including a short
+ * last block, which is stream encoded) are rewritten with zeros.
+ */
+int BlockFileIO::zeroRange(FUSE_OFF_T offset, FUSE_OFF_T end) {
+  if (offset >= end) return 0;
+
+  // blocks [firstBlock, lastBlock) are entirely within the range
+  FUSE_OFF_T firstBlock = (offset + _blockSize - 1) / _blockSize;
+  FUSE_OFF_T lastBlock = end / _blockSize;
+
+  FUSE_OFF_T headEnd = end;
+  FUSE_OFF_T tailStart = end;
+  if (firstBlock < lastBlock) {
+    int res = baseAllocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           firstBlock * _blockSize,
+                           (lastBlock - firstBlock) * _blockSize);
+    if (res < 0) return res;
+
+    Lock _lock(_cacheMutex);
+    if (_cache.dataLen > 0 && _cache.offset >= firstBlock * _blockSize &&
+        _cache.offset < lastBlock * _blockSize)
+      clearCache(_cache, _blockSize);
+
+    headEnd = firstBlock * _blockSize;
+    tailStart = lastBlock * _blockSize;
+  }
+
+  MemBlock mb = MemoryPool::allocate(_blockSize);
+  memset(mb.data, 0, _blockSize);
+
+  IORequest req;
+  req.data = mb.data;
+
+  bool ok = true;
+  FUSE_OFF_T edges[2][2] = {{offset, headEnd}, {tailStart, end}};
+  for (int i = 0; i < 2 && ok; ++i) {
+    // each edge may still span two blocks when no full block was punched
+    for (FUSE_OFF_T pos = edges[i][0]; pos < edges[i][1] && ok;) {
+      FUSE_OFF_T blockEnd = (pos / _blockSize + 1) * _blockSize;
+      req.offset = pos;
+      req.dataLen = (int)(min(blockEnd, edges[i][1]) - pos);
+      ok = write(req);
+      pos += req.dataLen;
+    }
+  }
+
+  MemoryPool::release(mb);
+
+  return ok ? 0 : -EIO;
+}
+
+/**
+ * Store the full block at offset as a hole: punch it out if it is within the
+ * file, or extend the file over it if it starts at a block aligned end of
+ * file.  Returns false if the block has to be written normally.
+ */
+bool BlockFileIO::writeHole(FUSE_OFF_T offset) {
+  FUSE_OFF_T fileSize = getSize();
+  if (fileSize < 0) return false;
+
+  int mode;
+  if (offset + _blockSize <= fileSize)
+    mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+  else if (offset >= fileSize && fileSize % _blockSize == 0)
+    mode = FALLOC_FL_ZERO_RANGE;
+  else
+    return false;  // straddles the (partial) last block
+
+  int res = allocate(mode, offset, _blockSize);
+  if (res < 0) {
+    VLOG(1) << "unable to store zero block at " << offset
+            << " as a hole: " << strerror(-res);
+    return false;
+  }
+  return true;
+}
+
+bool BlockFileIO::isZeroBlock(const unsigned char *data, int len) {
+  // OR together 64 bytes at a time, which the compiler turns into vector
+  // instructions, and only test the accumulator once per chunk.
+  const int chunk = 8 * sizeof(uint64_t);
+  int i = 0;
+  for (; i + chunk <= len; i += chunk) {
+    uint64_t words[8];
+    memcpy(words, data + i, sizeof(words));
+    uint64_t acc = 0;
+    for (int w = 0; w < 8; ++w) acc |= words[w];
+    if (acc != 0) return false;
+  }
+
+  unsigned char acc = 0;
+  for (; i < len; ++i) acc |= data[i];
+  return acc == 0;
+}
+
 }  // namespace encfs
@@ -47,9 +47,24 @@ class BlockFileIO : public FileIO {
 
   virtual int blockSize() const;
 
+  // Preallocation is passed down to the base layer and then extends the file
+  // like truncate() would.  Punching holes / zeroing ranges is only
+  // supported when holes are allowed: whole blocks become holes in the base
+  // file, partial blocks at the edges are re-encoded with zeros.
+  virtual int allocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length);
+
  protected:
   int truncateBase(FUSE_OFF_T size, FileIO *base);
   void padFile(FUSE_OFF_T oldSize, FUSE_OFF_T newSize, bool forceWrite);
+  int zeroRange(FUSE_OFF_T offset, FUSE_OFF_T end);
+  bool writeHole(FUSE_OFF_T offset);
+
+  // true if len bytes at data are all zero
+  static bool isZeroBlock(const unsigned char *data, int len);
+
+  // apply allocate() to the base file, after translating the range from
+  // this layer's offsets into base file offsets.
+  virtual int baseAllocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length) = 0;
 
   // same as read(), except that the request.offset field is guarenteed to be
   // block aligned, and the request size will not be larger then 1 block.
@@ -65,6 +80,8 @@ class BlockFileIO : public FileIO {
 
   // cache last block for speed...
   mutable IORequest _cache;
+  // reads of different blocks may run concurrently, and share the cache
+  mutable pthread_mutex_t _cacheMutex;
 };
 
 }  // namespace encfs
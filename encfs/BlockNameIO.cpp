@@ -85,13 +85,18 @@ static bool BlockIO32_registered = NameIO::Register(
 
     - Version 4.0 adds support for base32, creating names more suitable for
       case-insensitive filesystems (eg Mac).
+
+    - Version 5.0 chains each directory's names from a random IV stored in
+      the directory, rather than from the path.  The coding itself is the
+      same as 4.0, the version only keeps older releases from mounting such
+      a filesystem.
 */
 Interface BlockNameIO::CurrentInterface(bool caseInsensitive) {
-  // implement major version 4 plus support for two prior versions
+  // implement major version 5 plus support for three prior versions
   if (caseInsensitive)
-    return Interface("nameio/block32", 4, 0, 2);
+    return Interface("nameio/block32", 5, 0, 3);
   else
-    return Interface("nameio/block", 4, 0, 2);
+    return Interface("nameio/block", 5, 0, 3);
 }
 
 BlockNameIO::BlockNameIO(const Interface &iface,
@@ -130,6 +135,10 @@ int BlockNameIO::maxDecodedNameLen(int encodedNameLen) const {
   return decLen256 - 2;  // 2 checksum bytes removed..
 }
 
+bool BlockNameIO::concurrentDecode() const {
+  return _cipher->concurrentUse();
+}
+
 int BlockNameIO::encodeName(const char *plaintextName, int length, uint64_t *iv,
                             char *encodedName, int bufferLength) const {
 
@@ -191,7 +200,7 @@ int BlockNameIO::decodeName(const char *encodedName, int length, uint64_t *iv,
     throw Error("Filename too small to decode");
   }
 
-  BUFFER_INIT(tmpBuf, 32, (unsigned int)length);
+  BUFFER_INIT(tmpBuf, 256, (unsigned int)length);
 
   // decode into tmpBuf,
   if (_caseInsensitive) {
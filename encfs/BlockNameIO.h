@@ -51,6 +51,8 @@ class BlockNameIO : public NameIO {
   virtual int maxEncodedNameLen(int plaintextNameLen) const;
   virtual int maxDecodedNameLen(int encodedNameLen) const;
 
+  virtual bool concurrentDecode() const;
+
   // hack to help with static builds
   static bool Enabled();
 
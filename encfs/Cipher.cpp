@@ -171,6 +171,8 @@ unsigned int Cipher::MAC_16(const unsigned char *src, int len,
   return mac16;
 }
 
+bool Cipher::concurrentUse() const { return false; }
+
 bool Cipher::nameEncode(unsigned char *data, int len, uint64_t iv64,
                         const CipherKey &key) const {
   return streamEncode(data, len, iv64, key);
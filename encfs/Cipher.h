@@ -105,6 +105,9 @@ class Cipher {
   virtual int keySize() const = 0;
   virtual int encodedKeySize() const = 0;   // size
   virtual int cipherBlockSize() const = 0;  // size of a cipher block
+  // true if calls with the same key can run at once without waiting on each
+  // other
+  virtual bool concurrentUse() const;
 
   // fill the supplied buffer with random data
   // The data may be pseudo random and might not be suitable for key
@@ -34,6 +34,7 @@
 #include "CipherKey.h"
 #include "Error.h"
 #include "FileIO.h"
+#include "Mutex.h"
 
 namespace encfs {
 
@@ -58,13 +59,14 @@ CipherFileIO::CipherFileIO(const std::shared_ptr<FileIO> &_base,
       lastFlags(0) {
   fsConfig = cfg;
   cipher = cfg->cipher;
+  pthread_mutex_init(&headerMutex, 0);
   key = cfg->key;
 
   CHECK_EQ(fsConfig->config->blockSize % fsConfig->cipher->cipherBlockSize(), 0)
       << "FS block size must be multiple of cipher block size";
 }
 
-CipherFileIO::~CipherFileIO() {}
+CipherFileIO::~CipherFileIO() { pthread_mutex_destroy(&headerMutex); }
 
 Interface CipherFileIO::getInterface() const { return CipherFileIO_iface; }
 
@@ -134,10 +136,16 @@ int CipherFileIO::getAttr(struct stat_st *stbuf) const {
   // stat() the backing file
   int res = base->getAttr(stbuf);
 
+  if (res == 0) plainAttr(fsConfig, stbuf);
+
+  return res;
+}
+
+void CipherFileIO::plainAttr(const FSConfigPtr &cfg, struct stat_st *stbuf) {
   // adjust size if we have a file header
-  if ((res == 0) && haveHeader && S_ISREG(stbuf->st_mode) &&
+  if (cfg->config->uniqueIV && S_ISREG(stbuf->st_mode) &&
       (stbuf->st_size > 0)) {
-    if (!fsConfig->reverseEncryption) {
+    if (!cfg->reverseEncryption) {
       /* In normal mode, the upper file (plaintext) is smaller
        * than the backing ciphertext file */
       rAssert(stbuf->st_size >= HEADER_SIZE);
@@ -148,8 +156,6 @@ int CipherFileIO::getAttr(struct stat_st *stbuf) const {
       stbuf->st_size += HEADER_SIZE;
     }
   }
-
-  return res;
 }
 
 /**
@@ -223,6 +229,11 @@ void CipherFileIO::initHeader() {
   VLOG(1) << "initHeader finished, fileIV = " << fileIV;
 }
 
+void CipherFileIO::ensureHeader() const {
+  Lock _lock(headerMutex);
+  if (fileIV == 0) const_cast<CipherFileIO *>(this)->initHeader();
+}
+
 bool CipherFileIO::writeHeader() {
   if (!base->isWritable()) {
     // open for write..
@@ -325,8 +336,7 @@ ssize_t CipherFileIO::readOneBlock(const IORequest &req) const {
 
   bool ok;
   if (readSize > 0) {
-    if (haveHeader && fileIV == 0)
-      const_cast<CipherFileIO *>(this)->initHeader();
+    if (haveHeader) ensureHeader();
 
     if (readSize != bs) {
       VLOG(1) << "streamRead(data, " << readSize << ", IV)";
@@ -358,7 +368,7 @@ bool CipherFileIO::writeOneBlock(const IORequest &req) {
   int bs = blockSize();
   FUSE_OFF_T blockNum = req.offset / bs;
 
-  if (haveHeader && fileIV == 0) initHeader();
+  if (haveHeader) ensureHeader();
 
   bool ok;
   if (req.dataLen != bs) {
@@ -407,8 +417,8 @@ bool CipherFileIO::blockRead(unsigned char *buf, int size,
   else {
     if (_allowHoles) {
       // special case - leave all 0's alone
-      for (int i = 0; i < size; ++i)
-        if (buf[i] != 0) return cipher->blockDecode(buf, size, _iv64, key);
+      if (!isZeroBlock(buf, size))
+        return cipher->blockDecode(buf, size, _iv64, key);
 
       return true;
     } else
@@ -449,6 +459,19 @@ int CipherFileIO::truncate(FUSE_OFF_T size) {
   return res;
 }
 
+int CipherFileIO::baseAllocate(int mode, FUSE_OFF_T offset,
+                               FUSE_OFF_T length) {
+  if (fsConfig->reverseEncryption) return -EOPNOTSUPP;
+
+  // data in the backing file starts after the header, which has to exist
+  // before the file is extended.
+  if (haveHeader) {
+    if (fileIV == 0 && !(mode & FALLOC_FL_KEEP_SIZE)) initHeader();
+    offset += HEADER_SIZE;
+  }
+  return base->allocate(mode, offset, length);
+}
+
 /**
  * Handle reads for reverse mode with uniqueIV
  */
@@ -59,6 +59,9 @@ class CipherFileIO : public BlockFileIO {
   virtual int getAttr(struct stat_st *stbuf) const;
   virtual FUSE_OFF_T getSize() const;
 
+  // convert attributes of a backing file to those this layer presents
+  static void plainAttr(const FSConfigPtr &cfg, struct stat_st *stbuf);
+
   virtual int truncate(FUSE_OFF_T size);
 
   virtual bool isWritable() const;
@@ -66,9 +69,11 @@ class CipherFileIO : public BlockFileIO {
  private:
   virtual ssize_t readOneBlock(const IORequest &req) const;
   virtual bool writeOneBlock(const IORequest &req);
+  virtual int baseAllocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length);
   virtual void generateReverseHeader(unsigned char *data);
 
   void initHeader();
+  void ensureHeader() const;
   bool writeHeader();
   bool blockRead(unsigned char *buf, int size, uint64_t iv64) const;
   bool streamRead(unsigned char *buf, int size, uint64_t iv64) const;
@@ -87,6 +92,8 @@ class CipherFileIO : public BlockFileIO {
   uint64_t externalIV;
   uint64_t fileIV;
   int lastFlags;
+  // reads / writes of different blocks may race to initialize the header
+  mutable pthread_mutex_t headerMutex;
 
   std::shared_ptr<Cipher> cipher;
   CipherKey key;
@@ -19,6 +19,9 @@
  */
 
 #include "easylogging++.h"
+#include <chrono>
+#include <cstring>
+#include <errno.h>
 #include <utility>
 
 #include "Context.h"
@@ -28,39 +31,59 @@
 
 namespace encfs {
 
-EncFS_Context::EncFS_Context() {
+EncFS_Context::EncFS_Context() : backingWatched(false), openFileTotal(0) {
+  running = false;
   pthread_cond_init(&wakeupCond, 0);
   pthread_mutex_init(&wakeupMutex, 0);
   pthread_mutex_init(&contextMutex, 0);
-
-  usageCount = 0;
+  pthread_mutex_init(&remountMutex, 0);
+  for (int i = 0; i < NumShards; ++i) {
+    pthread_mutex_init(&openFiles[i].mutex, 0);
+    pthread_mutex_init(&closedFiles[i].mutex, 0);
+  }
+  for (int i = 0; i < NumUsageSlots; ++i) usage[i].count = 0;
 }
 
 EncFS_Context::~EncFS_Context() {
+  // release all entries from map
+  for (int i = 0; i < NumShards; ++i) {
+    openFiles[i].files.clear();
+    pthread_mutex_destroy(&openFiles[i].mutex);
+    pthread_mutex_destroy(&closedFiles[i].mutex);
+  }
+
+  pthread_mutex_destroy(&remountMutex);
   pthread_mutex_destroy(&contextMutex);
   pthread_mutex_destroy(&wakeupMutex);
   pthread_cond_destroy(&wakeupCond);
+}
 
-  // release all entries from map
-  openFiles.clear();
+// each thread sticks to one usage slot, handed out round robin
+static int usageSlot() {
+  static std::atomic<unsigned int> nextSlot(0);
+  static thread_local int slot = -1;
+  if (slot < 0) slot = nextSlot.fetch_add(1, std::memory_order_relaxed);
+  return slot;
 }
+
 std::shared_ptr<DirNode> EncFS_Context::getRoot(int *errCode) {
-  std::shared_ptr<DirNode> ret;
-  do {
-    {
-      Lock lock(contextMutex);
-      ret = root;
-      ++usageCount;
-    }
+  usage[usageSlot() % NumUsageSlots].count.fetch_add(
+      1, std::memory_order_relaxed);
 
-    if (!ret) {
-      int res = remountFS(this);
-      if (res != 0) {
-        *errCode = res;
-        break;
-      }
+  std::shared_ptr<DirNode> ret = std::atomic_load(&root);
+  while (!ret) {
+    // only one thread remounts, the others pick up its result
+    Lock lock(remountMutex);
+    ret = std::atomic_load(&root);
+    if (ret) break;
+
+    int res = remountFS(this);
+    if (res != 0) {
+      *errCode = res;
+      break;
     }
-  } while (!ret);
+    ret = std::atomic_load(&root);
+  }
 
   return ret;
 }
@@ -68,68 +91,387 @@ std::shared_ptr<DirNode> EncFS_Context::getRoot(int *errCode) {
 void EncFS_Context::setRoot(const std::shared_ptr<DirNode> &r) {
   Lock lock(contextMutex);
 
-  root = r;
+  std::atomic_store(&root, r);
   if (r) rootCipherDir = r->rootDirectory();
+  // a remount may find the backing store changed
+  attrCache.clear();
+  forgetClosedFiles();
 }
 
-bool EncFS_Context::isMounted() { return root.get() != nullptr; }
+bool EncFS_Context::isMounted() {
+  return std::atomic_load(&root).get() != nullptr;
+}
 
-int EncFS_Context::getAndResetUsageCounter() {
-  Lock lock(contextMutex);
+std::shared_ptr<DirNode> EncFS_Context::currentRoot() {
+  return std::atomic_load(&root);
+}
+
+void EncFS_Context::backingChanged(const char *cipherPath, bool removed) {
+  // without a root there is nothing cached, setRoot clears attrCache
+  std::shared_ptr<DirNode> r = currentRoot();
+  if (r) r->backingChanged(cipherPath, removed);
+}
 
-  int count = usageCount;
-  usageCount = 0;
+int EncFS_Context::getAndResetUsageCounter() {
+  int count = 0;
+  for (int i = 0; i < NumUsageSlots; ++i)
+    count += usage[i].count.exchange(0, std::memory_order_relaxed);
 
   return count;
 }
 
-int EncFS_Context::openFileCount() const {
-  Lock lock(contextMutex);
+int EncFS_Context::openFileCount() const { return openFileTotal; }
 
-  return openFiles.size();
+// FNV-1a
+static uint64_t fnvHash(const char *data, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t EncFS_Context::hashPath(const char *path) {
+  return fnvHash(path, strlen(path));
+}
+
+EncFS_Context::Shard &EncFS_Context::shardFor(uint64_t hash) {
+  // use the high bits, the low ones pick the bucket within the shard
+  return openFiles[(hash >> 56) % NumShards];
+}
+
+EncFS_Context::FileMap::iterator EncFS_Context::findFile(FileMap &files,
+                                                         uint64_t hash,
+                                                         const char *path) {
+  auto range = files.equal_range((size_t)hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.path == path) return it;
+  }
+  return files.end();
 }
+
 std::shared_ptr<FileNode> EncFS_Context::lookupNode(const char *path) {
-  Lock lock(contextMutex);
+  uint64_t hash = hashPath(path);
+  Shard &shard = shardFor(hash);
+  Lock lock(shard.mutex);
 
-  FileMap::iterator it = openFiles.find(std::string(path));
-  if (it != openFiles.end()) {
+  FileMap::iterator it = findFile(shard.files, hash, path);
+  if (it != shard.files.end()) {
     // all the items in the set point to the same node.. so just use the
     // first
-    return it->second.front();
+    return it->second.nodes.front();
   }
   return std::shared_ptr<FileNode>();
 }
 
 void EncFS_Context::renameNode(const char *from, const char *to) {
-  Lock lock(contextMutex);
+  uint64_t fromHash = hashPath(from);
+  uint64_t toHash = hashPath(to);
+  Shard &fromShard = shardFor(fromHash);
+  Shard &toShard = shardFor(toHash);
+
+  // always lock shards in address order to avoid deadlocks
+  Shard *first = &fromShard < &toShard ? &fromShard : &toShard;
+  Shard *second = &fromShard < &toShard ? &toShard : &fromShard;
+  Lock lock1(first->mutex);
+  std::unique_ptr<Lock> lock2;
+  if (second != first) lock2.reset(new Lock(second->mutex));
 
-  FileMap::iterator it = openFiles.find(std::string(from));
-  if (it != openFiles.end()) {
-    auto val = it->second;
-    openFiles.erase(it);
-    openFiles[std::string(to)] = val;
+  FileMap::iterator it = findFile(fromShard.files, fromHash, from);
+  if (it != fromShard.files.end()) {
+    auto val = std::move(it->second.nodes);
+    fromShard.files.erase(it);
+
+    FileMap::iterator dst = findFile(toShard.files, toHash, to);
+    if (dst == toShard.files.end())
+      dst = toShard.files.emplace((size_t)toHash, OpenFile());
+    else
+      --openFileTotal;
+    dst->second.path = to;
+    dst->second.nodes = std::move(val);
   }
 }
 
 FileNode *EncFS_Context::putNode(const char *path,
                                  std::shared_ptr<FileNode> &&node) {
-  Lock lock(contextMutex);
-  auto &list = openFiles[std::string(path)];
+  uint64_t hash = hashPath(path);
+  Shard &shard = shardFor(hash);
+  Lock lock(shard.mutex);
+
+  FileMap::iterator it = findFile(shard.files, hash, path);
+  if (it == shard.files.end()) {
+    it = shard.files.emplace((size_t)hash, OpenFile());
+    it->second.path = path;
+    ++openFileTotal;
+  }
+  auto &list = it->second.nodes;
   list.push_front(std::move(node));
   return list.front().get();
 }
 
+EncFS_Context::ClosedShard &EncFS_Context::closedShardFor(uint64_t hash) {
+  return closedFiles[(hash >> 56) % NumShards];
+}
+
+EncFS_Context::ClosedFileMap::iterator EncFS_Context::findClosed(
+    ClosedFileMap &files, uint64_t hash, const char *path) {
+  auto range = files.equal_range((size_t)hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.path == path) return it;
+  }
+  return files.end();
+}
+
+// the parts of the backing attributes which make up a change token
+static void changeToken(const struct stat_st &stbuf, int64_t *mtime,
+                        int64_t *size, uint64_t *ino) {
+#ifdef USE_LEGACY_DOKAN
+  *mtime = stbuf.st_mtime;
+#else
+  *mtime = stbuf.st_mtim.tv_sec;
+#endif
+  *size = stbuf.st_size;
+  *ino = stbuf.st_ino;
+}
+
+void EncFS_Context::fileClosed(const char *path, const struct stat_st &stbuf) {
+  uint64_t hash = hashPath(path);
+  ClosedShard &shard = closedShardFor(hash);
+  Lock lock(shard.mutex);
+
+  ClosedFileMap::iterator it = findClosed(shard.files, hash, path);
+  if (it == shard.files.end()) {
+    if (shard.files.size() >= MaxClosedFiles)
+      shard.files.erase(shard.files.begin());
+    it = shard.files.emplace((size_t)hash, ClosedFile());
+    it->second.path = path;
+    it->second.generation = 0;
+  }
+  ClosedFile &file = it->second;
+  changeToken(stbuf, &file.mtime, &file.size, &file.ino);
+  file.closedGeneration = file.generation;
+}
+
+bool EncFS_Context::unchangedSinceClose(const char *path,
+                                        const struct stat_st &stbuf) {
+  int64_t mtime, size;
+  uint64_t ino;
+  changeToken(stbuf, &mtime, &size, &ino);
+
+  uint64_t hash = hashPath(path);
+  ClosedShard &shard = closedShardFor(hash);
+  Lock lock(shard.mutex);
+
+  ClosedFileMap::iterator it = findClosed(shard.files, hash, path);
+  if (it == shard.files.end()) return false;
+  const ClosedFile &file = it->second;
+  return file.generation == file.closedGeneration && file.mtime == mtime &&
+         file.size == size && file.ino == ino;
+}
+
+void EncFS_Context::fileChanged(const char *path) {
+  uint64_t hash = hashPath(path);
+  ClosedShard &shard = closedShardFor(hash);
+  Lock lock(shard.mutex);
+
+  // files which were never closed have nothing to invalidate
+  ClosedFileMap::iterator it = findClosed(shard.files, hash, path);
+  if (it != shard.files.end()) ++it->second.generation;
+}
+
+void EncFS_Context::forgetClosedFiles() {
+  for (int i = 0; i < NumShards; ++i) {
+    Lock lock(closedFiles[i].mutex);
+    closedFiles[i].files.clear();
+  }
+}
+
 void EncFS_Context::eraseNode(const char *path, FileNode *pl) {
-  Lock lock(contextMutex);
+  uint64_t hash = hashPath(path);
+  Shard &shard = shardFor(hash);
+  Lock lock(shard.mutex);
 
-  FileMap::iterator it = openFiles.find(std::string(path));
-  rAssert(it != openFiles.end());
+  FileMap::iterator it = findFile(shard.files, hash, path);
+  rAssert(it != shard.files.end());
 
-  it->second.pop_front();
+  it->second.nodes.pop_front();
 
   // if no more references to this file, remove the record all together
-  if (it->second.empty()) {
-    openFiles.erase(it);
+  if (it->second.nodes.empty()) {
+    shard.files.erase(it);
+    --openFileTotal;
+  }
+}
+
+static int64_t nowMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+AttrCache::AttrCache() : attrTTL(0), negativeTTL(0) {
+  for (int i = 0; i < NumShards; ++i) {
+    pthread_mutex_init(&shards[i].mutex, 0);
+    shards[i].generation = 0;
+  }
+}
+
+AttrCache::~AttrCache() {
+  for (int i = 0; i < NumShards; ++i)
+    pthread_mutex_destroy(&shards[i].mutex);
+}
+
+void AttrCache::setTTL(int attrMillis, int negativeMillis) {
+  attrTTL = attrMillis;
+  negativeTTL = negativeMillis;
+  clear();
+}
+
+AttrCache::Shard &AttrCache::shardFor(uint64_t hash) {
+  return shards[(hash >> 56) % NumShards];
+}
+
+bool AttrCache::lookup(const char *path, struct stat_st *stbuf, int *result,
+                       uint64_t *generation) {
+  size_t len = strlen(path);
+  uint64_t hash = fnvHash(path, len);
+  Shard &shard = shardFor(hash);
+  Lock lock(shard.mutex);
+
+  *generation = shard.generation;
+  auto range = shard.entries.equal_range((size_t)hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.path != path) continue;
+
+    if (it->second.expires <= nowMillis()) {
+      shard.entries.erase(it);
+      return false;
+    }
+    *result = it->second.result;
+    if (*result == 0) *stbuf = it->second.stat;
+    return true;
+  }
+  return false;
+}
+
+void AttrCache::insert(const char *path, int result,
+                       const struct stat_st *stbuf, uint64_t generation) {
+  int ttl;
+  if (result == 0)
+    ttl = attrTTL;
+  else if (result == -ENOENT)
+    ttl = negativeTTL;
+  else
+    return;
+  if (ttl <= 0) return;
+
+  size_t len = strlen(path);
+  uint64_t hash = fnvHash(path, len);
+  Shard &shard = shardFor(hash);
+  Lock lock(shard.mutex);
+
+  // invalidated while the caller was asking the backing store
+  if (shard.generation != generation) return;
+
+  int64_t now = nowMillis();
+  if (shard.entries.size() >= MaxShardEntries) {
+    for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+      if (it->second.expires <= now)
+        it = shard.entries.erase(it);
+      else
+        ++it;
+    }
+    while (shard.entries.size() >= MaxShardEntries)
+      shard.entries.erase(shard.entries.begin());
+  }
+
+  EntryMap::iterator it = shard.entries.end();
+  auto range = shard.entries.equal_range((size_t)hash);
+  for (auto i = range.first; i != range.second; ++i) {
+    if (i->second.path == path) {
+      it = i;
+      break;
+    }
+  }
+  if (it == shard.entries.end()) {
+    it = shard.entries.emplace((size_t)hash, Entry());
+    it->second.path.assign(path, len);
+  }
+  it->second.result = result;
+  if (result == 0) it->second.stat = *stbuf;
+  it->second.expires = now + ttl;
+}
+
+void AttrCache::erase(const char *path, size_t len) {
+  uint64_t hash = fnvHash(path, len);
+  Shard &shard = shardFor(hash);
+  Lock lock(shard.mutex);
+
+  ++shard.generation;
+  auto range = shard.entries.equal_range((size_t)hash);
+  for (auto it = range.first; it != range.second;) {
+    if (it->second.path.size() == len &&
+        memcmp(it->second.path.data(), path, len) == 0)
+      it = shard.entries.erase(it);
+    else
+      ++it;
+  }
+}
+
+// length of the parent directory of path, 0 if it has none
+static size_t parentLength(const char *path, size_t len) {
+  while (len > 0 && path[len - 1] == '/') --len;
+  while (len > 0 && path[len - 1] != '/') --len;
+  if (len == 0) return 0;
+  // the root keeps its slash
+  return len > 1 ? len - 1 : 1;
+}
+
+void AttrCache::invalidate(const char *path) {
+  size_t len = strlen(path);
+  erase(path, len);
+
+  size_t parent = parentLength(path, len);
+  if (parent > 0 && parent < len) erase(path, parent);
+}
+
+void AttrCache::invalidatePath(const char *path) {
+  erase(path, strlen(path));
+}
+
+void AttrCache::invalidateTree(const char *path) {
+  size_t len = strlen(path);
+  while (len > 1 && path[len - 1] == '/') --len;
+  bool root = len == 1 && path[0] == '/';
+
+  for (int i = 0; i < NumShards; ++i) {
+    Shard &shard = shards[i];
+    Lock lock(shard.mutex);
+
+    ++shard.generation;
+    for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+      const std::string &name = it->second.path;
+      bool below = root || (name.size() >= len &&
+                            memcmp(name.data(), path, len) == 0 &&
+                            (name.size() == len || name[len] == '/'));
+      if (below)
+        it = shard.entries.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  size_t parent = parentLength(path, len);
+  if (parent > 0 && parent < len) erase(path, parent);
+}
+
+void AttrCache::clear() {
+  for (int i = 0; i < NumShards; ++i) {
+    Lock lock(shards[i].mutex);
+    ++shards[i].generation;
+    shards[i].entries.clear();
   }
 }
 
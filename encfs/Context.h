@@ -21,10 +21,12 @@
 #ifndef _Context_incl_
 #define _Context_incl_
 
+#include <atomic>
 #include <forward_list>
 #include <memory>
 #include "pthread.h"
 #include <set>
+#include <stdint.h>
 #include <string>
 #include <unordered_map>
 
@@ -37,6 +39,66 @@ class FileNode;
 struct EncFS_Args;
 struct EncFS_Opts;
 
+/*
+    Short lived cache of getattr results by plaintext path, so that the
+    stats which come with every request, and lookups of names which don't
+    exist, don't each go to the backing store.
+
+    Operations which go through encfs invalidate the paths they change.
+    Changes made to the backing store behind our back show up once the
+    entries expire, the TTLs are set per mount.  A getattr which raced with
+    an invalidation of its shard doesn't get to store its result.
+*/
+class AttrCache {
+ public:
+  AttrCache();
+  ~AttrCache();
+
+  // in milliseconds, 0 disables that kind of entry
+  void setTTL(int attrMillis, int negativeMillis);
+
+  // true on a hit, with the getattr result in *result (and *stbuf if that
+  // was 0).  On a miss *generation is set, to be passed to insert.
+  bool lookup(const char *path, struct stat_st *stbuf, int *result,
+              uint64_t *generation);
+  // only success and -ENOENT are kept
+  void insert(const char *path, int result, const struct stat_st *stbuf,
+              uint64_t generation);
+
+  // drops the path and its parent directory
+  void invalidate(const char *path);
+  // drops just the path, for changes which leave its directory alone
+  void invalidatePath(const char *path);
+  // same, and everything below the path too
+  void invalidateTree(const char *path);
+  void clear();
+
+ private:
+  struct Entry {
+    std::string path;
+    int result;
+    struct stat_st stat;
+    int64_t expires;  // steady clock, milliseconds
+  };
+  typedef std::unordered_multimap<size_t, Entry> EntryMap;
+
+  struct Shard {
+    pthread_mutex_t mutex;
+    EntryMap entries;
+    uint64_t generation;
+  };
+
+  static const int NumShards = 16;
+  static const size_t MaxShardEntries = 4096;
+
+  Shard &shardFor(uint64_t hash);
+  void erase(const char *path, size_t len);
+
+  Shard shards[NumShards];
+  std::atomic<int> attrTTL;
+  std::atomic<int> negativeTTL;
+};
+
 class EncFS_Context {
  public:
   EncFS_Context();
@@ -56,14 +118,37 @@ class EncFS_Context {
   void setRoot(const std::shared_ptr<DirNode> &root);
   std::shared_ptr<DirNode> getRoot(int *err);
   bool isMounted();
+  // the current root, if any.  Doesn't count as use, or mount on demand.
+  std::shared_ptr<DirNode> currentRoot();
+
+  // a path relative to rootCipherDir changed behind our back, see
+  // DirNode::backingChanged.  Doesn't count as use, or mount on demand.
+  void backingChanged(const char *cipherPath, bool removed);
+
+  /*
+      What files looked like when they were last closed, so that open can
+      let the kernel keep their page cache (keep_cache) if they haven't
+      changed since.  Backing mtimes only have one second resolution, so
+      changes made through us, or seen by the backing store watcher, also
+      bump a per-file generation through fileChanged.
+  */
+  void fileClosed(const char *path, const struct stat_st &stbuf);
+  bool unchangedSinceClose(const char *path, const struct stat_st &stbuf);
+  void fileChanged(const char *path);
+  void forgetClosedFiles();
 
   std::shared_ptr<EncFS_Args> args;
   std::shared_ptr<EncFS_Opts> opts;
+  AttrCache attrCache;
   bool publicFilesystem;
 
   // root path to cipher dir
   std::string rootCipherDir;
 
+  // set while the backing store watcher runs (never with --nowatch), so
+  // outside changes to files are known to reach fileChanged
+  std::atomic<bool> backingWatched;
+
   // for idle monitor
   bool running;
   pthread_t monitorThread;
@@ -79,17 +164,75 @@ class EncFS_Context {
    * store a unique Placeholder for each open() until the corresponding
    * release() is called.  std::shared_ptr then does our reference counting for
    * us.
+   *
+   * The open files are split into shards by path hash, each with its own
+   * lock, so that lookups of unrelated paths don't contend.  Entries are
+   * keyed by the hash and compared against the stored path, which lets
+   * lookups go straight from the caller's const char * without building a
+   * std::string.
    */
+  struct OpenFile {
+    std::string path;
+    std::forward_list<std::shared_ptr<FileNode>> nodes;
+  };
+  typedef std::unordered_multimap<size_t, OpenFile> FileMap;
 
-  typedef std::unordered_map<std::string,
-                             std::forward_list<std::shared_ptr<FileNode>>>
-      FileMap;
+  struct Shard {
+    mutable pthread_mutex_t mutex;
+    FileMap files;
+  };
 
-  mutable pthread_mutex_t contextMutex;
-  FileMap openFiles;
+  static const int NumShards = 16;
+
+  static uint64_t hashPath(const char *path);
+  Shard &shardFor(uint64_t hash);
+  static FileMap::iterator findFile(FileMap &files, uint64_t hash,
+                                    const char *path);
 
-  int usageCount;
+  mutable pthread_mutex_t contextMutex;
+  Shard openFiles[NumShards];
+  // number of paths in openFiles, so that it can be read without visiting
+  // every shard
+  std::atomic<int> openFileTotal;
+
+  // change tokens of closed files, sharded like the open files
+  struct ClosedFile {
+    std::string path;
+    int64_t mtime;
+    int64_t size;
+    uint64_t ino;
+    uint64_t closedGeneration;  // generation at the last close
+    uint64_t generation;
+  };
+  typedef std::unordered_multimap<size_t, ClosedFile> ClosedFileMap;
+
+  struct ClosedShard {
+    pthread_mutex_t mutex;
+    ClosedFileMap files;
+  };
+
+  static const size_t MaxClosedFiles = 1024;  // per shard
+  ClosedShard &closedShardFor(uint64_t hash);
+  static ClosedFileMap::iterator findClosed(ClosedFileMap &files,
+                                            uint64_t hash, const char *path);
+
+  ClosedShard closedFiles[NumShards];
+
+  /* Every operation counts itself for the idle monitor.  Threads spread
+   * their counts over separate cache lines, which are only summed up when
+   * the monitor asks for them.
+   */
+  struct UsageSlot {
+    std::atomic<int> count;
+    char pad[64 - sizeof(std::atomic<int>)];
+  };
+  static const int NumUsageSlots = 16;
+  UsageSlot usage[NumUsageSlots];
+
+  // published with std::atomic_load / std::atomic_store, readers don't lock.
+  // contextMutex serialises setRoot, remountMutex the mountOnDemand remount.
   std::shared_ptr<DirNode> root;
+  pthread_mutex_t remountMutex;
 };
 
 int remountFS(EncFS_Context *ctx);
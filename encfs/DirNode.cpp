@@ -20,12 +20,17 @@
 
 #include <cerrno>
 #include <cstdio>
+#include <deque>
+#include <fcntl.h>
+#include <thread>
+#include <unordered_map>
 #include "pthread.h"
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "unistd.h"
 //#include <utime.h>
 
+#include "Cipher.h"
 #include "DirNode.h"
 #include "FSConfig.h"
 #include "FileNode.h"
@@ -46,22 +51,105 @@ using namespace std;
 
 namespace encfs {
 
+/*
+    Holds a set of DirNode stripes, locked in ascending order and released
+    in reverse.
+*/
+class StripeLock {
+ public:
+  StripeLock(pthread_mutex_t *stripes, uint64_t mask)
+      : _stripes(stripes), _mask(mask) {
+    for (int i = 0; i < 64; ++i)
+      if (_mask & ((uint64_t)1 << i)) pthread_mutex_lock(&_stripes[i]);
+  }
+  ~StripeLock() {
+    for (int i = 63; i >= 0; --i)
+      if (_mask & ((uint64_t)1 << i)) pthread_mutex_unlock(&_stripes[i]);
+  }
+
+ private:
+  StripeLock(const StripeLock &src);             // not allowed
+  StripeLock &operator=(const StripeLock &src);  // not allowed
+
+  pthread_mutex_t *_stripes;
+  uint64_t _mask;
+};
+
 class DirDeleter {
  public:
   void operator()(unix::DIR *d) { unix::closedir(d); }
 };
 
+// directories whose decoded names are kept, and names kept per directory
+static const size_t MaxCachedDirs = 32;
+static const size_t MaxCachedNames = 128 * 1024;
+
+DecodedNames::DecodedNames(uint64_t _iv, int64_t _mtime, int64_t _ctime)
+    : lastUse(0), iv(_iv), mtime(_mtime), ctime(_ctime) {
+  pthread_mutex_init(&mutex, 0);
+}
+
+DecodedNames::~DecodedNames() { pthread_mutex_destroy(&mutex); }
+
+bool DecodedNames::matches(uint64_t _iv, int64_t _mtime,
+                           int64_t _ctime) const {
+  return iv == _iv && mtime == _mtime && ctime == _ctime;
+}
+
+bool DecodedNames::lookup(const char *cipherName,
+                          std::string *plainName) const {
+  Lock lock(mutex);
+
+  auto it = names.find(cipherName);
+  if (it == names.end()) return false;
+  *plainName = it->second;
+  return true;
+}
+
+void DecodedNames::insert(const char *cipherName,
+                          const std::string &plainName) {
+  Lock lock(mutex);
+
+  if (names.size() < MaxCachedNames) names[cipherName] = plainName;
+}
+
 DirTraverse::DirTraverse(const std::shared_ptr<unix::DIR> &_dirPtr, uint64_t _iv,
-                         const std::shared_ptr<NameIO> &_naming, bool _root)
-    : dir(_dirPtr), iv(_iv), naming(_naming), root(_root) {}
+                         const std::shared_ptr<NameIO> &_naming, bool _root,
+                         const std::shared_ptr<DecodedNames> &_decoded,
+                         const FSConfigPtr &_config)
+    : dir(_dirPtr),
+      iv(_iv),
+      naming(_naming),
+      root(_root),
+      decoded(_decoded),
+      config(_config),
+      pendingPos(0),
+      lastPos(0),
+      position(0) {}
 
 DirTraverse::DirTraverse(const DirTraverse &src)
-    : dir(src.dir), iv(src.iv), naming(src.naming) {}
+    : dir(src.dir),
+      iv(src.iv),
+      naming(src.naming),
+      root(src.root),
+      decoded(src.decoded),
+      config(src.config),
+      pending(src.pending),
+      pendingPos(src.pendingPos),
+      lastPos(src.lastPos),
+      position(src.position) {}
 
 DirTraverse &DirTraverse::operator=(const DirTraverse &src) {
   dir = src.dir;
   iv = src.iv;
   naming = src.naming;
+  root = src.root;
+  decoded = src.decoded;
+  config = src.config;
+  pending = src.pending;
+  pendingPos = src.pendingPos;
+  lastPos = src.lastPos;
+  position = src.position;
 
   return *this;
 }
@@ -71,6 +159,23 @@ DirTraverse::~DirTraverse() {
   iv = 0;
   naming.reset();
   root = false;
+  decoded.reset();
+  config.reset();
+  pending.clear();
+}
+
+// kept in every directory of a filesystem with per-directory IVs
+static const char DirectoryIVName[] = ".encfs6.diriv";
+
+// kept in the backing root while a recursive rename is under way
+static const char RenameJournalName[] = ".encfs6.rename";
+
+// backing files which belong to encfs rather than to the filesystem contents
+static bool hiddenName(const char *name, bool root) {
+  if (root && (strcmp(".encfs6.xml", name) == 0 ||
+               strcmp(RenameJournalName, name) == 0))
+    return true;
+  return strcmp(DirectoryIVName, name) == 0;
 }
 
 static bool _nextName(struct unix::dirent *&de, const std::shared_ptr<unix::DIR> &dir,
@@ -96,30 +201,108 @@ static bool _nextName(struct unix::dirent *&de, const std::shared_ptr<unix::DIR>
   }
 }
 
-std::string DirTraverse::nextPlaintextName(int *fileType, ino_t *inode) {
+// number of backing entries decoded as one batch
+static const size_t ReadAheadEntries = 512;
+
+bool DirTraverse::readAhead() {
+  pending.clear();
+  pendingPos = 0;
+
+  // names which aren't in the decoded name cache, and where they go
+  std::vector<std::string> encoded;
+  std::vector<size_t> slots;
+
   struct unix::dirent *de = 0;
-  while (_nextName(de, dir, fileType, inode)) {
-    if (root && (strcmp(".encfs6.xml", de->d_name) == 0)) {
+  Entry entry;
+  while (pending.size() < ReadAheadEntries &&
+         _nextName(de, dir, &entry.fileType, &entry.inode)) {
+    if (hiddenName(de->d_name, root)) {
       VLOG(1) << "skipping filename: " << de->d_name;
       continue;
     }
-    try {
-      uint64_t localIv = iv;
-      return naming->decodePath(de->d_name, &localIv);
-    } catch (encfs::Error &ex) {
+    // only valid until the next readdir
+    entry.haveStat = unix::readdirstat(dir.get(), &entry.stat) == 0;
+
+    entry.plainName.clear();
+    if (!decoded || !decoded->lookup(de->d_name, &entry.plainName)) {
+      slots.push_back(pending.size());
+      encoded.push_back(de->d_name);
+    }
+    pending.push_back(entry);
+  }
+
+  if (!encoded.empty()) {
+    std::vector<std::string> plain;
+    naming->decodeNames(encoded, iv, &plain);
+    for (size_t i = 0; i < encoded.size(); ++i) {
       // .. .problem decoding, ignore it and continue on to next name..
-      VLOG(1) << "error decoding filename: " << de->d_name;
+      if (plain[i].empty()) {
+        VLOG(1) << "error decoding filename: " << encoded[i];
+      }
+      if (decoded) decoded->insert(encoded[i].c_str(), plain[i]);
+      pending[slots[i]].plainName.swap(plain[i]);
     }
   }
 
+  return !pending.empty();
+}
+
+std::string DirTraverse::nextPlaintextName(int *fileType, ino_t *inode) {
+  while (pendingPos < pending.size() || readAhead()) {
+    const Entry &entry = pending[pendingPos++];
+    if (entry.plainName.empty()) continue;
+
+    if (fileType) *fileType = entry.fileType;
+    if (inode) *inode = entry.inode;
+    lastPos = pendingPos - 1;
+    ++position;
+    return entry.plainName;
+  }
+
+  if (fileType) *fileType = 0;
   return string();
 }
 
+std::string DirTraverse::nextPlaintextName(struct stat_st *stbuf,
+                                           bool *fullAttr) {
+  int fileType = 0;
+  ino_t inode = 0;
+  string name = nextPlaintextName(&fileType, &inode);
+  if (name.empty()) return name;
+
+  const Entry &entry = pending[lastPos];
+  *fullAttr = entry.haveStat;
+  if (entry.haveStat) {
+    *stbuf = entry.stat;
+    try {
+      if (config) FileNode::plainAttr(config, stbuf);
+    } catch (encfs::Error &err) {
+      // too short for its header, getAttr reports the error
+      *fullAttr = false;
+    }
+  }
+  if (!*fullAttr) {
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = fileType << 12;
+  }
+  // the listing's inode, as for the other version
+  if (inode != 0 || !entry.haveStat) stbuf->st_ino = inode;
+
+  return name;
+}
+
+void DirTraverse::putBack() {
+  // the entry is still pending, read ahead only happens in the next call
+  rAssert(position > 0 && lastPos < pendingPos);
+  pendingPos = lastPos;
+  --position;
+}
+
 std::string DirTraverse::nextInvalid() {
   struct unix::dirent *de = 0;
   // find the first name which produces a decoding error...
   while (_nextName(de, dir, (int *)nullptr, (ino_t *)nullptr)) {
-    if (root && (strcmp(".encfs6.xml", de->d_name) == 0)) {
+    if (hiddenName(de->d_name, root)) {
       VLOG(1) << "skipping filename: " << de->d_name;
       continue;
     }
@@ -147,29 +330,153 @@ struct RenameEl {
   bool isDirectory;
 };
 
+// one directory of a recursive rename
+struct RenameDir {
+  string fromP;  // plaintext paths
+  string toP;
+  RenameEl self;  // the entry renaming this directory, unless it's the top
+
+  list<RenameEl> entries;  // everything but subdirectories
+  std::vector<std::unique_ptr<RenameDir> > subdirs;
+
+  ~RenameDir() {
+    // don't leave decoded names behind either
+    fromP.assign(fromP.size(), ' ');
+    toP.assign(toP.size(), ' ');
+    self.oldPName.assign(self.oldPName.size(), ' ');
+    self.newPName.assign(self.newPName.size(), ' ');
+  }
+};
+
+static const char RenameJournalHeader[] = "encfs rename journal 1";
+static const char RenameJournalTrailer[] = "end";
+
 class RenameOp {
  private:
   DirNode *dn;
   std::shared_ptr<list<RenameEl> > renameList;
   list<RenameEl>::const_iterator last;
+  // the journal is ours to remove
+  bool journaled;
 
  public:
   RenameOp(DirNode *_dn, const std::shared_ptr<list<RenameEl> > &_renameList)
-      : dn(_dn), renameList(_renameList) {
+      : dn(_dn), renameList(_renameList), journaled(false) {
     last = renameList->begin();
   }
 
   RenameOp(const RenameOp &src)
-      : dn(src.dn), renameList(src.renameList), last(src.last) {}
+      : dn(src.dn),
+        renameList(src.renameList),
+        last(src.last),
+        journaled(src.journaled) {}
 
   ~RenameOp();
 
   operator bool() const { return renameList.get() != nullptr; }
 
+  /*
+      Records every rename of the list, followed by the rename of the top
+      directory from fromCName to toCName, before any of them is made.  A
+      rename interrupted by a crash is finished at the next mount.  Fails
+      while the journal of an earlier rename is still waiting to be
+      finished.
+  */
+  bool writeJournal(const string &fromCName, const string &toCName);
+  void removeJournal();
+
   bool apply();
   void undo();
+
+ private:
+  /*
+      Only open files have a node to rename, unless file headers depend on
+      the path.  Creating a node for every entry would cost a path encoding
+      each.
+  */
+  bool needsNode(const char *plainName) const {
+    return dn->fsConfig->config->externalIVChaining ||
+           (dn->ctx && dn->ctx->lookupNode(plainName));
+  }
 };
 
+// times to put back on a path, false if it can't be stat'ed
+static bool savedTimes(const char *path, struct utimbuf *ut) {
+  struct stat_st st;
+  if (unix::stat(path, &st) != 0) return false;
+
+#ifdef USE_LEGACY_DOKAN
+  ut->actime = st.st_atime;
+  ut->modtime = st.st_mtime;
+#else
+  ut->actime = st.st_atim.tv_sec;
+  ut->modtime = st.st_mtim.tv_sec;
+#endif
+  return true;
+}
+
+static string parentDir(const string &path) {
+  size_t slash = path.rfind('/');
+  return (slash == string::npos) ? string() : path.substr(0, slash);
+}
+
+bool RenameOp::writeJournal(const string &fromCName, const string &toCName) {
+  const string &root = dn->rootDir;
+  string journal = root + RenameJournalName;
+  int flags = O_WRONLY | O_CREAT | O_EXCL;
+#ifdef O_BINARY
+  flags |= O_BINARY;
+#endif
+  int fd = unix::open(journal.c_str(), flags, 0600);
+  if (fd < 0) {
+    if (errno == EEXIST)
+      RLOG(ERROR) << "an interrupted rename is still recorded in " << journal
+                  << ", no directories can be renamed until it is resolved";
+    else
+      RLOG(WARNING) << "unable to create rename journal " << journal << ": "
+                    << strerror(errno);
+    return false;
+  }
+  journaled = true;
+
+  // paths are stored relative to the root, which may move between mounts
+  string buf = string(RenameJournalHeader) + '\n';
+  __int64 offset = 0;
+  bool ok = true;
+  auto add = [&](const string &from, const string &to) {
+    buf.append(from, root.length(), string::npos).append(1, '\t');
+    buf.append(to, root.length(), string::npos).append(1, '\n');
+    if (buf.length() >= 1024 * 1024) {
+      ok = ok && unix::pwrite(fd, buf.data(), buf.length(), offset) ==
+                     (ssize_t)buf.length();
+      offset += buf.length();
+      buf.clear();
+    }
+  };
+  for (auto it = renameList->begin(); it != renameList->end(); ++it)
+    add(it->oldCName, it->newCName);
+  add(fromCName, toCName);
+  buf.append(RenameJournalTrailer).append(1, '\n');
+
+  ok = ok && unix::pwrite(fd, buf.data(), buf.length(), offset) ==
+                 (ssize_t)buf.length();
+  ok = ok && unix::fsync(fd) == 0;
+  unix::close(fd);
+
+  if (!ok) {
+    RLOG(WARNING) << "unable to write rename journal " << journal;
+    removeJournal();
+  }
+  return ok;
+}
+
+void RenameOp::removeJournal() {
+  if (!journaled) return;
+  string journal = dn->rootDir + RenameJournalName;
+  unix::unlink(journal.c_str());
+  journaled = false;
+}
+
 RenameOp::~RenameOp() {
   if (renameList) {
     // got a bunch of decoded filenames sitting in memory..  do a little
@@ -182,48 +489,73 @@ RenameOp::~RenameOp() {
   }
 }
 
+/*
+    Renaming entries changes the modification time of the directory holding
+    them, so the times of each source directory are saved before its first
+    entry is renamed, and put back once its contents are done.  A plain
+    backing rename doesn't change the times of the entry itself, which saves
+    a stat and a utime for every file.  A node rename may rewrite the file
+    header (external IV chaining), so those entries get theirs put back.
+*/
 bool RenameOp::apply() {
+  std::unordered_map<string, struct utimbuf> dirTimes;
+  size_t done = 0;
+  size_t total = renameList->size();
+  bool ok = true;
+
   try {
     while (last != renameList->end()) {
       // backing store rename.
       VLOG(1) << "renaming " << last->oldCName << " -> " << last->newCName;
 
-	  struct stat_st st;
-      bool preserve_mtime = unix::stat(last->oldCName.c_str(), &st) == 0;
+      string parent = parentDir(last->oldCName);
+      if (dirTimes.find(parent) == dirTimes.end()) {
+        struct utimbuf ut;
+        if (savedTimes(parent.c_str(), &ut)) dirTimes[parent] = ut;
+      }
+
+      if (last->isDirectory) {
+        // everything below it has been renamed
+        auto it = dirTimes.find(last->oldCName);
+        if (it != dirTimes.end()) {
+          unix::utime(last->oldCName.c_str(), &it->second);
+          dirTimes.erase(it);
+        }
+      }
 
       // internal node rename..
-      dn->renameNode(last->oldPName.c_str(), last->newPName.c_str());
+      bool node = needsNode(last->oldPName.c_str());
+      struct utimbuf entryTimes;
+      bool restoreTimes = node && savedTimes(last->oldCName.c_str(),
+                                             &entryTimes);
+      if (node) dn->renameNode(last->oldPName.c_str(), last->newPName.c_str());
 
       // rename on disk..
       if (unix::rename(last->oldCName.c_str(), last->newCName.c_str()) == -1) {
         RLOG(WARNING) << "Error renaming " << last->oldCName << ": "
                       << strerror(errno);
-        dn->renameNode(last->newPName.c_str(), last->oldPName.c_str(), false);
-        return false;
-      }
-
-      if (preserve_mtime) {
-        struct utimbuf ut;
-
-#ifdef USE_LEGACY_DOKAN
-		ut.actime = st.st_atime;
-		ut.modtime = st.st_mtime;
-#else 
-		ut.actime = st.st_atim.tv_sec;
-		ut.modtime = st.st_mtim.tv_sec;
-#endif
-
-        unix::utime(last->newCName.c_str(), &ut);
+        if (node)
+          dn->renameNode(last->newPName.c_str(), last->oldPName.c_str(),
+                         false);
+        ok = false;
+        break;
       }
+      if (restoreTimes) unix::utime(last->newCName.c_str(), &entryTimes);
 
       ++last;
+      if (++done % 10000 == 0)
+        RLOG(INFO) << "recursive rename: " << done << " of " << total;
     }
-
-    return true;
   } catch (encfs::Error &err) {
     RLOG(WARNING) << err.what();
-    return false;
+    ok = false;
   }
+
+  // the top directory, which the caller renames afterwards
+  for (auto it = dirTimes.begin(); it != dirTimes.end(); ++it)
+    unix::utime(it->first.c_str(), &it->second);
+
+  return ok;
 }
 
 void RenameOp::undo() {
@@ -246,7 +578,8 @@ void RenameOp::undo() {
 
     unix::rename(it->newCName.c_str(), it->oldCName.c_str());
     try {
-      dn->renameNode(it->newPName.c_str(), it->oldPName.c_str(), false);
+      if (needsNode(it->newPName.c_str()))
+        dn->renameNode(it->newPName.c_str(), it->oldPName.c_str(), false);
     } catch (encfs::Error &err) {
       RLOG(WARNING) << err.what();
       // continue on anyway...
@@ -257,23 +590,263 @@ void RenameOp::undo() {
   RLOG(WARNING) << "Undo rename count: " << undoCount;
 }
 
-DirNode::DirNode(EncFS_Context *_ctx, const string &sourceDir,
-                 const FSConfigPtr &_config) {
-  pthread_mutex_init(&mutex, 0);
+// number of encrypted paths kept per DirNode
+static const int PathCacheSize = 4096;
+
+PathCache::PathCache(int capacity) {
+  shardCapacity = (capacity + NumShards - 1) / NumShards;
+  for (int i = 0; i < NumShards; ++i) {
+    pthread_mutex_init(&shards[i].mutex, 0);
+    shards[i].hits = 0;
+    shards[i].misses = 0;
+  }
+}
+
+PathCache::~PathCache() {
+  for (int i = 0; i < NumShards; ++i) {
+    shards[i].entries.clear();
+    pthread_mutex_destroy(&shards[i].mutex);
+  }
+}
 
-  Lock _lock(mutex);
+// FNV-1a
+uint64_t PathCache::hashPath(const char *path) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)path; *p; ++p) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool PathCache::lookup(const char *plainPath, std::string *cipherPath,
+                       uint64_t *iv, bool *haveIV) {
+  uint64_t hash = hashPath(plainPath);
+  Shard &shard = shards[(hash >> 56) % NumShards];
+  Lock lock(shard.mutex);
+
+  const Entry *entry = find(shard, hash, plainPath);
+  if (!entry) return false;
+
+  *cipherPath = entry->cipherPath;
+  *iv = entry->iv;
+  *haveIV = entry->haveIV;
+  return true;
+}
+
+int PathCache::lookup(const char *plainPath, char *buf, int bufLen) {
+  uint64_t hash = hashPath(plainPath);
+  Shard &shard = shards[(hash >> 56) % NumShards];
+  Lock lock(shard.mutex);
+
+  const Entry *entry = find(shard, hash, plainPath);
+  if (!entry) return -1;
+
+  int len = entry->cipherPath.length();
+  if (len >= bufLen) return -2;
+  memcpy(buf, entry->cipherPath.c_str(), len + 1);
+  return len;
+}
+
+const PathCache::Entry *PathCache::find(Shard &shard, uint64_t hash,
+                                        const char *plainPath) {
+  auto range = shard.entries.equal_range((size_t)hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.plainPath == plainPath) {
+      ++shard.hits;
+      return &it->second;
+    }
+  }
+
+  ++shard.misses;
+  return NULL;
+}
+
+void PathCache::insert(const char *plainPath, const std::string &cipherPath,
+                       uint64_t iv, bool haveIV) {
+  uint64_t hash = hashPath(plainPath);
+  Shard &shard = shards[(hash >> 56) % NumShards];
+  Lock lock(shard.mutex);
+
+  auto range = shard.entries.equal_range((size_t)hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.plainPath == plainPath) {
+      it->second.cipherPath = cipherPath;
+      it->second.iv = iv;
+      it->second.haveIV = haveIV;
+      return;
+    }
+  }
+
+  // full, make room by dropping an arbitrary entry
+  if (shard.entries.size() >= shardCapacity)
+    shard.entries.erase(shard.entries.begin());
+
+  Entry entry;
+  entry.plainPath = plainPath;
+  entry.cipherPath = cipherPath;
+  entry.iv = iv;
+  entry.haveIV = haveIV;
+  shard.entries.emplace((size_t)hash, std::move(entry));
+}
+
+void PathCache::invalidate(const char *plainPath) {
+  size_t len = strlen(plainPath);
+  // "/dir/" drops the same entries as "/dir"
+  while (len > 1 && plainPath[len - 1] == '/') --len;
+
+  for (int i = 0; i < NumShards; ++i) {
+    Lock lock(shards[i].mutex);
+
+    EntryMap &entries = shards[i].entries;
+    for (auto it = entries.begin(); it != entries.end();) {
+      const string &path = it->second.plainPath;
+      bool below = path.compare(0, len, plainPath, len) == 0 &&
+                   (path.length() == len || path[len] == '/' || len == 1);
+      if (below)
+        it = entries.erase(it);
+      else
+        ++it;
+    }
+  }
+}
+
+PathCache::Stats PathCache::stats() const {
+  Stats st = {0, 0, 0};
+  for (int i = 0; i < NumShards; ++i) {
+    Lock lock(shards[i].mutex);
+    st.hits += shards[i].hits;
+    st.misses += shards[i].misses;
+    st.entries += shards[i].entries.size();
+  }
+  return st;
+}
+
+DirNode::DirNode(EncFS_Context *_ctx, const string &sourceDir,
+                 const FSConfigPtr &_config)
+    : pathCache(PathCacheSize) {
+  for (int i = 0; i < NumStripes; ++i) pthread_mutex_init(&stripes[i], 0);
+  pthread_mutex_init(&dirNamesMutex, 0);
+  dirNamesUse = 0;
 
   ctx = _ctx;
   rootDir = sourceDir;  // .. and fsConfig->opts->mountPoint have trailing slash
   fsConfig = _config;
 
   naming = fsConfig->nameCoding;
+  // the IVs are only used for chaining
+  directoryIVs = fsConfig->config && fsConfig->config->directoryIV && naming &&
+                 naming->getChainedNameIV();
+
+  if (fsConfig->opts && !fsConfig->opts->readOnly) resumeRename();
 }
 
-DirNode::~DirNode() {}
+/*
+    A journal left in the root means a recursive rename was interrupted.
+    The renames are replayed in order, skipping those which were already
+    made, which also finishes a rename that was being undone.  A journal
+    without its trailer was never complete, and nothing was renamed yet.
+
+    The journal only goes once every rename is made.  If one fails, or file
+    headers depend on their path (external IV chaining, where a replay would
+    need to rewrite headers the journal knows nothing about), it is left for
+    the user to resolve.
+*/
+void DirNode::resumeRename() {
+  string journal = rootDir + RenameJournalName;
+  struct stat_st st;
+  if (unix::stat(journal.c_str(), &st) != 0) return;
+
+  int flags = O_RDONLY;
+#ifdef O_BINARY
+  flags |= O_BINARY;
+#endif
+  int fd = unix::open(journal.c_str(), flags);
+  if (fd < 0) {
+    RLOG(ERROR) << "unable to read rename journal " << journal;
+    return;
+  }
+  string data(st.st_size, '\0');
+  ssize_t got = unix::pread(fd, &data[0], data.size(), 0);
+  unix::close(fd);
+  if (got != (ssize_t)data.size()) {
+    RLOG(ERROR) << "unable to read rename journal " << journal;
+    return;
+  }
+
+  std::vector<std::pair<string, string> > renames;
+  bool complete = false;
+  size_t pos = 0;
+  bool first = true;
+  while (pos < data.size()) {
+    size_t end = data.find('\n', pos);
+    if (end == string::npos) break;
+    string line = data.substr(pos, end - pos);
+    pos = end + 1;
+
+    if (first) {
+      first = false;
+      if (line != RenameJournalHeader) break;
+      continue;
+    }
+    if (line == RenameJournalTrailer) {
+      complete = true;
+      break;
+    }
+    size_t tab = line.find('\t');
+    if (tab == string::npos) break;
+    renames.push_back(std::make_pair(rootDir + line.substr(0, tab),
+                                     rootDir + line.substr(tab + 1)));
+  }
+
+  if (complete && fsConfig->config && fsConfig->config->externalIVChaining) {
+    RLOG(ERROR) << "a rename was interrupted, but file headers depend on "
+                   "their path so it can't be finished automatically.  "
+                   "The renames left to make are listed in "
+                << journal;
+    return;
+  }
+
+  if (complete) {
+    RLOG(WARNING) << "finishing interrupted rename of " << renames.size()
+                  << " entries";
+    size_t done = 0;
+    for (size_t i = 0; i < renames.size(); ++i) {
+      const char *from = renames[i].first.c_str();
+      if (unix::stat(from, &st) != 0) continue;  // already renamed
+      if (unix::rename(from, renames[i].second.c_str()) != 0) {
+        RLOG(ERROR) << "unable to rename " << from << ": " << strerror(errno)
+                    << ", the rest of the interrupted rename is left in "
+                    << journal;
+        return;
+      }
+      if (++done % 10000 == 0)
+        RLOG(INFO) << "recursive rename: " << i + 1 << " of "
+                   << renames.size();
+    }
+  }
+
+  unix::unlink(journal.c_str());
+}
+
+DirNode::~DirNode() {
+  dirNames.clear();
+  pthread_mutex_destroy(&dirNamesMutex);
+  for (int i = 0; i < NumStripes; ++i) pthread_mutex_destroy(&stripes[i]);
+}
+
+// FNV-1a of the plaintext path
+uint64_t DirNode::stripeMask(const char *plaintextPath) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)plaintextPath; *p; ++p) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return (uint64_t)1 << (hash % NumStripes);
+}
 
 bool DirNode::hasDirectoryNameDependency() const {
-  return naming ? naming->getChainedNameIV() : false;
+  return naming ? naming->getChainedNameIV() && !directoryIVs : false;
 }
 
 string DirNode::rootDirectory() {
@@ -314,15 +887,186 @@ bool DirNode::touchesMountpoint(const char *realPath) const {
  * $ touch foobar
  * cipherPath: /foobar encoded to cipher/NKAKsn2APtmquuKPoF4QRPxS
  */
+
+// the coded form of dir + '/' + name, given the coded dir
+static string joinCipherPath(const string &cipherDir, const string &name) {
+  // coding never starts a path with '/'
+  if (cipherDir.empty()) return name;
+  return cipherDir + '/' + name;
+}
+
+/*
+    A miss only codes the final component, starting from the cipher path and
+    chained IV of the parent directory, which is looked up (or coded) the
+    same way.  Operations within one directory then share its prefix.
+*/
+string DirNode::encodePath(const char *plaintextPath, uint64_t *iv) {
+  string cyName;
+  uint64_t pathIV = 0;
+  bool haveIV = true;
+  if (!pathCache.lookup(plaintextPath, &cyName, &pathIV, &haveIV))
+    return encodeUncached(plaintextPath, iv);
+
+  if (iv && !haveIV) {
+    // first coded as a leaf, now used as a directory
+    pathIV = directoryIV(rootDir + cyName);
+    pathCache.insert(plaintextPath, cyName, pathIV);
+  }
+  if (iv) *iv = pathIV;
+  return cyName;
+}
+
+string DirNode::encodeUncached(const char *plaintextPath, uint64_t *iv) {
+  string cyName;
+  uint64_t pathIV = 0;
+  const char *last = strrchr(plaintextPath, '/');
+  if (last && last != plaintextPath && last[1] != '\0') {
+    string parent(plaintextPath, last - plaintextPath);
+    cyName = encodePath(parent.c_str(), &pathIV);
+
+    char leaf[PathBufferSize];
+    if (naming->encodePath(last + 1, &pathIV, leaf, sizeof(leaf)) >= 0)
+      cyName = joinCipherPath(cyName, leaf);
+    else
+      cyName = joinCipherPath(cyName, naming->encodePath(last + 1, &pathIV));
+  } else {
+    cyName = naming->encodePath(plaintextPath, &pathIV);
+  }
+
+  // what's below this path is chained from its own IV instead, which is
+  // only read once the path is used as a directory
+  bool haveIV = true;
+  if (directoryIVs) {
+    haveIV = iv != NULL;
+    pathIV = haveIV ? directoryIV(rootDir + cyName) : 0;
+  }
+  pathCache.insert(plaintextPath, cyName, pathIV, haveIV);
+
+  if (iv) *iv = pathIV;
+  return cyName;
+}
+
+// the IV file of a backing directory, which may end in '/' (the root)
+static string directoryIVFile(const string &cipherDir) {
+  if (!cipherDir.empty() && cipherDir[cipherDir.length() - 1] == '/')
+    return cipherDir + DirectoryIVName;
+  return cipherDir + '/' + DirectoryIVName;
+}
+
+uint64_t DirNode::directoryIV(const string &cipherDir) {
+  string ivFile = directoryIVFile(cipherDir);
+  int flags = O_RDONLY;
+#ifdef O_BINARY
+  flags |= O_BINARY;
+#endif
+  // fails for files, and for directories created without an IV
+  int fd = unix::open(ivFile.c_str(), flags);
+  if (fd < 0) return 0;
+
+  unsigned char buf[8] = {0};
+  ssize_t got = unix::pread(fd, buf, sizeof(buf), 0);
+  unix::close(fd);
+  if (got != (ssize_t)sizeof(buf)) {
+    RLOG(ERROR) << "unable to read directory IV " << ivFile;
+    return 0;
+  }
+
+  fsConfig->cipher->streamDecode(buf, sizeof(buf), 0, fsConfig->key);
+  uint64_t iv = 0;
+  for (int i = 0; i < 8; ++i) iv = (iv << 8) | (uint64_t)buf[i];
+  return iv;
+}
+
+bool DirNode::writeDirectoryIV(const string &cipherDir, uint64_t iv) {
+  unsigned char buf[8] = {0};
+  while (iv == 0) {  // 0 means no IV
+    if (!fsConfig->cipher->randomize(buf, sizeof(buf), false)) {
+      RLOG(ERROR) << "unable to generate a random directory IV";
+      return false;
+    }
+    for (int i = 0; i < 8; ++i) iv = (iv << 8) | (uint64_t)buf[i];
+  }
+  for (int i = 7; i >= 0; --i) {
+    buf[i] = (unsigned char)(iv & 0xff);
+    iv >>= 8;
+  }
+  fsConfig->cipher->streamEncode(buf, sizeof(buf), 0, fsConfig->key);
+
+  string ivFile = directoryIVFile(cipherDir);
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_BINARY
+  flags |= O_BINARY;
+#endif
+  int fd = unix::open(ivFile.c_str(), flags, 0644);
+  if (fd < 0) {
+    RLOG(WARNING) << "unable to create directory IV " << ivFile << ": "
+                  << strerror(errno);
+    return false;
+  }
+  bool ok = unix::pwrite(fd, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf);
+  ok = ok && unix::fsync(fd) == 0;
+  unix::close(fd);
+
+  if (!ok) {
+    RLOG(WARNING) << "unable to write directory IV " << ivFile;
+    unix::unlink(ivFile.c_str());
+  }
+  return ok;
+}
+
+int DirNode::rmdirWithIV(const string &cipherDir) {
+  // the IV file only goes if nothing else is left
+  unix::DIR *dir = unix::opendir(cipherDir.c_str());
+  if (dir == NULL) return -errno;
+  {
+    std::shared_ptr<unix::DIR> dp(dir, DirDeleter());
+    struct unix::dirent *de;
+    while ((de = unix::readdir(dir)) != NULL) {
+      if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
+          strcmp(de->d_name, DirectoryIVName) != 0)
+        return -ENOTEMPTY;
+    }
+  }
+
+  uint64_t iv = directoryIV(cipherDir);
+  string ivFile = directoryIVFile(cipherDir);
+  if (unix::unlink(ivFile.c_str()) != 0 && errno != ENOENT) return -errno;
+  if (unix::rmdir(cipherDir.c_str()) == 0) return 0;
+
+  // something was created in the meantime, put the IV back
+  int eno = errno;
+  if (iv != 0) writeDirectoryIV(cipherDir, iv);
+  return -eno;
+}
+
+PathCache::Stats DirNode::pathCacheStats() const { return pathCache.stats(); }
+
 string DirNode::cipherPath(const char *plaintextPath) {
-  return rootDir + naming->encodePath(plaintextPath);
+  return rootDir + encodePath(plaintextPath);
+}
+
+int DirNode::cipherPath(const char *plaintextPath, char *buf, int bufLen) {
+  int rootLen = rootDir.length();
+  if (rootLen >= bufLen) return -1;
+  memcpy(buf, rootDir.c_str(), rootLen);
+
+  int len = pathCache.lookup(plaintextPath, buf + rootLen, bufLen - rootLen);
+  if (len == -2) return -1;
+  if (len < 0) {
+    string cyName = encodeUncached(plaintextPath, NULL);
+    len = cyName.length();
+    if (rootLen + len >= bufLen) return -1;
+    memcpy(buf + rootLen, cyName.c_str(), len + 1);
+  }
+
+  return rootLen + len;
 }
 
 /**
  * Same as cipherPath(), but does not prefix the ciphertext root directory
  */
 string DirNode::cipherPathWithoutRoot(const char *plaintextPath) {
-  return naming->encodePath(plaintextPath);
+  return encodePath(plaintextPath);
 }
 
 /**
@@ -345,6 +1089,7 @@ string DirNode::plainPath(const char *cipherPath_) {
     }
 
     // Default.
+    if (directoryIVs) return decodeWithDirectoryIVs(cipherPath_);
     return naming->decodePath(cipherPath_);
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "decode err: " << err.what();
@@ -352,6 +1097,101 @@ string DirNode::plainPath(const char *cipherPath_) {
   }
 }
 
+string DirNode::decodeWithDirectoryIVs(const char *cipherPath_) {
+  string plain;
+  string cipherDir;
+  for (const char *p = cipherPath_; *p;) {
+    if (*p == '/') {
+      plain += '/';
+      if (!cipherDir.empty()) cipherDir += '/';
+      ++p;
+      continue;
+    }
+
+    const char *end = strchr(p, '/');
+    if (end == NULL) end = p + strlen(p);
+    string name(p, end - p);
+
+    // the names in a directory are chained from its IV
+    uint64_t iv = directoryIV(rootDir + cipherDir);
+    plain += naming->decodePath(name.c_str(), &iv);
+    cipherDir += name;
+    p = end;
+  }
+  return plain;
+}
+
+string DirNode::encodeWithDirectoryIVs(const char *plaintextPath) {
+  string cipherDir;
+  for (const char *p = plaintextPath; *p;) {
+    if (*p == '/') {
+      // coding never starts a path with '/'
+      if (!cipherDir.empty()) cipherDir += '/';
+      ++p;
+      continue;
+    }
+
+    const char *end = strchr(p, '/');
+    if (end == NULL) end = p + strlen(p);
+    string name(p, end - p);
+
+    // the same IV lookup as encodeUncached
+    uint64_t iv = directoryIV(rootDir + cipherDir);
+    cipherDir += naming->encodePath(name.c_str(), &iv);
+    p = end;
+  }
+  return cipherDir;
+}
+
+void DirNode::backingChanged(const char *cipherPath_, bool removed) {
+  // plainPath takes a leading '/' as a special path in reverse mode
+  while (*cipherPath_ == '/') ++cipherPath_;
+
+  const char *leaf = strrchr(cipherPath_, '/');
+  leaf = leaf ? leaf + 1 : cipherPath_;
+  if (strcmp(leaf, ".encfs6.xml") == 0 || strcmp(leaf, RenameJournalName) == 0)
+    return;
+
+  string changed(cipherPath_);
+  if (strcmp(leaf, DirectoryIVName) == 0) {
+    // the names of the whole directory depend on it
+    changed.assign(cipherPath_, leaf - cipherPath_);
+    removed = true;
+  }
+  while (!changed.empty() && changed[changed.length() - 1] == '/')
+    changed.erase(changed.length() - 1);
+
+  string plain = "/";
+  if (!changed.empty()) {
+    string decoded = plainPath(changed.c_str());
+    if (decoded.empty()) {
+      removed = true;
+    } else if (decoded[0] == '/') {
+      plain = decoded;
+    } else {
+      plain += decoded;
+    }
+  }
+  VLOG(1) << "backing store changed: " << changed;
+
+  // encoded paths only change along with directory IVs, including ones
+  // which were looked up before their directory existed
+  if (directoryIVs) pathCache.invalidate(plain.c_str());
+  if (ctx != NULL) {
+    if (removed)
+      ctx->attrCache.invalidateTree(plain.c_str());
+    else
+      ctx->attrCache.invalidate(plain.c_str());
+
+    // files below a directory which went away keep their old change tokens,
+    // whatever shows up in their place is seen as a change of its own
+    if (removed && plain == "/")
+      ctx->forgetClosedFiles();
+    else
+      ctx->fileChanged(plain.c_str());
+  }
+}
+
 string DirNode::relativeCipherPath(const char *plaintextPath) {
   try {
     // use '+' prefix to indicate special decoding.
@@ -361,6 +1201,7 @@ string DirNode::relativeCipherPath(const char *plaintextPath) {
              naming->encodeName(plaintextPath + 1, strlen(plaintextPath + 1));
     }
 
+    if (directoryIVs) return encodeWithDirectoryIVs(plaintextPath);
     return naming->encodePath(plaintextPath);
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "encode err: " << err.what();
@@ -369,35 +1210,82 @@ string DirNode::relativeCipherPath(const char *plaintextPath) {
 }
 
 DirTraverse DirNode::openDir(const char *plaintextPath) {
-  string cyName = rootDir + naming->encodePath(plaintextPath);
+  // in chained IV mode this is also the IV at this directory level, which
+  // comes out of the same (cached) encoding
+  uint64_t iv = 0;
+  string cyName = rootDir + encodePath(plaintextPath, &iv);
 
   unix::DIR *dir = unix::opendir(cyName.c_str());
   if (dir == NULL) {
     int eno = errno;
     VLOG(1) << "opendir error " << strerror(eno);
+    errno = eno;  // for the caller
     return DirTraverse(shared_ptr<unix::DIR>(), 0, std::shared_ptr<NameIO>(), false);
   } else {
     std::shared_ptr<unix::DIR> dp(dir, DirDeleter());
 
-    uint64_t iv = 0;
-    // if we're using chained IV mode, then compute the IV at this
-    // directory level..
-    try {
-      if (naming->getChainedNameIV()) naming->encodePath(plaintextPath, &iv);
-    } catch (encfs::Error &err) {
-      RLOG(ERROR) << "encode err: " << err.what();
+    return DirTraverse(dp, iv, naming, (strlen(plaintextPath) == 1),
+                       decodedNames(cyName, iv), fsConfig);
+  }
+}
+
+/*
+    Any change to the entries of a directory updates its modification time,
+    so names decoded while the times are unchanged can be reused.  Decoding
+    only depends on the name and the directory IV, so a change which lands
+    within the timestamp resolution can't produce wrong names, it only
+    leaves stale ones behind until the next change.
+*/
+std::shared_ptr<DecodedNames> DirNode::decodedNames(const string &cipherDir,
+                                                    uint64_t iv) {
+  struct stat_st st;
+  if (unix::stat(cipherDir.c_str(), &st) != 0)
+    return std::shared_ptr<DecodedNames>();
+
+#ifdef USE_LEGACY_DOKAN
+  int64_t mtime = st.st_mtime;
+  int64_t ctime = st.st_ctime;
+#else
+  int64_t mtime = st.st_mtim.tv_sec;
+  int64_t ctime = st.st_ctim.tv_sec;
+#endif
+
+  Lock _lock(dirNamesMutex);
+
+  std::shared_ptr<DecodedNames> &names = dirNames[cipherDir];
+  if (!names || !names->matches(iv, mtime, ctime)) {
+    names.reset(new DecodedNames(iv, mtime, ctime));
+
+    // drop the least recently listed directory
+    if (dirNames.size() > MaxCachedDirs) {
+      auto oldest = dirNames.end();
+      for (auto it = dirNames.begin(); it != dirNames.end(); ++it) {
+        if (it->second != names &&
+            (oldest == dirNames.end() ||
+             it->second->lastUse < oldest->second->lastUse))
+          oldest = it;
+      }
+      dirNames.erase(oldest);
     }
-    return DirTraverse(dp, iv, naming, (strlen(plaintextPath) == 1));
   }
+  names->lastUse = ++dirNamesUse;
+
+  return names;
 }
 
-bool DirNode::genRenameList(list<RenameEl> &renameList, const char *fromP,
-                            const char *toP) {
+/*
+    Scans one directory of a recursive rename.  Entries are renamed within
+    the old directory, so the subdirectories are queued for scanning and
+    their contents renamed before the subdirectory itself.
+*/
+bool DirNode::scanRenameDir(RenameDir *rd) {
+  const char *fromP = rd->fromP.c_str();
+  const char *toP = rd->toP.c_str();
   uint64_t fromIV = 0, toIV = 0;
 
   // compute the IV for both paths
-  string fromCPart = naming->encodePath(fromP, &fromIV);
-  string toCPart = naming->encodePath(toP, &toIV);
+  string fromCPart = encodePath(fromP, &fromIV);
+  string toCPart = encodePath(toP, &toIV);
 
   // where the files live before the rename..
   string sourcePath = rootDir + fromCPart;
@@ -460,17 +1348,19 @@ bool DirNode::genRenameList(list<RenameEl> &renameList, const char *fromP,
       ren.isDirectory = isDir;
 
       if (isDir) {
-        // recurse..  We want to add subdirectory elements before the
-        // parent, as that is the logical rename order..
-        if (!genRenameList(renameList, ren.oldPName.c_str(),
-                           ren.newPName.c_str())) {
-          return false;
-        }
+        // the scan of the subdirectory encodes the new path again,
+        // starting from this entry
+        pathCache.insert(ren.newPName.c_str(), joinCipherPath(toCPart, newName),
+                         localIV);
+
+        std::unique_ptr<RenameDir> child(new RenameDir);
+        child->fromP = ren.oldPName;
+        child->toP = ren.newPName;
+        child->self = ren;
+        rd->subdirs.push_back(std::move(child));
+      } else {
+        rd->entries.push_back(ren);
       }
-
-      VLOG(1) << "adding file " << oldFull << " to rename list";
-
-      renameList.push_back(ren);
     } catch (encfs::Error &err) {
       // We can't convert this name, because we don't have a valid IV for
       // it (or perhaps a valid key).. It will be inaccessible..
@@ -487,6 +1377,114 @@ bool DirNode::genRenameList(list<RenameEl> &renameList, const char *fromP,
   return true;
 }
 
+namespace {
+// name coding serializes on the cipher key, so more scanners than this
+// mostly wait
+const unsigned int MaxRenameScanners = 8;
+
+/*
+    Directories of a recursive rename are scanned by a few threads, each
+    taking the next queued directory and queueing its subdirectories.
+*/
+class RenameScan {
+ public:
+  RenameScan(DirNode *dn, bool (DirNode::*scan)(RenameDir *))
+      : dn(dn), scan(scan), busy(0), scanned(0), failed(false) {
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&cond, 0);
+  }
+  ~RenameScan() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  bool run(RenameDir *top) {
+    queue.push_back(top);
+
+    unsigned int threads = std::thread::hardware_concurrency();
+    if (threads > MaxRenameScanners) threads = MaxRenameScanners;
+    std::vector<pthread_t> workers(threads);
+    std::vector<bool> started(threads, false);
+    for (unsigned int t = 1; t < threads; ++t)
+      started[t] = pthread_create(&workers[t], 0, worker, this) == 0;
+    work();
+    for (unsigned int t = 1; t < threads; ++t)
+      if (started[t]) pthread_join(workers[t], 0);
+
+    return !failed;
+  }
+
+ private:
+  static void *worker(void *arg) {
+    ((RenameScan *)arg)->work();
+    return 0;
+  }
+
+  void work() {
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+      while (queue.empty() && busy > 0 && !failed)
+        pthread_cond_wait(&cond, &mutex);
+      if (failed || queue.empty()) break;
+
+      RenameDir *rd = queue.front();
+      queue.pop_front();
+      ++busy;
+      pthread_mutex_unlock(&mutex);
+
+      bool ok = false;
+      try {
+        ok = (dn->*scan)(rd);
+      } catch (encfs::Error &err) {
+        RLOG(WARNING) << "rename scan of " << rd->fromP << ": " << err.what();
+      }
+
+      pthread_mutex_lock(&mutex);
+      --busy;
+      if (!ok) failed = true;
+      for (auto &child : rd->subdirs) queue.push_back(child.get());
+      if (++scanned % 1000 == 0)
+        RLOG(INFO) << "recursive rename: scanned " << scanned
+                   << " directories";
+      pthread_cond_broadcast(&cond);
+    }
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  DirNode *dn;
+  bool (DirNode::*scan)(RenameDir *);
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::deque<RenameDir *> queue;
+  int busy;
+  int scanned;
+  bool failed;
+};
+
+// contents of each directory come before the directory itself
+void flattenRenameDir(RenameDir *rd, list<RenameEl> &renameList) {
+  for (auto &child : rd->subdirs) {
+    flattenRenameDir(child.get(), renameList);
+    renameList.push_back(child->self);
+  }
+  renameList.splice(renameList.end(), rd->entries);
+}
+}  // namespace
+
+bool DirNode::genRenameList(list<RenameEl> &renameList, const char *fromP,
+                            const char *toP) {
+  RenameDir top;
+  top.fromP = fromP;
+  top.toP = toP;
+
+  RenameScan scan(this, &DirNode::scanRenameDir);
+  if (!scan.run(&top)) return false;
+
+  flattenRenameDir(&top, renameList);
+  return true;
+}
+
 /*
     A bit of a pain.. If a directory is renamed in a filesystem with
     directory initialization vector chaining, then we have to recursively
@@ -508,7 +1506,7 @@ bool DirNode::genRenameList(list<RenameEl> &renameList, const char *fromP,
 
 int DirNode::mkdir(const char *plaintextPath, mode_t mode, uid_t uid,
                    gid_t gid) {
-  string cyName = rootDir + naming->encodePath(plaintextPath);
+  string cyName = rootDir + encodePath(plaintextPath);
   rAssert(!cyName.empty());
 
   VLOG(1) << "mkdir on " << cyName;
@@ -533,31 +1531,46 @@ int DirNode::mkdir(const char *plaintextPath, mode_t mode, uid_t uid,
     RLOG(WARNING) << "mkdir error on " << cyName << " mode " << mode << ": "
                   << strerror(eno);
     res = -eno;
+  } else if (directoryIVs && !writeDirectoryIV(cyName, 0)) {
+    unix::rmdir(cyName.c_str());
+    res = -EIO;
   } else
     res = 0;
 
+  // a lookup before the mkdir cached the path without the new IV
+  if (directoryIVs) pathCache.invalidate(plaintextPath);
+
   return res;
 }
 
 int DirNode::rename(const char *fromPlaintext, const char *toPlaintext) {
-  Lock _lock(mutex);
-
-  string fromCName = rootDir + naming->encodePath(fromPlaintext);
-  string toCName = rootDir + naming->encodePath(toPlaintext);
+  string fromCName = rootDir + encodePath(fromPlaintext);
+  string toCName = rootDir + encodePath(toPlaintext);
   rAssert(!fromCName.empty());
   rAssert(!toCName.empty());
 
+  // renaming a directory with chained names renames everything below it
+  bool recursive =
+      hasDirectoryNameDependency() && isDirectory(fromCName.c_str());
+  uint64_t mask = stripeMask(fromPlaintext) | stripeMask(toPlaintext);
+  if (recursive) mask = ~(uint64_t)0 >> (64 - NumStripes);
+  StripeLock _lock(stripes, mask);
+
   VLOG(1) << "rename " << fromCName << " -> " << toCName;
 
   std::shared_ptr<FileNode> toNode = findOrCreate(toPlaintext);
 
   std::shared_ptr<RenameOp> renameOp;
-  if (hasDirectoryNameDependency() && isDirectory(fromCName.c_str())) {
+  if (recursive) {
     VLOG(1) << "recursive rename begin";
     renameOp = newRenameOp(fromPlaintext, toPlaintext);
 
-    if (!renameOp || !renameOp->apply()) {
-      if (renameOp) renameOp->undo();
+    if (!renameOp || !renameOp->writeJournal(fromCName, toCName) ||
+        !renameOp->apply()) {
+      if (renameOp) {
+        renameOp->undo();
+        renameOp->removeJournal();
+      }
 
       RLOG(WARNING) << "rename aborted";
       return -EACCES;
@@ -598,6 +1611,13 @@ int DirNode::rename(const char *fromPlaintext, const char *toPlaintext) {
     res = -EIO;
   }
 
+  // renamed or undone, either way nothing is left to resume
+  if (renameOp) renameOp->removeJournal();
+
+  // cached encodings below either name are no longer wanted
+  pathCache.invalidate(fromPlaintext);
+  pathCache.invalidate(toPlaintext);
+
   if (res != 0) {
     VLOG(1) << "rename failed: " << strerror(errno);
     res = -errno;
@@ -607,10 +1627,10 @@ int DirNode::rename(const char *fromPlaintext, const char *toPlaintext) {
 }
 
 int DirNode::link(const char *from, const char *to) {
-  Lock _lock(mutex);
+  StripeLock _lock(stripes, stripeMask(from) | stripeMask(to));
 
-  string fromCName = rootDir + naming->encodePath(from);
-  string toCName = rootDir + naming->encodePath(to);
+  string fromCName = rootDir + encodePath(from);
+  string toCName = rootDir + encodePath(to);
 
   rAssert(!fromCName.empty());
   rAssert(!toCName.empty());
@@ -647,7 +1667,7 @@ std::shared_ptr<FileNode> DirNode::renameNode(const char *from, const char *to,
 
   if (node) {
     uint64_t newIV = 0;
-    string cname = rootDir + naming->encodePath(to, &newIV);
+    string cname = rootDir + encodePath(to, &newIV);
 
     VLOG(1) << "renaming internal node " << node->cipherName() << " -> "
             << cname;
@@ -667,12 +1687,14 @@ std::shared_ptr<FileNode> DirNode::findOrCreate(const char *plainName) {
   std::shared_ptr<FileNode> node;
   if (ctx) node = ctx->lookupNode(plainName);
   if (!node) {
+    // the IV of the path is only used by external IV chaining
+    bool externalIV = fsConfig->config->externalIVChaining;
     uint64_t iv = 0;
-    string cipherName = naming->encodePath(plainName, &iv);
+    string cipherName = encodePath(plainName, externalIV ? &iv : NULL);
     node.reset(new FileNode(this, fsConfig, plainName,
                             (rootDir + cipherName).c_str()));
 
-    if (fsConfig->config->externalIVChaining) node->setName(0, 0, iv);
+    if (externalIV) node->setName(0, 0, iv);
 
     VLOG(1) << "created FileNode for " << node->cipherName();
   }
@@ -682,10 +1704,35 @@ std::shared_ptr<FileNode> DirNode::findOrCreate(const char *plainName) {
 
 shared_ptr<FileNode> DirNode::lookupNode(const char *plainName,
                                          const char * /* requestor */) {
-  Lock _lock(mutex);
+  StripeLock _lock(stripes, stripeMask(plainName));
   return findOrCreate(plainName);
 }
 
+int DirNode::getAttr(const char *plaintextPath, struct stat_st *stbuf) {
+  StripeLock _lock(stripes, stripeMask(plaintextPath));
+
+  std::shared_ptr<FileNode> node;
+  if (ctx) node = ctx->lookupNode(plaintextPath);
+  if (node) return node->getAttr(stbuf);
+
+  char buf[PathBufferSize];
+  string longName;
+  const char *cyName = buf;
+  if (cipherPath(plaintextPath, buf, sizeof(buf)) < 0) {
+    longName = cipherPath(plaintextPath);
+    cyName = longName.c_str();
+  }
+  VLOG(1) << "getattr " << cyName;
+
+  // check that we're not recursing into the mount point itself
+  if (touchesMountpoint(cyName)) {
+    VLOG(1) << "getattr error: Tried to touch mountpoint: '" << cyName << "'";
+    return -EIO;
+  }
+
+  return FileNode::getAttr(fsConfig, cyName, stbuf);
+}
+
 /*
     Similar to lookupNode, except that we also call open() and only return a
     node on sucess..  This is done in one step to avoid any race conditions
@@ -695,7 +1742,7 @@ shared_ptr<FileNode> DirNode::lookupNode(const char *plainName,
                                                int *result) {
   (void)requestor;
   rAssert(result != NULL);
-  Lock _lock(mutex);
+  StripeLock _lock(stripes, stripeMask(plainName));
 
   std::shared_ptr<FileNode> node = findOrCreate(plainName);
 
@@ -706,10 +1753,10 @@ shared_ptr<FileNode> DirNode::lookupNode(const char *plainName,
 }
 
 int DirNode::unlink(const char *plaintextName) {
-  string cyName = naming->encodePath(plaintextName);
+  string cyName = encodePath(plaintextName);
   VLOG(1) << "unlink " << cyName;
 
-  Lock _lock(mutex);
+  StripeLock _lock(stripes, stripeMask(plaintextName));
 
   int res = 0;
 #if 0
@@ -735,4 +1782,24 @@ int DirNode::unlink(const char *plaintextName) {
   return res;
 }
 
+int DirNode::rmdir(const char *plaintextPath) {
+  string cyName = rootDir + encodePath(plaintextPath);
+  VLOG(1) << "rmdir " << cyName;
+
+  StripeLock _lock(stripes, stripeMask(plaintextPath));
+
+  int res = 0;
+  if (directoryIVs)
+    res = rmdirWithIV(cyName);
+  else if (unix::rmdir(cyName.c_str()) == -1)
+    res = -errno;
+  if (res != 0) {
+    VLOG(1) << "rmdir error: " << strerror(-res);
+  } else {
+    pathCache.invalidate(plaintextPath);
+  }
+
+  return res;
+}
+
 }  // namespace encfs
@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <string>
 #include <sys/types.h>
+#include <unordered_map>
 #include <vector>
 
 #include "CipherKey.h"
@@ -44,12 +45,44 @@ class EncFS_Context;
 class FileNode;
 class NameIO;
 class RenameOp;
+struct RenameDir;
 struct RenameEl;
 
+/*
+    Decoded names of one backing directory, ciphertext name -> plaintext
+    name (empty for names which don't decode).  Only valid for the
+    directory IV and modification times it was created with.
+*/
+class DecodedNames {
+ public:
+  DecodedNames(uint64_t iv, int64_t mtime, int64_t ctime);
+  ~DecodedNames();
+
+  bool matches(uint64_t iv, int64_t mtime, int64_t ctime) const;
+
+  bool lookup(const char *cipherName, std::string *plainName) const;
+  void insert(const char *cipherName, const std::string &plainName);
+
+  uint64_t lastUse;
+
+ private:
+  DecodedNames(const DecodedNames &src);             // not allowed
+  DecodedNames &operator=(const DecodedNames &src);  // not allowed
+
+  mutable pthread_mutex_t mutex;
+  uint64_t iv;
+  int64_t mtime;
+  int64_t ctime;
+  std::unordered_map<std::string, std::string> names;
+};
+
 class DirTraverse {
  public:
   DirTraverse(const std::shared_ptr<unix::DIR> &dirPtr, uint64_t iv,
-              const std::shared_ptr<NameIO> &naming, bool root);
+              const std::shared_ptr<NameIO> &naming, bool root,
+              const std::shared_ptr<DecodedNames> &decoded =
+                  std::shared_ptr<DecodedNames>(),
+              const FSConfigPtr &config = FSConfigPtr());
   DirTraverse(const DirTraverse &src);
   ~DirTraverse();
 
@@ -64,6 +97,21 @@ class DirTraverse {
   // unknown)
   std::string nextPlaintextName(int *fileType = 0, ino_t *inode = 0);
 
+  /*
+      Same as above, also returning the attributes of the entry as getAttr
+      would (sizes adjusted for the file header and MAC blocks).  They are
+      taken from the backing directory listing, without a lookup of the
+      name.  *fullAttr is false if the listing didn't have them, then only
+      st_ino and the file type in st_mode are set.
+  */
+  std::string nextPlaintextName(struct stat_st *stbuf, bool *fullAttr);
+
+  // number of plaintext names returned so far, used as the readdir offset
+  long long tell() const;
+  // return the last plaintext name again on the next call, when it couldn't
+  // be passed on.  Only valid right after nextPlaintextName().
+  void putBack();
+
   /* Return cipher name of next undecodable filename..
      The opposite of nextPlaintextName(), as that skips undecodable names..
   */
@@ -76,8 +124,87 @@ class DirTraverse {
   uint64_t iv;
   std::shared_ptr<NameIO> naming;
   bool root;
+  // names decoded by earlier traversals, if the directory is cached
+  std::shared_ptr<DecodedNames> decoded;
+  // for the plaintext sizes of attributes
+  FSConfigPtr config;
+
+  // backing entries are read ahead in chunks, so that their names can be
+  // decoded as one batch
+  struct Entry {
+    std::string plainName;  // empty if the name didn't decode
+    int fileType;
+    ino_t inode;
+    bool haveStat;
+    struct stat_st stat;  // of the backing entry
+  };
+  bool readAhead();
+  std::vector<Entry> pending;
+  size_t pendingPos;
+  size_t lastPos;  // of the last name returned
+  long long position;
 };
 inline bool DirTraverse::valid() const { return dir.get() != 0; }
+inline long long DirTraverse::tell() const { return position; }
+
+/*
+    Bounded cache of plaintext path -> (cipher path, chained IV), so that
+    repeated operations on the same path don't re-encrypt every component.
+    Entries are spread over independently locked shards by path hash.  With
+    per-directory IVs, an entry may leave out the IV until the path is used
+    as a directory.
+*/
+class PathCache {
+ public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;
+  };
+
+  explicit PathCache(int capacity);
+  ~PathCache();
+
+  // haveIV is cleared if the entry has no IV yet
+  bool lookup(const char *plainPath, std::string *cipherPath, uint64_t *iv,
+              bool *haveIV);
+  // copies the cipher path into buf, returns its length, -1 on a miss or -2
+  // if it doesn't fit
+  int lookup(const char *plainPath, char *buf, int bufLen);
+  void insert(const char *plainPath, const std::string &cipherPath,
+              uint64_t iv, bool haveIV = true);
+
+  // drop a path and everything below it
+  void invalidate(const char *plainPath);
+
+  Stats stats() const;
+
+ private:
+  struct Entry {
+    std::string plainPath;
+    std::string cipherPath;
+    uint64_t iv;
+    bool haveIV;
+  };
+  typedef std::unordered_multimap<size_t, Entry> EntryMap;
+
+  // counters live in the shards, under the lock lookups take anyway
+  struct Shard {
+    mutable pthread_mutex_t mutex;
+    EntryMap entries;
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  static const int NumShards = 16;
+  static uint64_t hashPath(const char *path);
+  // with the shard locked, counts the hit or miss
+  static const Entry *find(Shard &shard, uint64_t hash,
+                           const char *plainPath);
+
+  Shard shards[NumShards];
+  size_t shardCapacity;
+};
 
 class DirNode {
  public:
@@ -104,7 +231,18 @@ class DirNode {
                                      const char *requestor, int flags,
                                      int *openResult);
 
+  /*
+      Stat a plaintext path.  Open files are asked directly, anything else is
+      answered from the backing file without creating a FileNode.
+  */
+  int getAttr(const char *plaintextPath, struct stat_st *stbuf);
+
   std::string cipherPath(const char *plaintextPath);
+  /*
+      Writes the cipher path into buf and returns its length, or -1 if it
+      doesn't fit.  Cached paths are copied without touching the heap.
+  */
+  int cipherPath(const char *plaintextPath, char *buf, int bufLen);
   std::string cipherPathWithoutRoot(const char *plaintextPath);
   std::string plainPath(const char *cipherPath);
 
@@ -116,13 +254,17 @@ class DirNode {
   /*
       Returns true if file names are dependent on the parent directory name.
       If a directory name is changed, then all the filenames must also be
-      changed.
+      changed.  With per-directory IVs they only depend on the directory
+      itself, and moving it doesn't change them.
   */
   bool hasDirectoryNameDependency() const;
 
   // unlink the specified file
   int unlink(const char *plaintextName);
 
+  // remove the specified (empty) directory
+  int rmdir(const char *plaintextPath);
+
   // traverse directory
   DirTraverse openDir(const char *plainDirName);
 
@@ -132,6 +274,17 @@ class DirNode {
 
   int rename(const char *fromPlaintext, const char *toPlaintext);
 
+  // hit rate of the encrypted path cache
+  PathCache::Stats pathCacheStats() const;
+
+  /*
+      A path relative to rootDir changed behind our back.  Drops what we and
+      the context have cached about its plaintext path, and about everything
+      below it if it went away (it may have been a directory).  Names which
+      don't decode drop everything.
+  */
+  void backingChanged(const char *cipherPath, bool removed);
+
   int link(const char *from, const char *to);
 
   // returns idle time of filesystem in seconds
@@ -159,12 +312,54 @@ class DirNode {
  private:
   friend class RenameOp;
 
+  // the subdirectories of a rename are scanned in parallel
   bool genRenameList(std::list<RenameEl> &list, const char *fromP,
                      const char *toP);
+  bool scanRenameDir(RenameDir *rd);
+
+  // finish a recursive rename left in the journal by a crash
+  void resumeRename();
 
   std::shared_ptr<FileNode> findOrCreate(const char *plainName);
 
-  pthread_mutex_t mutex;
+  // naming->encodePath starting from the root IV, through pathCache
+  std::string encodePath(const char *plaintextPath, uint64_t *iv = NULL);
+  // the pathCache miss path of encodePath, adds the result to the cache.
+  // With per-directory IVs, the path's IV is only read if iv is given.
+  std::string encodeUncached(const char *plaintextPath, uint64_t *iv);
+  // plainPath with per-directory IVs, decodes a directory at a time
+  std::string decodeWithDirectoryIVs(const char *cipherPath);
+  // and its reverse, for relativeCipherPath.  Not cached, as the path may
+  // be relative to a symlink rather than the root.
+  std::string encodeWithDirectoryIVs(const char *plaintextPath);
+
+  /*
+      With per-directory IVs, the names in a directory are chained from a
+      random IV kept in a hidden file inside it, rather than from the IV of
+      the path.  The IV is cached along with the directory's path, once it
+      is used as one (file paths don't need it).  Returns 0
+      for a directory without one (such as the root).
+  */
+  uint64_t directoryIV(const std::string &cipherDir);
+  // a random IV is picked if iv is 0
+  bool writeDirectoryIV(const std::string &cipherDir, uint64_t iv);
+  // remove an empty directory, along with its IV file
+  int rmdirWithIV(const std::string &cipherDir);
+
+  // the decoded names of a backing directory, reused while the directory
+  // is unchanged
+  std::shared_ptr<DecodedNames> decodedNames(const std::string &cipherDir,
+                                             uint64_t iv);
+
+  /*
+      Operations lock the stripes of the plaintext paths they touch, so
+      unrelated paths don't serialize on one directory mutex.  Multiple
+      stripes are always taken in ascending order.  A rename which has to
+      re-encode a whole subtree takes all of them.
+  */
+  static const int NumStripes = 32;
+  static uint64_t stripeMask(const char *plaintextPath);
+  pthread_mutex_t stripes[NumStripes];
 
   EncFS_Context *ctx;
 
@@ -173,6 +368,13 @@ class DirNode {
   FSConfigPtr fsConfig;
 
   std::shared_ptr<NameIO> naming;
+  bool directoryIVs;
+
+  PathCache pathCache;
+
+  pthread_mutex_t dirNamesMutex;
+  std::map<std::string, std::shared_ptr<DecodedNames>> dirNames;
+  uint64_t dirNamesUse;
 };
 
 }  // namespace encfs
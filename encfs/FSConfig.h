@@ -74,6 +74,7 @@ struct EncFSConfig {
   bool externalIVChaining;  // IV seeding by filename IV chaining
 
   bool chainedNameIV;  // filename IV chaining
+  bool directoryIV;    // chaining starts from a random IV per directory
   bool allowHoles;     // allow holes in files (implicit zero blocks)
 
   EncFSConfig() : keyData(), salt() {
@@ -84,6 +85,7 @@ struct EncFSConfig {
     uniqueIV = false;
     externalIVChaining = false;
     chainedNameIV = false;
+    directoryIV = false;
     allowHoles = false;
 
     kdfIterations = 0;
@@ -20,6 +20,8 @@
 
 #include "FileIO.h"
 
+#include <cerrno>
+
 namespace encfs {
 
 FileIO::FileIO() {}
@@ -33,4 +35,11 @@ bool FileIO::setIV(uint64_t iv) {
   return true;
 }
 
+int FileIO::allocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length) {
+  (void)mode;
+  (void)offset;
+  (void)length;
+  return -EOPNOTSUPP;
+}
+
 }  // namespace encfs
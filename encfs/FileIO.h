@@ -72,6 +72,11 @@ class FileIO {
 
   virtual int truncate(FUSE_OFF_T size) = 0;
 
+  // fallocate() style space management, mode is a mask of FALLOC_FL_*
+  // flags.  Returns 0 on success, -errno on failure.  The default
+  // implementation returns -EOPNOTSUPP.
+  virtual int allocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length);
+
   virtual bool isWritable() const = 0;
 
  private:
@@ -43,29 +43,26 @@ using namespace std;
 
 namespace encfs {
 
-/*
-   TODO: locking at the FileNode level is inefficient, since this precludes
-   multiple IO operations from going on concurrently within the same file.
-
-   There is no reason why simultainous reads cannot be satisfied, or why one
-   read has to wait for the decoding of the previous read before it can be
-   sent to the IO subsystem!
-*/
-
 FileNode::FileNode(DirNode *parent_, const FSConfigPtr &cfg,
                    const char *plaintextName_, const char *cipherName_) {
-  pthread_mutex_init(&mutex, 0);
-
-  Lock _lock(mutex);
+  ExclusiveLock _lock(lock);
 
   this->_pname = plaintextName_;
   this->_cname = cipherName_;
   this->parent = parent_;
 
   this->fsConfig = cfg;
+  this->readOnly = -1;
+  this->attrChanged = false;
 
   // chain RawFileIO & CipherFileIO
-  std::shared_ptr<FileIO> rawIO(new RawFileIO(_cname));
+  std::shared_ptr<RawFileIO> rawIO(new RawFileIO(_cname));
+  // nothing writes to backing files on a read-only mount, so reads can be
+  // served from a mapping.  Not for reverse mode, or when caching is off,
+  // since the backing files may then change underneath us.
+  if (cfg->opts->readOnly && !cfg->opts->reverseEncryption &&
+      !cfg->opts->noCache)
+    rawIO->setMapped(true);
   io = std::shared_ptr<FileIO>(new CipherFileIO(rawIO, fsConfig));
 
   if (cfg->config->blockMACBytes || cfg->config->blockMACRandBytes)
@@ -73,14 +70,9 @@ FileNode::FileNode(DirNode *parent_, const FSConfigPtr &cfg,
 }
 
 FileNode::~FileNode() {
-  // FileNode mutex should be locked before the destructor is called
-  // pthread_mutex_lock( &mutex );
-
   _pname.assign(_pname.length(), '\0');
   _cname.assign(_cname.length(), '\0');
   io.reset();
-
-  pthread_mutex_destroy(&mutex);
 }
 
 const char *FileNode::cipherName() const { return _cname.c_str(); }
@@ -99,7 +91,7 @@ static bool setIV(const std::shared_ptr<FileIO> &io, uint64_t iv) {
 
 bool FileNode::setName(const char *plaintextName_, const char *cipherName_,
                        uint64_t iv, bool setIVFirst) {
-  // Lock _lock( mutex );
+  ExclusiveLock _lock(lock);
   if (cipherName_) VLOG(1) << "calling setIV on " << cipherName_;
 
   if (setIVFirst) {
@@ -132,7 +124,7 @@ bool FileNode::setName(const char *plaintextName_, const char *cipherName_,
 }
 
 int FileNode::mknod(mode_t mode, dev_t rdev, uid_t uid, gid_t gid) {
-  Lock _lock(mutex);
+  ExclusiveLock _lock(lock);
 
   int res;
 #if 0
@@ -190,33 +182,90 @@ int FileNode::mknod(mode_t mode, dev_t rdev, uid_t uid, gid_t gid) {
 }
 
 int FileNode::open(int flags) const {
-  Lock _lock(mutex);
+  ExclusiveLock _lock(lock);
 
   int res = io->open(flags);
   return res;
 }
 
 int FileNode::getAttr(struct stat_st *stbuf) const {
-  Lock _lock(mutex);
+  SharedLock _lock(lock);
 
+  // cleared first, so a write racing with the stat marks it again
+  attrChanged.store(false);
   int res = io->getAttr(stbuf);
   return res;
 }
 
+int FileNode::getAttr(const FSConfigPtr &cfg, const char *cipherName,
+                      struct stat_st *stbuf) {
+  if (unix::lstat(cipherName, stbuf) < 0) {
+    int eno = errno;
+    RLOG(DEBUG) << "getAttr error on " << cipherName << ": " << strerror(eno);
+    return -eno;
+  }
+
+  plainAttr(cfg, stbuf);
+  return 0;
+}
+
+void FileNode::plainAttr(const FSConfigPtr &cfg, struct stat_st *stbuf) {
+  CipherFileIO::plainAttr(cfg, stbuf);
+  if (cfg->config->blockMACBytes || cfg->config->blockMACRandBytes)
+    MACFileIO::plainAttr(cfg, stbuf);
+}
+
 FUSE_OFF_T FileNode::getSize() const {
-  Lock _lock(mutex);
+  SharedLock _lock(lock);
 
-  int res = io->getSize();
+  FUSE_OFF_T res = io->getSize();
   return res;
 }
 
+bool FileNode::isReadOnly() const {
+  int ro = readOnly.load();
+  if (ro < 0) {
+    struct stat_st stbuf;
+    if (getAttr(&stbuf) != 0) {
+      // not cached, so that we ask again next time
+      RLOG(DEBUG) << "isReadOnly failed: getAttr error";
+      return false;
+    }
+
+    // No write permissions?
+    ro = (S_ISREG(stbuf.st_mode) && !(_S_IWRITE & stbuf.st_mode)) ? 1 : 0;
+    readOnly.store(ro);
+  }
+
+  return ro == 1;
+}
+
+void FileNode::clearModeCache() { readOnly.store(-1); }
+
+bool FileNode::markAttrChanged() { return !attrChanged.exchange(true); }
+
+void FileNode::blockRange(FUSE_OFF_T offset, ssize_t size, int64_t *first,
+                          int64_t *last) const {
+  int bs = io->blockSize();
+  *first = offset / bs;
+  *last = (size > 0) ? (offset + size - 1) / bs : *first;
+}
+
 ssize_t FileNode::read(FUSE_OFF_T offset, unsigned char *data, ssize_t size) const {
   IORequest req;
   req.offset = offset;
   req.dataLen = size;
   req.data = data;
 
-  Lock _lock(mutex);
+  // reverse mode regenerates the file header on every read
+  if (fsConfig->reverseEncryption) {
+    ExclusiveLock _lock(lock);
+    return io->read(req);
+  }
+
+  int64_t first, last;
+  blockRange(offset, size, &first, &last);
+  SharedLock _lock(lock, first, last, false);
 
   return io->read(req);
 }
@@ -229,19 +278,35 @@ bool FileNode::write(FUSE_OFF_T offset, unsigned char *data, ssize_t size) {
   req.dataLen = size;
   req.data = data;
 
-  Lock _lock(mutex);
+  {
+    // writes within the current file size only touch their own blocks
+    int64_t first, last;
+    blockRange(offset, size, &first, &last);
+    SharedLock _lock(lock, first, last, true);
+
+    FUSE_OFF_T fileSize = io->getSize();
+    if (fileSize >= 0 && offset + size <= fileSize) return io->write(req);
+  }
+
+  ExclusiveLock _lock(lock);
 
   return io->write(req);
 }
 
 int FileNode::truncate(FUSE_OFF_T size) {
-  Lock _lock(mutex);
+  ExclusiveLock _lock(lock);
 
   return io->truncate(size);
 }
 
+int FileNode::allocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length) {
+  ExclusiveLock _lock(lock);
+
+  return io->allocate(mode, offset, length);
+}
+
 int FileNode::sync(bool datasync) {
-  Lock _lock(mutex);
+  ExclusiveLock _lock(lock);
 
   int fh = io->open(O_RDONLY);
   if (fh >= 0) {
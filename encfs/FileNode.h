@@ -21,6 +21,7 @@
 #ifndef _FileNode_incl_
 #define _FileNode_incl_
 
+#include <atomic>
 #include <inttypes.h>
 #include <memory>
 #include "pthread.h"
@@ -31,6 +32,7 @@
 #include "CipherKey.h"
 #include "FSConfig.h"
 #include "FileUtils.h"
+#include "Mutex.h"
 #include "encfs.h"
 
 namespace encfs {
@@ -67,26 +69,53 @@ class FileNode {
   int getAttr(struct stat_st *stbuf) const;
   FUSE_OFF_T getSize() const;
 
+  // true for a regular file without write permission.  The answer is
+  // cached, clearModeCache() must be called when the mode changes.
+  bool isReadOnly() const;
+  void clearModeCache();
+
+  // true for the first write since getAttr, which has to drop attributes
+  // cached by path.  Later writes up to the next getAttr don't.
+  bool markAttrChanged();
+
+  // Same as getAttr, for a file which isn't open.  Only stats the backing
+  // file and adjusts the size for the layers a FileNode would stack on it.
+  static int getAttr(const FSConfigPtr &cfg, const char *cipherName,
+                     struct stat_st *stbuf);
+  // the size adjustment of the above, for attributes found some other way
+  static void plainAttr(const FSConfigPtr &cfg, struct stat_st *stbuf);
+
   ssize_t read(FUSE_OFF_T offset, unsigned char *data, ssize_t size) const;
   bool write(FUSE_OFF_T offset, unsigned char *data, ssize_t size);
 
   // truncate the file to a particular size
   int truncate(FUSE_OFF_T size);
 
+  // preallocate space or punch holes, mode is a mask of FALLOC_FL_* flags
+  int allocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length);
+
   // datasync or full sync
   int sync(bool dataSync);
 
  private:
-  // doing locking at the FileNode level isn't as efficient as at the
-  // lowest level of RawFileIO, since that means locks are held longer
-  // (held during CPU intensive crypto operations!).  However it makes it
-  // easier to avoid any race conditions with operations such as
-  // truncate() which may result in multiple calls down to the FileIO
-  // level.
-  mutable pthread_mutex_t mutex;
+  // blocks [first, last] touched by an IO request
+  void blockRange(FUSE_OFF_T offset, ssize_t size, int64_t *first,
+                  int64_t *last) const;
+
+  // Reads, and writes which stay within the file, take the shared side and
+  // lock only the blocks they touch (shared for reads, exclusive for
+  // writes), so they run concurrently unless they overlap.  Anything which
+  // may change the size or identity of the file (truncate, extending
+  // writes, open, setName) takes the exclusive side.
+  mutable RangeLock lock;
 
   FSConfigPtr fsConfig;
 
+  // cached isReadOnly() result, -1 if not known yet
+  mutable std::atomic<int> readOnly;
+  // written since the last getAttr
+  mutable std::atomic<bool> attrChanged;
+
   std::shared_ptr<FileIO> io;
   std::string _pname;  // plaintext name
   std::string _cname;  // encrypted name
@@ -318,6 +318,7 @@ bool readV6Config(const char *configFile, EncFSConfig *cfg, ConfigInfo *info) {
   config->read("blockSize", &cfg->blockSize);
   config->read("uniqueIV", &cfg->uniqueIV);
   config->read("chainedNameIV", &cfg->chainedNameIV);
+  config->read("directoryIV", &cfg->directoryIV);
   config->read("externalIVChaining", &cfg->externalIVChaining);
   config->read("blockMACBytes", &cfg->blockMACBytes);
   config->read("blockMACRandBytes", &cfg->blockMACRandBytes);
@@ -540,6 +541,7 @@ bool writeV6Config(const char *configFile, const EncFSConfig *cfg) {
   addEl(doc, config, "blockSize", cfg->blockSize);
   addEl(doc, config, "uniqueIV", cfg->uniqueIV);
   addEl(doc, config, "chainedNameIV", cfg->chainedNameIV);
+  addEl(doc, config, "directoryIV", cfg->directoryIV);
   addEl(doc, config, "externalIVChaining", cfg->externalIVChaining);
   addEl(doc, config, "blockMACBytes", cfg->blockMACBytes);
   addEl(doc, config, "blockMACRandBytes", cfg->blockMACRandBytes);
@@ -940,6 +942,20 @@ static bool selectExternalChainedIV() {
         "in the filesystem."));
 }
 
+/**
+ * Ask the user if filename IVs should be kept per directory
+ */
+static bool selectDirectoryIV() {
+  // xgroup(setup)
+  return boolDefaultNo(
+      _("Enable per-directory filename IVs?\n"
+        "Each directory keeps a random IV in a hidden file, which the names\n"
+        "inside it are encoded with, so renaming a directory doesn't have\n"
+        "to re-encode everything below it.\n"
+        "Filesystems created with this option need this version of encfs\n"
+        "or newer."));
+}
+
 /**
  * Ask the user if file holes should be passed through
  */
@@ -995,6 +1011,7 @@ RootPtr createV6Config(EncFS_Context *ctx,
   bool uniqueIV = true;         // selectUniqueIV()
   bool chainedIV = true;        // selectChainedIV()
   bool externalIV = false;      // selectExternalChainedIV()
+  bool directoryIV = false;     // selectDirectoryIV()
   bool allowHoles = true;       // selectZeroBlockPassThrough()
   long desiredKDFDuration = NormalKDFDuration;
 
@@ -1098,6 +1115,8 @@ RootPtr createV6Config(EncFS_Context *ctx,
              << "\n";
         externalIV = false;
       }
+      // the file data IV would no longer follow the path
+      if (chainedIV && !externalIV) directoryIV = selectDirectoryIV();
       selectBlockMAC(&blockMACBytes, &blockMACRandBytes, opts->requireMac);
       allowHoles = selectZeroBlockPassThrough();
     }
@@ -1120,13 +1139,14 @@ RootPtr createV6Config(EncFS_Context *ctx,
   config->cipherIface = cipher->getInterface();
   config->keySize = keySize;
   config->blockSize = blockSize;
-  config->nameIface = nameIOIface;
+  config->nameIface = NameIO::ConfigInterface(nameIOIface, directoryIV);
   config->creator = "EncFS " VERSION;
   config->subVersion = V6SubVersion;
   config->blockMACBytes = blockMACBytes;
   config->blockMACRandBytes = blockMACRandBytes;
   config->uniqueIV = uniqueIV;
   config->chainedNameIV = chainedIV;
+  config->directoryIV = directoryIV;
   config->externalIVChaining = externalIV;
   config->allowHoles = allowHoles;
 
@@ -1319,6 +1339,10 @@ void showFSInfo(const EncFSConfig *config) {
     // xgroup(diag)
     cout << _("Filenames encoded using IV chaining mode.\n");
   }
+  if (config->directoryIV) {
+    // xgroup(diag)
+    cout << _("Filename IV chaining starts from a random IV per directory.\n");
+  }
   if (config->externalIVChaining) {
     // xgroup(diag)
     cout << _("File data IV is chained to filename IV.\n");
@@ -1576,7 +1600,8 @@ RootPtr initFS(EncFS_Context *ctx, const std::shared_ptr<EncFS_Opts> &opts) {
 
     if (opts->reverseEncryption) {
       if (config->blockMACBytes != 0 || config->blockMACRandBytes != 0 ||
-          config->externalIVChaining || config->chainedNameIV) {
+          config->externalIVChaining || config->chainedNameIV ||
+          config->directoryIV) {
         cout << _(
             "The configuration loaded is not compatible with --reverse\n");
         return rootInfo;
@@ -93,6 +93,14 @@ struct EncFS_Opts {
                  * behind the back of EncFS (for example, in reverse mode).
                  * See main.cpp for a longer explaination. */
 
+  // how long getattr results and missing names are cached, in milliseconds
+  int attrTimeout;
+  int negativeTimeout;
+  // watch rootDir for changes made behind our back, to keep caches coherent
+  bool watchBacking;
+
+  int poolLimit;  // bytes the memory pool may keep for reuse, in MiB
+
   bool readOnly;  // Mount read-only
 
   bool requireMac;  // Throw an error if MAC is disabled
@@ -112,6 +120,10 @@ struct EncFS_Opts {
     reverseEncryption = false;
     configMode = Config_Prompt;
     noCache = false;
+    attrTimeout = 1000;
+    negativeTimeout = 1000;
+    watchBacking = true;
+    poolLimit = 4;
     readOnly = false;
     requireMac = false;
   }
@@ -118,19 +118,27 @@ static FUSE_OFF_T locWithoutHeader(FUSE_OFF_T offset, int blockSize, int headerS
   return offset - blockNum * headerSize;
 }
 
-int MACFileIO::getAttr(struct stat_st *stbuf) const {
-  int res = base->getAttr(stbuf);
-
-  if (res == 0 && S_ISREG(stbuf->st_mode)) {
+static void adjustAttr(struct stat_st *stbuf, int dataSize, int headerSize) {
+  if (S_ISREG(stbuf->st_mode)) {
     // have to adjust size field..
-    int headerSize = macBytes + randBytes;
-    int bs = blockSize() + headerSize;
+    int bs = dataSize + headerSize;
     stbuf->st_size = locWithoutHeader(stbuf->st_size, bs, headerSize);
   }
+}
+
+int MACFileIO::getAttr(struct stat_st *stbuf) const {
+  int res = base->getAttr(stbuf);
+
+  if (res == 0) adjustAttr(stbuf, blockSize(), macBytes + randBytes);
 
   return res;
 }
 
+void MACFileIO::plainAttr(const FSConfigPtr &cfg, struct stat_st *stbuf) {
+  adjustAttr(stbuf, dataBlockSize(cfg),
+             cfg->config->blockMACBytes + cfg->config->blockMACRandBytes);
+}
+
 FUSE_OFF_T MACFileIO::getSize() const {
   // adjust the size to hide the header overhead we tack on..
   int headerSize = macBytes + randBytes;
@@ -160,11 +168,7 @@ ssize_t MACFileIO::readOneBlock(const IORequest &req) const {
   // don't store zeros if configured for zero-block pass-through
   bool skipBlock = true;
   if (_allowHoles) {
-    for (int i = 0; i < readSize; ++i)
-      if (tmp.data[i] != 0) {
-        skipBlock = false;
-        break;
-      }
+    skipBlock = isZeroBlock(tmp.data, (int)readSize);
   } else if (macBytes > 0)
     skipBlock = false;
 
@@ -258,6 +262,17 @@ int MACFileIO::truncate(FUSE_OFF_T size) {
   return res;
 }
 
+int MACFileIO::baseAllocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length) {
+  int headerSize = macBytes + randBytes;
+  int bs = blockSize() + headerSize;
+
+  // block aligned ranges stay block aligned in the base layer
+  FUSE_OFF_T start = locWithHeader(offset, bs, headerSize);
+  FUSE_OFF_T end = locWithHeader(offset + length, bs, headerSize);
+
+  return base->allocate(mode, start, end - start);
+}
+
 bool MACFileIO::isWritable() const { return base->isWritable(); }
 
 }  // namespace encfs
@@ -58,6 +58,9 @@ class MACFileIO : public BlockFileIO {
   virtual int getAttr(struct stat_st *stbuf) const;
   virtual FUSE_OFF_T getSize() const;
 
+  // convert attributes of a backing file to those this layer presents
+  static void plainAttr(const FSConfigPtr &cfg, struct stat_st *stbuf);
+
   virtual int truncate(FUSE_OFF_T size);
 
   virtual bool isWritable() const;
@@ -65,6 +68,7 @@ class MACFileIO : public BlockFileIO {
  private:
   virtual ssize_t readOneBlock(const IORequest &req) const;
   virtual bool writeOneBlock(const IORequest &req);
+  virtual int baseAllocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length);
 
   std::shared_ptr<FileIO> base;
   std::shared_ptr<Cipher> cipher;
@@ -20,9 +20,13 @@
 
 #include "MemoryPool.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
-#include <openssl/ossl_typ.h>
-#include "pthread.h"
+#include <new>
+#include <vector>
+
+#include "Mutex.h"
 
 #ifdef HAVE_VALGRIND_MEMCHECK_H
 #include <valgrind/memcheck.h>
@@ -31,64 +35,198 @@
 #define VALGRIND_MAKE_MEM_UNDEFINED(a, b)
 #endif
 
-#include <openssl/buffer.h>
+namespace encfs {
+
+/*
+    Blocks are grouped in power of two size classes, from 64 bytes to 64k,
+    which covers file blocks, MAC blocks (block + header) and name buffers.
+    Larger requests bypass the pool.
 
-#define BLOCKDATA(BLOCK) (unsigned char *)BLOCK->data->data
+    Each thread keeps a short free list per class, so the common
+    allocate/release pair touches no shared state.  Overflowing thread lists
+    are pushed onto a shared reserve, which is a lock-free stack.  Threads
+    only ever take the whole reserve of a class at once (exchange with
+    NULL), so popping can't run into the ABA problem.
 
-namespace encfs {
+    Thread caches are registered, so trim() can empty the caches of other
+    threads as well.  Each cache has a spin lock which its owner holds while
+    touching the lists; it is only ever contended by trim().
+*/
+
+static const int MinClassShift = 6;
+static const int NumClasses = 11;
+static const int ThreadCacheLimit = 16;  // blocks per class and thread
 
 struct BlockList {
   BlockList *next;
-  int size;
-  BUF_MEM *data;
+  int size;       // capacity of the data area
+  int used;       // bytes requested by the current owner
+  int sizeClass;  // -1 for blocks which are not pooled
 };
 
-static BlockList *allocBlock(int size) {
-  BlockList *block = new BlockList;
+// keep the data area aligned for the crypto code
+static const size_t HeaderSize =
+    (sizeof(BlockList) + 15) & ~static_cast<size_t>(15);
+
+#define BLOCKDATA(BLOCK) ((unsigned char *)(BLOCK) + HeaderSize)
+
+static std::atomic<BlockList *> gReserve[NumClasses];
+static std::atomic<uint64_t> gAllocations(0);
+static std::atomic<uint64_t> gHits(0);
+static std::atomic<uint64_t> gBytesHeld(0);
+static std::atomic<uint64_t> gHighWaterMark(4 * 1024 * 1024);
+
+static int sizeClass(int size) {
+  int c = 0;
+  while ((1 << (MinClassShift + c)) < size) {
+    if (++c == NumClasses) return -1;
+  }
+  return c;
+}
+
+static int classSize(int c) { return 1 << (MinClassShift + c); }
+
+static BlockList *allocBlock(int size, int c) {
+  BlockList *block = (BlockList *)::operator new(HeaderSize + size);
+  block->next = NULL;
   block->size = size;
-  block->data = BUF_MEM_new();
-  BUF_MEM_grow(block->data, size);
-  VALGRIND_MAKE_MEM_NOACCESS(block->data->data, block->data->max);
+  block->used = 0;
+  block->sizeClass = c;
+  VALGRIND_MAKE_MEM_NOACCESS(BLOCKDATA(block), size);
 
   return block;
 }
 
 static void freeBlock(BlockList *el) {
-  VALGRIND_MAKE_MEM_UNDEFINED(el->data->data, el->data->max);
-  BUF_MEM_free(el->data);
+  VALGRIND_MAKE_MEM_UNDEFINED(BLOCKDATA(el), el->size);
+  ::operator delete(el);
+}
 
-  delete el;
+static void freeList(BlockList *block) {
+  while (block != NULL) {
+    BlockList *next = block->next;
+    gBytesHeld -= block->size;
+    freeBlock(block);
+    block = next;
+  }
 }
 
-static pthread_mutex_t gMPoolMutex;
-static BlockList *gMemPool = NULL;
+// push a chain of blocks [first .. last] onto the shared reserve
+static void pushReserve(int c, BlockList *first, BlockList *last) {
+  BlockList *head = gReserve[c].load(std::memory_order_relaxed);
+  do {
+    last->next = head;
+  } while (!gReserve[c].compare_exchange_weak(
+      head, first, std::memory_order_release, std::memory_order_relaxed));
+}
+
+namespace {
+
+struct ThreadCache;
 
-void init_mpool_mutex() {
-  pthread_mutex_init(&gMPoolMutex, 0);
+// never destroyed, as thread caches may outlive static destruction
+struct Registry {
+  pthread_mutex_t mutex;
+  std::vector<ThreadCache *> caches;
+
+  Registry() { pthread_mutex_init(&mutex, 0); }
+};
+
+Registry &registry() {
+  static Registry *reg = new Registry();
+  return *reg;
 }
 
-MemBlock MemoryPool::allocate(int size) {
-  pthread_mutex_lock(&gMPoolMutex);
-
-  BlockList *parent = NULL;
-  BlockList *block = gMemPool;
-  // check if we already have a large enough block available..
-  while (block != NULL && block->size < size) {
-    parent = block;
-    block = block->next;
+struct ThreadCache {
+  BlockList *lists[NumClasses];
+  int counts[NumClasses];
+  std::atomic_flag busy;
+
+  ThreadCache() {
+    busy.clear();
+    for (int c = 0; c < NumClasses; ++c) {
+      lists[c] = NULL;
+      counts[c] = 0;
+    }
+    Registry &reg = registry();
+    Lock lock(reg.mutex);
+    reg.caches.push_back(this);
+  }
+
+  // hand everything to the shared reserve when the thread exits
+  ~ThreadCache() {
+    {
+      Registry &reg = registry();
+      Lock lock(reg.mutex);
+      reg.caches.erase(
+          std::find(reg.caches.begin(), reg.caches.end(), this));
+    }
+    for (int c = 0; c < NumClasses; ++c) flush(c);
   }
 
-  // unlink block from list
-  if (block) {
-    if (!parent)
-      gMemPool = block->next;
-    else
-      parent->next = block->next;
+  void lock() {
+    while (busy.test_and_set(std::memory_order_acquire)) {
+    }
   }
-  pthread_mutex_unlock(&gMPoolMutex);
+  void unlock() { busy.clear(std::memory_order_release); }
 
-  if (!block) block = allocBlock(size);
+  void flush(int c) {
+    BlockList *first = lists[c];
+    if (first == NULL) return;
+
+    BlockList *last = first;
+    while (last->next != NULL) last = last->next;
+    lists[c] = NULL;
+    counts[c] = 0;
+    pushReserve(c, first, last);
+  }
+
+  // take the whole shared reserve for class c
+  void refill(int c) {
+    BlockList *block = gReserve[c].exchange(NULL, std::memory_order_acquire);
+    lists[c] = block;
+    for (counts[c] = 0; block != NULL; block = block->next) ++counts[c];
+  }
+
+  // free everything held, called with the cache locked
+  void clear() {
+    for (int c = 0; c < NumClasses; ++c) {
+      freeList(lists[c]);
+      lists[c] = NULL;
+      counts[c] = 0;
+    }
+  }
+};
+
+}  // namespace
+
+static thread_local ThreadCache tCache;
+
+MemBlock MemoryPool::allocate(int size) {
+  gAllocations.fetch_add(1, std::memory_order_relaxed);
+
+  BlockList *block = NULL;
+  int c = sizeClass(size);
+  if (c < 0) {
+    block = allocBlock(size, c);
+  } else {
+    ThreadCache &tc = tCache;
+    tc.lock();
+    if (tc.lists[c] == NULL) tc.refill(c);
+
+    block = tc.lists[c];
+    if (block != NULL) {
+      tc.lists[c] = block->next;
+      --tc.counts[c];
+      gHits.fetch_add(1, std::memory_order_relaxed);
+      gBytesHeld -= block->size;
+    }
+    tc.unlock();
+
+    if (block == NULL) block = allocBlock(classSize(c), c);
+  }
   block->next = NULL;
+  block->used = size;
 
   MemBlock result;
   result.data = BLOCKDATA(block);
@@ -100,35 +238,57 @@ MemBlock MemoryPool::allocate(int size) {
 }
 
 void MemoryPool::release(const MemBlock &mb) {
-  pthread_mutex_lock(&gMPoolMutex);
-
   BlockList *block = (BlockList *)mb.internalData;
 
   // just to be sure there's nothing important left in buffers..
-  VALGRIND_MAKE_MEM_UNDEFINED(block->data->data, block->size);
-  memset(BLOCKDATA(block), 0, block->size);
-  VALGRIND_MAKE_MEM_NOACCESS(block->data->data, block->data->max);
+  VALGRIND_MAKE_MEM_UNDEFINED(BLOCKDATA(block), block->used);
+  memset(BLOCKDATA(block), 0, block->used);
+  VALGRIND_MAKE_MEM_NOACCESS(BLOCKDATA(block), block->size);
 
-  block->next = gMemPool;
-  gMemPool = block;
+  int c = block->sizeClass;
+  if (c < 0 || gBytesHeld.load(std::memory_order_relaxed) + block->size >
+                   gHighWaterMark.load(std::memory_order_relaxed)) {
+    // over the limit, don't keep it around
+    freeBlock(block);
+    return;
+  }
+  gBytesHeld += block->size;
 
-  pthread_mutex_unlock(&gMPoolMutex);
+  ThreadCache &tc = tCache;
+  tc.lock();
+  block->next = tc.lists[c];
+  tc.lists[c] = block;
+  if (++tc.counts[c] > ThreadCacheLimit) tc.flush(c);
+  tc.unlock();
 }
 
-void MemoryPool::destroyAll() {
-  pthread_mutex_lock(&gMPoolMutex);
-
-  BlockList *block = gMemPool;
-  gMemPool = NULL;
-
-  pthread_mutex_unlock(&gMPoolMutex);
-
-  while (block != NULL) {
-    BlockList *next = block->next;
+void MemoryPool::setHighWaterMark(uint64_t bytes) {
+  gHighWaterMark = bytes;
+  if (gBytesHeld > bytes) trim();
+}
 
-    freeBlock(block);
-    block = next;
+void MemoryPool::trim() {
+  Registry &reg = registry();
+  {
+    Lock lock(reg.mutex);
+    for (ThreadCache *tc : reg.caches) {
+      tc->lock();
+      tc->clear();
+      tc->unlock();
+    }
   }
+  for (int c = 0; c < NumClasses; ++c)
+    freeList(gReserve[c].exchange(NULL, std::memory_order_acquire));
 }
 
+MemoryPool::Stats MemoryPool::stats() {
+  Stats st;
+  st.allocations = gAllocations.load(std::memory_order_relaxed);
+  st.hits = gHits.load(std::memory_order_relaxed);
+  st.bytesHeld = gBytesHeld.load(std::memory_order_relaxed);
+  return st;
+}
+
+void MemoryPool::destroyAll() { trim(); }
+
 }  // namespace encfs
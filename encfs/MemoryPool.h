@@ -21,6 +21,8 @@
 #ifndef _MemoryPool_incl_
 #define _MemoryPool_incl_
 
+#include <stdint.h>
+
 namespace encfs {
 
 struct MemBlock {
@@ -41,11 +43,27 @@ inline MemBlock::MemBlock() : data(0), internalData(0) {}
     // do things with storage in   mb.data
     unsigned char *buffer = mb.data;
     MemoryPool::release( mb );
+
+    Released blocks are cleared and kept for reuse, in per-thread caches
+    and a shared reserve, until the pool holds more than the high water
+    mark.  Further releases free their blocks instead.
 */
 namespace MemoryPool {
 MemBlock allocate(int size);
 void release(const MemBlock &el);
 void destroyAll();
+
+// limit on the bytes held by the pool (default 4 MiB)
+void setHighWaterMark(uint64_t bytes);
+// free every block held, in all thread caches and the shared reserve
+void trim();
+
+struct Stats {
+  uint64_t allocations;  // calls to allocate()
+  uint64_t hits;         // allocations served from the pool
+  uint64_t bytesHeld;    // bytes kept for reuse
+};
+Stats stats();
 }
 
 }  // namespace encfs
@@ -21,6 +21,9 @@
 #ifndef _Mutex_incl_
 #define _Mutex_incl_
 
+#include <stdint.h>
+#include <vector>
+
 #include "pthread.h"
 
 namespace encfs {
@@ -51,6 +54,145 @@ inline Lock::~Lock() {
 
 inline void Lock::leave() { _mutex = 0; }
 
+/*
+    Reader / writer lock for a file, with block range locking for the
+    shared side.  Shared holders may lock a range of blocks, and only
+    conflict with each other if their ranges overlap and one of them is
+    exclusive.  An exclusive lock waits for all shared holders to leave, and
+    while it is waiting no new shared holders are let in.
+*/
+class RangeLock {
+ public:
+  RangeLock();
+  ~RangeLock();
+
+  void lockExclusive();
+  void unlockExclusive();
+
+  // shared lock, holding blocks [first, last].  An empty range (first >
+  // last) only holds off exclusive lockers.
+  void lockShared(int64_t first = 1, int64_t last = 0, bool exclusive = false);
+  void unlockShared(int64_t first = 1, int64_t last = 0,
+                    bool exclusive = false);
+
+ private:
+  RangeLock(const RangeLock &src);             // not allowed
+  RangeLock &operator=(const RangeLock &src);  // not allowed
+
+  struct Range {
+    int64_t first;
+    int64_t last;
+    bool exclusive;
+  };
+  bool conflicts(int64_t first, int64_t last, bool exclusive) const;
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+  bool _exclusive;
+  int _exclusiveWaiting;
+  int _shared;
+  std::vector<Range> _ranges;
+};
+
+inline RangeLock::RangeLock()
+    : _exclusive(false), _exclusiveWaiting(0), _shared(0) {
+  pthread_mutex_init(&_mutex, 0);
+  pthread_cond_init(&_cond, 0);
+}
+
+inline RangeLock::~RangeLock() {
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+inline void RangeLock::lockExclusive() {
+  Lock lock(_mutex);
+  ++_exclusiveWaiting;
+  while (_exclusive || _shared > 0) pthread_cond_wait(&_cond, &_mutex);
+  --_exclusiveWaiting;
+  _exclusive = true;
+}
+
+inline void RangeLock::unlockExclusive() {
+  Lock lock(_mutex);
+  _exclusive = false;
+  pthread_cond_broadcast(&_cond);
+}
+
+inline bool RangeLock::conflicts(int64_t first, int64_t last,
+                                 bool exclusive) const {
+  if (first > last) return false;
+  for (size_t i = 0; i < _ranges.size(); ++i) {
+    const Range &r = _ranges[i];
+    if ((exclusive || r.exclusive) && first <= r.last && r.first <= last)
+      return true;
+  }
+  return false;
+}
+
+inline void RangeLock::lockShared(int64_t first, int64_t last,
+                                  bool exclusive) {
+  Lock lock(_mutex);
+  while (_exclusive || _exclusiveWaiting > 0 ||
+         conflicts(first, last, exclusive))
+    pthread_cond_wait(&_cond, &_mutex);
+
+  ++_shared;
+  if (first <= last) {
+    Range r = {first, last, exclusive};
+    _ranges.push_back(r);
+  }
+}
+
+inline void RangeLock::unlockShared(int64_t first, int64_t last,
+                                    bool exclusive) {
+  Lock lock(_mutex);
+  if (first <= last) {
+    for (size_t i = 0; i < _ranges.size(); ++i) {
+      const Range &r = _ranges[i];
+      if (r.first == first && r.last == last && r.exclusive == exclusive) {
+        _ranges[i] = _ranges.back();
+        _ranges.pop_back();
+        break;
+      }
+    }
+  }
+  --_shared;
+  pthread_cond_broadcast(&_cond);
+}
+
+// scoped helpers for RangeLock
+class ExclusiveLock {
+ public:
+  ExclusiveLock(RangeLock &lock) : _lock(lock) { _lock.lockExclusive(); }
+  ~ExclusiveLock() { _lock.unlockExclusive(); }
+
+ private:
+  ExclusiveLock(const ExclusiveLock &src);             // not allowed
+  ExclusiveLock &operator=(const ExclusiveLock &src);  // not allowed
+
+  RangeLock &_lock;
+};
+
+class SharedLock {
+ public:
+  SharedLock(RangeLock &lock, int64_t first = 1, int64_t last = 0,
+             bool exclusive = false)
+      : _lock(lock), _first(first), _last(last), _exclusive(exclusive) {
+    _lock.lockShared(_first, _last, _exclusive);
+  }
+  ~SharedLock() { _lock.unlockShared(_first, _last, _exclusive); }
+
+ private:
+  SharedLock(const SharedLock &src);             // not allowed
+  SharedLock &operator=(const SharedLock &src);  // not allowed
+
+  RangeLock &_lock;
+  int64_t _first;
+  int64_t _last;
+  bool _exclusive;
+};
+
 }  // namespace encfs
 
 #endif
@@ -25,7 +25,9 @@
 // for static build.  Need to reference the modules which are registered at
 // run-time, to ensure that the linker doesn't optimize them away.
 #include <iostream>
+#include <list>
 #include <map>
+#include <thread>
 #include <utility>
 
 #include "BlockNameIO.h"
@@ -33,6 +35,7 @@
 #include "Error.h"
 #include "Interface.h"
 #include "NullNameIO.h"
+#include "pthread.h"
 #include "StreamNameIO.h"
 
 using namespace std;
@@ -125,6 +128,16 @@ std::shared_ptr<NameIO> NameIO::New(const Interface &iface,
   return result;
 }
 
+Interface NameIO::ConfigInterface(const Interface &iface, bool directoryIV) {
+  Interface result(iface);
+  if (!directoryIV && result.age() > 0) {
+    --result.current();
+    result.revision() = 0;
+    --result.age();
+  }
+  return result;
+}
+
 NameIO::NameIO() : chainedNameIV(false), reverseEncryption(false) {}
 
 NameIO::~NameIO() {}
@@ -137,16 +150,19 @@ void NameIO::setReverseEncryption(bool enable) { reverseEncryption = enable; }
 
 bool NameIO::getReverseEncryption() const { return reverseEncryption; }
 
-std::string NameIO::recodePath(
+int NameIO::recodePath(
     const char *path, int (NameIO::*_length)(int) const,
     int (NameIO::*_code)(const char *, int, uint64_t *, char *, int) const,
-    uint64_t *iv) const {
-  string output;
+    uint64_t *iv, char *buf, int bufLen) const {
+  int outLen = 0;
+  if (bufLen < 1) return -1;
 
   while (*path) {
     if (*path == '/') {
-      if (!output.empty())  // don't start the string with '/'
-        output += '/';
+      if (outLen > 0) {  // don't start the string with '/'
+        if (outLen + 1 >= bufLen) return -1;
+        buf[outLen++] = '/';
+      }
       ++path;
     } else {
       bool isDotFile = (*path == '.');
@@ -155,32 +171,49 @@ std::string NameIO::recodePath(
 
       // at this point we know that len > 0
       if (isDotFile && (path[len - 1] == '.') && (len <= 2)) {
-        output.append(len, '.');  // append [len] copies of '.'
+        if (outLen + len >= bufLen) return -1;
+        memset(buf + outLen, '.', len);  // append [len] copies of '.'
+        outLen += len;
         path += len;
         continue;
       }
 
-      // figure out buffer sizes
+      // the coded name goes straight to the output
       int approxLen = (this->*_length)(len);
       if (approxLen <= 0) throw Error("Filename too small to decode");
-      int bufSize = 0;
+      if (outLen + approxLen + 1 > bufLen) return -1;
 
-      BUFFER_INIT_S(codeBuf, 32, (unsigned int)approxLen + 1, bufSize)
-
-      // code the name
-      int codedLen = (this->*_code)(path, len, iv, codeBuf, bufSize);
+      int codedLen =
+          (this->*_code)(path, len, iv, buf + outLen, bufLen - outLen);
       rAssert(codedLen <= approxLen);
-      rAssert(codeBuf[codedLen] == '\0');
+      outLen += codedLen;
       path += len;
-
-      // append result to string
-      output += (char *)codeBuf;
-
-      BUFFER_RESET(codeBuf)
     }
   }
 
-  return output;
+  buf[outLen] = '\0';
+  return outLen;
+}
+
+std::string NameIO::recodePath(
+    const char *path, int (NameIO::*_length)(int) const,
+    int (NameIO::*_code)(const char *, int, uint64_t *, char *, int) const,
+    uint64_t *iv) const {
+  char buf[PathBufferSize];
+  uint64_t startIV = iv ? *iv : 0;
+
+  int len = recodePath(path, _length, _code, iv, buf, sizeof(buf));
+  if (len >= 0) return string(buf, len);
+
+  // doesn't fit on the stack, start over with a larger buffer
+  std::vector<char> heapBuf(sizeof(buf));
+  do {
+    heapBuf.resize(heapBuf.size() * 2);
+    if (iv) *iv = startIV;
+    len = recodePath(path, _length, _code, iv, heapBuf.data(), heapBuf.size());
+  } while (len < 0);
+
+  return string(heapBuf.data(), len);
 }
 
 std::string NameIO::encodePath(const char *plaintextPath) const {
@@ -215,6 +248,188 @@ std::string NameIO::decodePath(const char *path, uint64_t *iv) const {
   return getReverseEncryption() ? _encodePath(path, iv) : _decodePath(path, iv);
 }
 
+int NameIO::encodePath(const char *path, uint64_t *iv, char *buf,
+                       int bufLen) const {
+  // if chaining is not enabled, then the iv pointer is not used..
+  if (!chainedNameIV) iv = 0;
+  if (getReverseEncryption())
+    return recodePath(path, &NameIO::maxDecodedNameLen, &NameIO::decodeName,
+                      iv, buf, bufLen);
+  return recodePath(path, &NameIO::maxEncodedNameLen, &NameIO::encodeName, iv,
+                    buf, bufLen);
+}
+
+int NameIO::decodePath(const char *path, uint64_t *iv, char *buf,
+                       int bufLen) const {
+  // if chaining is not enabled, then the iv pointer is not used..
+  if (!chainedNameIV) iv = 0;
+  if (getReverseEncryption())
+    return recodePath(path, &NameIO::maxEncodedNameLen, &NameIO::encodeName,
+                      iv, buf, bufLen);
+  return recodePath(path, &NameIO::maxDecodedNameLen, &NameIO::decodeName, iv,
+                    buf, bufLen);
+}
+
+namespace {
+// names decoded by one thread, [begin, end) of the batch
+struct DecodeSlice {
+  const NameIO *naming;
+  const std::vector<std::string> *encoded;
+  uint64_t iv;
+  std::vector<std::string> *plaintext;
+  size_t begin;
+  size_t end;
+};
+
+// the slices of one decodeNames call
+struct DecodeBatch {
+  std::vector<DecodeSlice> *slices;
+  size_t next;     // next slice to hand out
+  size_t pending;  // slices not yet decoded
+};
+
+/*
+    Threads for decodeNames, started on first use and kept for the life of
+    the process.  Batches wait in a queue until all of their slices are
+    handed out.  The calling thread decodes slices of its own batch too, so
+    a batch finishes even when every worker is busy with another directory.
+*/
+class DecodePool {
+ public:
+  explicit DecodePool(unsigned int workers);
+
+  // decode all slices, returns once every one of them is done
+  void run(std::vector<DecodeSlice> *slices);
+
+ private:
+  static void *worker(void *arg);
+  // hand out the next slice of a batch, with the mutex held
+  DecodeSlice *take(DecodeBatch *batch);
+
+  pthread_mutex_t mutex;
+  pthread_cond_t queued;    // a batch was queued
+  pthread_cond_t finished;  // the last slice of a batch was decoded
+  std::list<DecodeBatch *> queue;
+};
+}  // namespace
+
+static void *decodeSlice(void *arg) {
+  DecodeSlice *slice = (DecodeSlice *)arg;
+  for (size_t i = slice->begin; i < slice->end; ++i) {
+    try {
+      uint64_t localIV = slice->iv;
+      (*slice->plaintext)[i] =
+          slice->naming->decodePath((*slice->encoded)[i].c_str(), &localIV);
+    } catch (encfs::Error &err) {
+      (*slice->plaintext)[i].clear();
+    }
+  }
+  return 0;
+}
+
+DecodePool::DecodePool(unsigned int workers) {
+  pthread_mutex_init(&mutex, 0);
+  pthread_cond_init(&queued, 0);
+  pthread_cond_init(&finished, 0);
+
+  // if some threads can't be started, callers do more of the work
+  for (unsigned int i = 0; i < workers; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, 0, worker, this) != 0) {
+      RLOG(WARNING) << "unable to start name decoding thread";
+      break;
+    }
+    pthread_detach(thread);
+  }
+}
+
+DecodeSlice *DecodePool::take(DecodeBatch *batch) {
+  DecodeSlice *slice = &(*batch->slices)[batch->next++];
+  if (batch->next == batch->slices->size()) queue.remove(batch);
+  return slice;
+}
+
+void *DecodePool::worker(void *arg) {
+  DecodePool *pool = (DecodePool *)arg;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (pool->queue.empty())
+      pthread_cond_wait(&pool->queued, &pool->mutex);
+
+    DecodeBatch *batch = pool->queue.front();
+    DecodeSlice *slice = pool->take(batch);
+
+    pthread_mutex_unlock(&pool->mutex);
+    decodeSlice(slice);
+    pthread_mutex_lock(&pool->mutex);
+
+    if (--batch->pending == 0) pthread_cond_broadcast(&pool->finished);
+  }
+  return 0;
+}
+
+void DecodePool::run(std::vector<DecodeSlice> *slices) {
+  DecodeBatch batch = {slices, 0, slices->size()};
+
+  pthread_mutex_lock(&mutex);
+  queue.push_back(&batch);
+  pthread_cond_broadcast(&queued);
+
+  while (batch.next < slices->size()) {
+    DecodeSlice *slice = take(&batch);
+
+    pthread_mutex_unlock(&mutex);
+    decodeSlice(slice);
+    pthread_mutex_lock(&mutex);
+
+    --batch.pending;
+  }
+  while (batch.pending > 0) pthread_cond_wait(&finished, &mutex);
+  pthread_mutex_unlock(&mutex);
+}
+
+// below this many names per thread, handing out slices costs more than it
+// saves
+static const size_t MinNamesPerThread = 64;
+static const unsigned int MaxDecodeThreads = 8;
+
+static unsigned int decodeThreads() {
+  unsigned int threads = std::thread::hardware_concurrency();
+  return (threads > MaxDecodeThreads) ? MaxDecodeThreads : threads;
+}
+
+bool NameIO::concurrentDecode() const { return false; }
+
+void NameIO::decodeNames(const std::vector<std::string> &encoded, uint64_t iv,
+                         std::vector<std::string> *plaintext) const {
+  plaintext->resize(encoded.size());
+
+  // a cipher which serialises its users would only make the threads queue
+  unsigned int threads = concurrentDecode() ? decodeThreads() : 1;
+  if (threads > encoded.size() / MinNamesPerThread)
+    threads = encoded.size() / MinNamesPerThread;
+
+  if (threads <= 1) {
+    DecodeSlice all = {this, &encoded, iv, plaintext, 0, encoded.size()};
+    decodeSlice(&all);
+    return;
+  }
+
+  std::vector<DecodeSlice> slices(threads);
+  size_t per = (encoded.size() + threads - 1) / threads;
+  for (unsigned int t = 0; t < threads; ++t) {
+    size_t begin = t * per;
+    size_t end = (begin + per < encoded.size()) ? begin + per : encoded.size();
+    DecodeSlice slice = {this, &encoded, iv, plaintext, begin, end};
+    slices[t] = slice;
+  }
+
+  // never destroyed, its threads may be waiting on it until the process ends
+  static DecodePool *pool = new DecodePool(decodeThreads() - 1);
+  pool->run(&slices);
+}
+
 int NameIO::encodeName(const char *input, int length, char *output,
                        int bufferLength) const {
   return encodeName(input, length, (uint64_t *)0, output, bufferLength);
@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <string>
+#include <vector>
 
 #include "CipherKey.h"
 #include "Interface.h"
@@ -61,6 +62,13 @@ class NameIO {
                        const Interface &iface, Constructor constructor,
                        bool hidden = false);
 
+  /*
+      The newest version of the block and stream codings is the one with
+      per-directory IVs (kept by DirNode).  Filesystems without them are
+      recorded with the version before, so older releases still mount them.
+  */
+  static Interface ConfigInterface(const Interface &iface, bool directoryIV);
+
   NameIO();
   virtual ~NameIO();
 
@@ -77,6 +85,29 @@ class NameIO {
   std::string encodePath(const char *plaintextPath, uint64_t *iv) const;
   std::string decodePath(const char *encodedPath, uint64_t *iv) const;
 
+  /*
+      Same as above, but the result is written to buf without touching the
+      heap.  Returns the length of the result, or -1 if it doesn't fit in
+      bufLen bytes along with its terminating NUL.
+  */
+  int encodePath(const char *plaintextPath, uint64_t *iv, char *buf,
+                 int bufLen) const;
+  int decodePath(const char *encodedPath, uint64_t *iv, char *buf,
+                 int bufLen) const;
+
+  /*
+      Decode a batch of names from one directory, which all share the
+      directory's IV.  Large batches are spread over a pool of threads if
+      concurrentDecode() allows it.  plaintext[i] is the decoding of
+      encoded[i], or empty if that name can't be decoded.
+  */
+  void decodeNames(const std::vector<std::string> &encoded, uint64_t iv,
+                   std::vector<std::string> *plaintext) const;
+
+  // true if names can be decoded on several threads at once without them
+  // waiting on each other
+  virtual bool concurrentDecode() const;
+
   virtual int maxEncodedNameLen(int plaintextNameLen) const = 0;
   virtual int maxDecodedNameLen(int encodedNameLen) const = 0;
 
@@ -100,6 +131,10 @@ class NameIO {
                                                    uint64_t *, char *, int)
                              const,
                          uint64_t *iv) const;
+  int recodePath(const char *path, int (NameIO::*codingLen)(int) const,
+                 int (NameIO::*codingFunc)(const char *, int, uint64_t *,
+                                           char *, int) const,
+                 uint64_t *iv, char *buf, int bufLen) const;
 
   std::string _encodePath(const char *plaintextPath, uint64_t *iv) const;
   std::string _decodePath(const char *encodedPath, uint64_t *iv) const;
@@ -117,6 +152,9 @@ class NameIO {
 
     BUFFER_RESET should be called for the same name as BUFFER_INIT
 */
+// paths up to this length are coded in stack buffers
+static const int PathBufferSize = 1024;
+
 #define BUFFER_INIT(Name, OptimizedSize, Size)          \
   char Name##_Raw[OptimizedSize];                       \
   char *Name = Name##_Raw;                              \
@@ -108,6 +108,8 @@ int NullCipher::keySize() const { return 0; }
 
 int NullCipher::cipherBlockSize() const { return 1; }
 
+bool NullCipher::concurrentUse() const { return true; }
+
 bool NullCipher::streamEncode(unsigned char *src, int len, uint64_t iv64,
                               const CipherKey &key) const {
   (void)src;
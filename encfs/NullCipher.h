@@ -61,6 +61,7 @@ class NullCipher : public Cipher {
   virtual int keySize() const;
   virtual int encodedKeySize() const;
   virtual int cipherBlockSize() const;
+  virtual bool concurrentUse() const;
 
   virtual bool randomize(unsigned char *buf, int len, bool strongRandom) const;
 
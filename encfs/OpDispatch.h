@@ -0,0 +1,119 @@
+/*****************************************************************************
+ * Author:   Valient Gough <vgough@pobox.com>
+ *
+ *****************************************************************************
+ * Copyright (c) 2003-2007, Valient Gough
+ *
+ * This program is free software; you can distribute it and/or modify it under
+ * the terms of the GNU General Public License (GPL), as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef _OpDispatch_incl_
+#define _OpDispatch_incl_
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "Context.h"
+#include "DirNode.h"
+#include "Error.h"
+#include "FileNode.h"
+#include "easylogging++.h"
+#include "fuse.h"
+
+namespace encfs {
+
+/*
+    Dispatch helpers used by the FUSE operations in encfs.cpp.
+
+    The operation is taken as a template parameter rather than a
+    std::function, so binding the call arguments never allocates.  Cipher
+    paths are built in stack buffers, so apart from path cache misses and
+    the FileNode created by a lookup of a file which isn't open, nothing
+    here touches the heap.
+*/
+
+// apply a functor to a cipher path (a const char *), given the plain path
+template <typename Op>
+int withCipherPath(EncFS_Context *ctx, const char *opName, const char *path,
+                   Op op, bool passReturnCode = false) {
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) return res;
+
+  try {
+    char buf[PathBufferSize];
+    std::string longName;
+    const char *cyName = buf;
+    if (FSRoot->cipherPath(path, buf, sizeof(buf)) < 0) {
+      longName = FSRoot->cipherPath(path);
+      cyName = longName.c_str();
+    }
+    VLOG(1) << "op: " << opName << " : " << cyName;
+
+    res = op(ctx, cyName);
+
+    if (res == -1) {
+      int eno = errno;
+      VLOG(1) << "op: " << opName << " error: " << strerror(eno);
+      res = -eno;
+    } else if (!passReturnCode) {
+      res = 0;
+    }
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "withCipherPath: error caught in " << opName << ": "
+                << err.what();
+  }
+  return res;
+}
+
+// apply a functor to a node, the open one from fi if there is one
+template <typename Op>
+int withFileNode(EncFS_Context *ctx, const char *opName, const char *path,
+                 struct fuse_file_info *fi, Op op) {
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) return res;
+
+  try {
+
+    auto do_op = [&FSRoot, opName, &op](FileNode *fnode) {
+      rAssert(fnode != nullptr);
+      VLOG(1) << "op: " << opName << " : " << fnode->cipherName();
+
+      // check that we're not recursing into the mount point itself
+      if (FSRoot->touchesMountpoint(fnode->cipherName())) {
+        VLOG(1) << "op: " << opName << " error: Tried to touch mountpoint: '"
+                << fnode->cipherName() << "'";
+        return -EIO;
+      }
+      return op(fnode);
+    };
+
+    if (fi != nullptr && fi->fh != 0)
+      res = do_op(reinterpret_cast<FileNode *>(fi->fh));
+    else
+      res = do_op(FSRoot->lookupNode(path, opName).get());
+
+    if (res < 0) {
+      RLOG(DEBUG) << "op: " << opName << " error: " << strerror(-res);
+    }
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "withFileNode: error caught in " << opName << ": "
+                << err.what();
+  }
+  return res;
+}
+
+}  // namespace encfs
+
+#endif
@@ -31,6 +31,7 @@
 
 #include "Error.h"
 #include "FileIO.h"
+#include "Mutex.h"
 #include "RawFileIO.h"
 
 using namespace std;
@@ -50,8 +51,25 @@ inline void swap(int &x, int &y) {
   y = tmp;
 }
 
+// a read-only view of the whole file, unmapped once no reader holds it.
+struct RawFileIO::Mapping {
+  unsigned char *data;
+  FUSE_OFF_T size;
+
+  Mapping(void *data_, FUSE_OFF_T size_)
+      : data((unsigned char *)data_), size(size_) {}
+  ~Mapping() { unix::munmap(data, (size_t)size); }
+};
+
 RawFileIO::RawFileIO()
-    : knownSize(false), fileSize(0), fd(-1), oldfd(-1), canWrite(false) {}
+    : knownSize(false),
+      fileSize(0),
+      fd(-1),
+      oldfd(-1),
+      canWrite(false),
+      useMapping(false) {
+  pthread_mutex_init(&mapMutex, 0);
+}
 
 RawFileIO::RawFileIO(const std::string &fileName)
     : name(fileName),
@@ -59,12 +77,18 @@ RawFileIO::RawFileIO(const std::string &fileName)
       fileSize(0),
       fd(-1),
       oldfd(-1),
-      canWrite(false) {}
+      canWrite(false),
+      useMapping(false) {
+  pthread_mutex_init(&mapMutex, 0);
+}
 
 RawFileIO::~RawFileIO() {
   int _fd = -1;
   int _oldfd = -1;
 
+  mapping.reset();
+  pthread_mutex_destroy(&mapMutex);
+
   swap(_fd, fd);
   swap(_oldfd, oldfd);
 
@@ -152,6 +176,16 @@ int RawFileIO::open(int flags) {
       canWrite = requestWrite;
       oldfd = fd;
       result = fd = newFd;
+
+      // prime the size from the new descriptor, so that later getSize()
+      // calls (made on every write) don't need to stat the file by name.
+      struct stat_st stbuf;
+      if (unix::fstat(fd, &stbuf) == 0) {
+        fileSize = stbuf.st_size;
+        knownSize = true;
+      } else {
+        knownSize = false;
+      }
     } else {
       result = -errno;
       RLOG(DEBUG) << "::open error: " << strerror(errno);
@@ -162,7 +196,9 @@ int RawFileIO::open(int flags) {
 }
 
 int RawFileIO::getAttr(struct stat_st *stbuf) const {
-  int res = unix::lstat(name.c_str(), stbuf);
+  // prefer the open descriptor, it is cheaper than a lookup by name
+  int res = (fd >= 0) ? unix::fstat(fd, stbuf)
+                      : unix::lstat(name.c_str(), stbuf);
   int eno = errno;
 
   if (res < 0) {
@@ -178,9 +214,10 @@ const char *RawFileIO::getFileName() const { return name.c_str(); }
 
 FUSE_OFF_T RawFileIO::getSize() const {
   if (!knownSize) {
-	struct stat_st stbuf;
+    struct stat_st stbuf;
     memset(&stbuf, 0, sizeof(struct stat_st));
-    int res = unix::lstat(name.c_str(), &stbuf);
+    int res = (fd >= 0) ? unix::fstat(fd, &stbuf)
+                        : unix::lstat(name.c_str(), &stbuf);
 
     if (res == 0) {
       const_cast<RawFileIO *>(this)->fileSize = stbuf.st_size;
@@ -195,9 +232,69 @@ FUSE_OFF_T RawFileIO::getSize() const {
   }
 }
 
+void RawFileIO::setMapped(bool mapped) { useMapping = mapped; }
+
+FUSE_OFF_T RawFileIO::mappedSize() const {
+  Lock _lock(mapMutex);
+  return mapping ? mapping->size : 0;
+}
+
+/*
+    Return a mapping which covers [0, end) if the file is that large.  The
+    file may have grown since it was last mapped, in which case it is mapped
+    again.  Readers keep their own reference, so an old mapping stays valid
+    until they are done with it.
+*/
+std::shared_ptr<RawFileIO::Mapping> RawFileIO::currentMapping(
+    FUSE_OFF_T end) const {
+  Lock _lock(mapMutex);
+
+  if (mapping && mapping->size >= end) return mapping;
+
+  struct stat_st stbuf;
+  if (unix::fstat(fd, &stbuf) != 0) return mapping;
+
+  FUSE_OFF_T size = stbuf.st_size;
+  if (size <= 0 || (mapping && size <= mapping->size) ||
+      (uint64_t)size > (uint64_t)SIZE_MAX)
+    return mapping;
+
+  void *addr = unix::mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    RLOG(WARNING) << "mmap of " << name << " failed, using pread: "
+                  << strerror(errno);
+    useMapping = false;
+    return mapping;
+  }
+
+  VLOG(1) << "mapped " << size << " bytes of " << name;
+  mapping = std::make_shared<Mapping>(addr, size);
+  return mapping;
+}
+
+// returns -1 if the request can't be served from a mapping.  The data is
+// still copied: blocks are decoded in place in the caller's buffer, so this
+// only saves the system call and the kernel's copy which pread makes.
+ssize_t RawFileIO::readMapped(const IORequest &req) const {
+  std::shared_ptr<Mapping> m = currentMapping(req.offset + req.dataLen);
+  if (!m) return -1;
+
+  if (req.offset >= m->size) return 0;
+
+  FUSE_OFF_T avail = m->size - req.offset;
+  ssize_t len = (avail < req.dataLen) ? (ssize_t)avail : req.dataLen;
+  memcpy(req.data, m->data + req.offset, len);
+  return len;
+}
+
 ssize_t RawFileIO::read(const IORequest &req) const {
   rAssert(fd >= 0);
 
+  if (useMapping) {
+    ssize_t mappedSize = readMapped(req);
+    if (mappedSize >= 0) return mappedSize;
+  }
+
   ssize_t readSize = unix::pread(fd, req.data, req.dataLen, req.offset);
 
   if (readSize < 0) {
@@ -275,6 +372,27 @@ int RawFileIO::truncate(FUSE_OFF_T size) {
   return res;
 }
 
+int RawFileIO::allocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length) {
+  if (fd < 0 || !canWrite) return -EBADF;
+
+  int res = unix::fallocate(fd, mode, offset, length);
+  if (res < 0) {
+    int eno = errno;
+    RLOG(WARNING) << "fallocate failed for " << name << " (" << fd
+                  << ") mode " << mode << ", offset " << offset << ", length "
+                  << length << ", error " << strerror(eno);
+    knownSize = false;
+    return -eno;
+  }
+
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && knownSize) {
+    FUSE_OFF_T last = offset + length;
+    if (last > fileSize) fileSize = last;
+  }
+
+  return 0;
+}
+
 bool RawFileIO::isWritable() const { return canWrite; }
 
 }  // namespace encfs
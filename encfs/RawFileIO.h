@@ -21,6 +21,8 @@
 #ifndef _RawFileIO_incl_
 #define _RawFileIO_incl_
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <sys/types.h>
 
@@ -49,18 +51,35 @@ class RawFileIO : public FileIO {
   virtual bool write(const IORequest &req);
 
   virtual int truncate(FUSE_OFF_T size);
+  virtual int allocate(int mode, FUSE_OFF_T offset, FUSE_OFF_T length);
 
   virtual bool isWritable() const;
 
+  // Serve reads from a read-only mapping of the file instead of pread.
+  // Only for files which are never written through this FileIO.
+  void setMapped(bool mapped);
+  // size of the current mapping, 0 if the file isn't mapped
+  FUSE_OFF_T mappedSize() const;
+
  protected:
+  struct Mapping;
+  std::shared_ptr<Mapping> currentMapping(FUSE_OFF_T end) const;
+  ssize_t readMapped(const IORequest &req) const;
+
   std::string name;
 
-  bool knownSize;
-  FUSE_OFF_T fileSize;
+  // shared by concurrent readers and writers of different blocks
+  std::atomic<bool> knownSize;
+  std::atomic<FUSE_OFF_T> fileSize;
 
   int fd;
   int oldfd;
   bool canWrite;
+
+  // cleared by a reader if mapping fails, while others may be testing it
+  mutable std::atomic<bool> useMapping;
+  mutable pthread_mutex_t mapMutex;
+  mutable std::shared_ptr<Mapping> mapping;
 };
 
 }  // namespace encfs
@@ -218,6 +218,43 @@ static bool AES_Cipher_registered =
                      AESBlockRange, NewAESCipher);
 #endif
 
+/*
+    Cipher and MAC contexts for one operation at a time.  A key keeps a free
+    list of these, so that threads using the same key don't wait on each
+    other; the key's mutex is only held to take a set from the list, or to
+    put it back.
+*/
+struct SSLContexts {
+  EVP_CIPHER_CTX block_enc;
+  EVP_CIPHER_CTX block_dec;
+  EVP_CIPHER_CTX stream_enc;
+  EVP_CIPHER_CTX stream_dec;
+
+  HMAC_CTX mac_ctx;
+
+  SSLContexts *next;
+
+  SSLContexts();
+  ~SSLContexts();
+};
+
+SSLContexts::SSLContexts() : next(0) {
+  EVP_CIPHER_CTX_init(&block_enc);
+  EVP_CIPHER_CTX_init(&block_dec);
+  EVP_CIPHER_CTX_init(&stream_enc);
+  EVP_CIPHER_CTX_init(&stream_dec);
+  HMAC_CTX_init(&mac_ctx);
+}
+
+SSLContexts::~SSLContexts() {
+  EVP_CIPHER_CTX_cleanup(&block_enc);
+  EVP_CIPHER_CTX_cleanup(&block_dec);
+  EVP_CIPHER_CTX_cleanup(&stream_enc);
+  EVP_CIPHER_CTX_cleanup(&stream_dec);
+
+  HMAC_CTX_cleanup(&mac_ctx);
+}
+
 class SSLKey : public AbstractCipherKey {
  public:
   pthread_mutex_t mutex;
@@ -229,18 +266,16 @@ class SSLKey : public AbstractCipherKey {
   // followed by iv of _ivLength bytes,
   unsigned char *buffer;
 
-  EVP_CIPHER_CTX block_enc;
-  EVP_CIPHER_CTX block_dec;
-  EVP_CIPHER_CTX stream_enc;
-  EVP_CIPHER_CTX stream_dec;
-
-  HMAC_CTX mac_ctx;
+  // set up once by initKey, and copied for each set handed out
+  SSLContexts initial;
+  // sets not in use, protected by mutex
+  SSLContexts *idle;
 
   SSLKey(int keySize, int ivLength);
   ~SSLKey();
 };
 
-SSLKey::SSLKey(int keySize_, int ivLength_) {
+SSLKey::SSLKey(int keySize_, int ivLength_) : idle(0) {
   this->keySize = keySize_;
   this->ivLength = ivLength_;
   pthread_mutex_init(&mutex, 0);
@@ -250,12 +285,6 @@ SSLKey::SSLKey(int keySize_, int ivLength_) {
   // most likely fails unless we're running as root, or a user-page-lock
   // kernel patch is applied..
   mlock(buffer, keySize + ivLength);
-
-  EVP_CIPHER_CTX_init(&block_enc);
-  EVP_CIPHER_CTX_init(&block_dec);
-  EVP_CIPHER_CTX_init(&stream_enc);
-  EVP_CIPHER_CTX_init(&stream_dec);
-  HMAC_CTX_init(&mac_ctx);
 }
 
 SSLKey::~SSLKey() {
@@ -268,16 +297,60 @@ SSLKey::~SSLKey() {
   ivLength = 0;
   buffer = 0;
 
-  EVP_CIPHER_CTX_cleanup(&block_enc);
-  EVP_CIPHER_CTX_cleanup(&block_dec);
-  EVP_CIPHER_CTX_cleanup(&stream_enc);
-  EVP_CIPHER_CTX_cleanup(&stream_dec);
-
-  HMAC_CTX_cleanup(&mac_ctx);
+  while (idle) {
+    SSLContexts *ctx = idle;
+    idle = ctx->next;
+    delete ctx;
+  }
 
   pthread_mutex_destroy(&mutex);
 }
 
+/*
+    Takes a set of contexts from the key for as long as it lives, making a
+    new one if all are in use.
+*/
+class ContextLease {
+ public:
+  explicit ContextLease(SSLKey *key);
+  ~ContextLease();
+
+  SSLContexts *operator->() const { return _ctx; }
+  SSLContexts *get() const { return _ctx; }
+
+ private:
+  ContextLease(const ContextLease &src);             // not allowed
+  ContextLease &operator=(const ContextLease &src);  // not allowed
+
+  SSLKey *_key;
+  SSLContexts *_ctx;
+};
+
+ContextLease::ContextLease(SSLKey *key) : _key(key) {
+  {
+    Lock lock(key->mutex);
+    _ctx = key->idle;
+    if (_ctx) key->idle = _ctx->next;
+  }
+
+  if (!_ctx) {
+    // the initial contexts aren't changed after initKey, so copying them
+    // needs no lock
+    _ctx = new SSLContexts();
+    EVP_CIPHER_CTX_copy(&_ctx->block_enc, &key->initial.block_enc);
+    EVP_CIPHER_CTX_copy(&_ctx->block_dec, &key->initial.block_dec);
+    EVP_CIPHER_CTX_copy(&_ctx->stream_enc, &key->initial.stream_enc);
+    EVP_CIPHER_CTX_copy(&_ctx->stream_dec, &key->initial.stream_dec);
+    HMAC_CTX_copy(&_ctx->mac_ctx, &key->initial.mac_ctx);
+  }
+}
+
+ContextLease::~ContextLease() {
+  Lock lock(_key->mutex);
+  _ctx->next = _key->idle;
+  _key->idle = _ctx;
+}
+
 inline unsigned char *KeyData(const std::shared_ptr<SSLKey> &key) {
   return key->buffer;
 }
@@ -288,29 +361,30 @@ inline unsigned char *IVData(const std::shared_ptr<SSLKey> &key) {
 void initKey(const std::shared_ptr<SSLKey> &key, const EVP_CIPHER *_blockCipher,
              const EVP_CIPHER *_streamCipher, int _keySize) {
   Lock lock(key->mutex);
+  SSLContexts *ctx = &key->initial;
   // initialize the cipher context once so that we don't have to do it for
   // every block..
-  EVP_EncryptInit_ex(&key->block_enc, _blockCipher, NULL, NULL, NULL);
-  EVP_DecryptInit_ex(&key->block_dec, _blockCipher, NULL, NULL, NULL);
-  EVP_EncryptInit_ex(&key->stream_enc, _streamCipher, NULL, NULL, NULL);
-  EVP_DecryptInit_ex(&key->stream_dec, _streamCipher, NULL, NULL, NULL);
-
-  EVP_CIPHER_CTX_set_key_length(&key->block_enc, _keySize);
-  EVP_CIPHER_CTX_set_key_length(&key->block_dec, _keySize);
-  EVP_CIPHER_CTX_set_key_length(&key->stream_enc, _keySize);
-  EVP_CIPHER_CTX_set_key_length(&key->stream_dec, _keySize);
-
-  EVP_CIPHER_CTX_set_padding(&key->block_enc, 0);
-  EVP_CIPHER_CTX_set_padding(&key->block_dec, 0);
-  EVP_CIPHER_CTX_set_padding(&key->stream_enc, 0);
-  EVP_CIPHER_CTX_set_padding(&key->stream_dec, 0);
-
-  EVP_EncryptInit_ex(&key->block_enc, NULL, NULL, KeyData(key), NULL);
-  EVP_DecryptInit_ex(&key->block_dec, NULL, NULL, KeyData(key), NULL);
-  EVP_EncryptInit_ex(&key->stream_enc, NULL, NULL, KeyData(key), NULL);
-  EVP_DecryptInit_ex(&key->stream_dec, NULL, NULL, KeyData(key), NULL);
-
-  HMAC_Init_ex(&key->mac_ctx, KeyData(key), _keySize, EVP_sha1(), 0);
+  EVP_EncryptInit_ex(&ctx->block_enc, _blockCipher, NULL, NULL, NULL);
+  EVP_DecryptInit_ex(&ctx->block_dec, _blockCipher, NULL, NULL, NULL);
+  EVP_EncryptInit_ex(&ctx->stream_enc, _streamCipher, NULL, NULL, NULL);
+  EVP_DecryptInit_ex(&ctx->stream_dec, _streamCipher, NULL, NULL, NULL);
+
+  EVP_CIPHER_CTX_set_key_length(&ctx->block_enc, _keySize);
+  EVP_CIPHER_CTX_set_key_length(&ctx->block_dec, _keySize);
+  EVP_CIPHER_CTX_set_key_length(&ctx->stream_enc, _keySize);
+  EVP_CIPHER_CTX_set_key_length(&ctx->stream_dec, _keySize);
+
+  EVP_CIPHER_CTX_set_padding(&ctx->block_enc, 0);
+  EVP_CIPHER_CTX_set_padding(&ctx->block_dec, 0);
+  EVP_CIPHER_CTX_set_padding(&ctx->stream_enc, 0);
+  EVP_CIPHER_CTX_set_padding(&ctx->stream_dec, 0);
+
+  EVP_EncryptInit_ex(&ctx->block_enc, NULL, NULL, KeyData(key), NULL);
+  EVP_DecryptInit_ex(&ctx->block_dec, NULL, NULL, KeyData(key), NULL);
+  EVP_EncryptInit_ex(&ctx->stream_enc, NULL, NULL, KeyData(key), NULL);
+  EVP_DecryptInit_ex(&ctx->stream_dec, NULL, NULL, KeyData(key), NULL);
+
+  HMAC_Init_ex(&ctx->mac_ctx, KeyData(key), _keySize, EVP_sha1(), 0);
 }
 
 SSL_Cipher::SSL_Cipher(const Interface &iface_, const Interface &realIface_,
@@ -446,13 +520,13 @@ CipherKey SSL_Cipher::newRandomKey() {
 static uint64_t _checksum_64(SSLKey *key, const unsigned char *data,
                              int dataLen, uint64_t *chainedIV) {
   rAssert(dataLen > 0);
-  Lock lock(key->mutex);
+  ContextLease ctx(key);
 
   unsigned char md[EVP_MAX_MD_SIZE];
   unsigned int mdLen = EVP_MAX_MD_SIZE;
 
-  HMAC_Init_ex(&key->mac_ctx, 0, 0, 0, 0);
-  HMAC_Update(&key->mac_ctx, data, dataLen);
+  HMAC_Init_ex(&ctx->mac_ctx, 0, 0, 0, 0);
+  HMAC_Update(&ctx->mac_ctx, data, dataLen);
   if (chainedIV) {
     // toss in the chained IV as well
     uint64_t tmp = *chainedIV;
@@ -462,10 +536,10 @@ static uint64_t _checksum_64(SSLKey *key, const unsigned char *data,
       tmp >>= 8;
     }
 
-    HMAC_Update(&key->mac_ctx, h, 8);
+    HMAC_Update(&ctx->mac_ctx, h, 8);
   }
 
-  HMAC_Final(&key->mac_ctx, md, &mdLen);
+  HMAC_Final(&ctx->mac_ctx, md, &mdLen);
 
   rAssert(mdLen >= 8);
 
@@ -623,7 +697,8 @@ int SSL_Cipher::cipherBlockSize() const {
  * requirement for "seed" is that is must be unique.
  */
 void SSL_Cipher::setIVec(unsigned char *ivec, uint64_t seed,
-                         const std::shared_ptr<SSLKey> &key) const {
+                         const std::shared_ptr<SSLKey> &key,
+                         SSLContexts *ctx) const {
   if (iface.current() >= 3) {
     memcpy(ivec, IVData(key), _ivLength);
 
@@ -636,10 +711,10 @@ void SSL_Cipher::setIVec(unsigned char *ivec, uint64_t seed,
     }
 
     // combine ivec and seed with HMAC
-    HMAC_Init_ex(&key->mac_ctx, 0, 0, 0, 0);
-    HMAC_Update(&key->mac_ctx, ivec, _ivLength);
-    HMAC_Update(&key->mac_ctx, md, 8);
-    HMAC_Final(&key->mac_ctx, md, &mdLen);
+    HMAC_Init_ex(&ctx->mac_ctx, 0, 0, 0, 0);
+    HMAC_Update(&ctx->mac_ctx, ivec, _ivLength);
+    HMAC_Update(&ctx->mac_ctx, md, 8);
+    HMAC_Final(&ctx->mac_ctx, md, &mdLen);
     rAssert(mdLen >= _ivLength);
 
     memcpy(ivec, md, _ivLength);
@@ -723,25 +798,25 @@ bool SSL_Cipher::streamEncode(unsigned char *buf, int size, uint64_t iv64,
   rAssert(key->keySize == _keySize);
   rAssert(key->ivLength == _ivLength);
 
-  Lock lock(key->mutex);
+  ContextLease ctx(key.get());
 
   unsigned char ivec[MAX_IVLENGTH];
   int dstLen = 0, tmpLen = 0;
 
   shuffleBytes(buf, size);
 
-  setIVec(ivec, iv64, key);
-  EVP_EncryptInit_ex(&key->stream_enc, NULL, NULL, NULL, ivec);
-  EVP_EncryptUpdate(&key->stream_enc, buf, &dstLen, buf, size);
-  EVP_EncryptFinal_ex(&key->stream_enc, buf + dstLen, &tmpLen);
+  setIVec(ivec, iv64, key, ctx.get());
+  EVP_EncryptInit_ex(&ctx->stream_enc, NULL, NULL, NULL, ivec);
+  EVP_EncryptUpdate(&ctx->stream_enc, buf, &dstLen, buf, size);
+  EVP_EncryptFinal_ex(&ctx->stream_enc, buf + dstLen, &tmpLen);
 
   flipBytes(buf, size);
   shuffleBytes(buf, size);
 
-  setIVec(ivec, iv64 + 1, key);
-  EVP_EncryptInit_ex(&key->stream_enc, NULL, NULL, NULL, ivec);
-  EVP_EncryptUpdate(&key->stream_enc, buf, &dstLen, buf, size);
-  EVP_EncryptFinal_ex(&key->stream_enc, buf + dstLen, &tmpLen);
+  setIVec(ivec, iv64 + 1, key, ctx.get());
+  EVP_EncryptInit_ex(&ctx->stream_enc, NULL, NULL, NULL, ivec);
+  EVP_EncryptUpdate(&ctx->stream_enc, buf, &dstLen, buf, size);
+  EVP_EncryptFinal_ex(&ctx->stream_enc, buf + dstLen, &tmpLen);
 
   dstLen += tmpLen;
   if (dstLen != size) {
@@ -759,23 +834,23 @@ bool SSL_Cipher::streamDecode(unsigned char *buf, int size, uint64_t iv64,
   rAssert(key->keySize == _keySize);
   rAssert(key->ivLength == _ivLength);
 
-  Lock lock(key->mutex);
+  ContextLease ctx(key.get());
 
   unsigned char ivec[MAX_IVLENGTH];
   int dstLen = 0, tmpLen = 0;
 
-  setIVec(ivec, iv64 + 1, key);
-  EVP_DecryptInit_ex(&key->stream_dec, NULL, NULL, NULL, ivec);
-  EVP_DecryptUpdate(&key->stream_dec, buf, &dstLen, buf, size);
-  EVP_DecryptFinal_ex(&key->stream_dec, buf + dstLen, &tmpLen);
+  setIVec(ivec, iv64 + 1, key, ctx.get());
+  EVP_DecryptInit_ex(&ctx->stream_dec, NULL, NULL, NULL, ivec);
+  EVP_DecryptUpdate(&ctx->stream_dec, buf, &dstLen, buf, size);
+  EVP_DecryptFinal_ex(&ctx->stream_dec, buf + dstLen, &tmpLen);
 
   unshuffleBytes(buf, size);
   flipBytes(buf, size);
 
-  setIVec(ivec, iv64, key);
-  EVP_DecryptInit_ex(&key->stream_dec, NULL, NULL, NULL, ivec);
-  EVP_DecryptUpdate(&key->stream_dec, buf, &dstLen, buf, size);
-  EVP_DecryptFinal_ex(&key->stream_dec, buf + dstLen, &tmpLen);
+  setIVec(ivec, iv64, key, ctx.get());
+  EVP_DecryptInit_ex(&ctx->stream_dec, NULL, NULL, NULL, ivec);
+  EVP_DecryptUpdate(&ctx->stream_dec, buf, &dstLen, buf, size);
+  EVP_DecryptFinal_ex(&ctx->stream_dec, buf + dstLen, &tmpLen);
 
   unshuffleBytes(buf, size);
 
@@ -796,20 +871,20 @@ bool SSL_Cipher::blockEncode(unsigned char *buf, int size, uint64_t iv64,
   rAssert(key->ivLength == _ivLength);
 
   // data must be integer number of blocks
-  const int blockMod = size % EVP_CIPHER_CTX_block_size(&key->block_enc);
+  const int blockMod = size % EVP_CIPHER_block_size(_blockCipher);
   if (blockMod != 0)
     throw Error("Invalid data size, not multiple of block size");
 
-  Lock lock(key->mutex);
+  ContextLease ctx(key.get());
 
   unsigned char ivec[MAX_IVLENGTH];
 
   int dstLen = 0, tmpLen = 0;
-  setIVec(ivec, iv64, key);
+  setIVec(ivec, iv64, key, ctx.get());
 
-  EVP_EncryptInit_ex(&key->block_enc, NULL, NULL, NULL, ivec);
-  EVP_EncryptUpdate(&key->block_enc, buf, &dstLen, buf, size);
-  EVP_EncryptFinal_ex(&key->block_enc, buf + dstLen, &tmpLen);
+  EVP_EncryptInit_ex(&ctx->block_enc, NULL, NULL, NULL, ivec);
+  EVP_EncryptUpdate(&ctx->block_enc, buf, &dstLen, buf, size);
+  EVP_EncryptFinal_ex(&ctx->block_enc, buf + dstLen, &tmpLen);
   dstLen += tmpLen;
 
   if (dstLen != size) {
@@ -828,20 +903,20 @@ bool SSL_Cipher::blockDecode(unsigned char *buf, int size, uint64_t iv64,
   rAssert(key->ivLength == _ivLength);
 
   // data must be integer number of blocks
-  const int blockMod = size % EVP_CIPHER_CTX_block_size(&key->block_dec);
+  const int blockMod = size % EVP_CIPHER_block_size(_blockCipher);
   if (blockMod != 0)
     throw Error("Invalid data size, not multiple of block size");
 
-  Lock lock(key->mutex);
+  ContextLease ctx(key.get());
 
   unsigned char ivec[MAX_IVLENGTH];
 
   int dstLen = 0, tmpLen = 0;
-  setIVec(ivec, iv64, key);
+  setIVec(ivec, iv64, key, ctx.get());
 
-  EVP_DecryptInit_ex(&key->block_dec, NULL, NULL, NULL, ivec);
-  EVP_DecryptUpdate(&key->block_dec, buf, &dstLen, buf, size);
-  EVP_DecryptFinal_ex(&key->block_dec, buf + dstLen, &tmpLen);
+  EVP_DecryptInit_ex(&ctx->block_dec, NULL, NULL, NULL, ivec);
+  EVP_DecryptUpdate(&ctx->block_dec, buf, &dstLen, buf, size);
+  EVP_DecryptFinal_ex(&ctx->block_dec, buf + dstLen, &tmpLen);
   dstLen += tmpLen;
 
   if (dstLen != size) {
@@ -852,6 +927,9 @@ bool SSL_Cipher::blockDecode(unsigned char *buf, int size, uint64_t iv64,
   return true;
 }
 
+// each operation takes its own set of contexts from the key
+bool SSL_Cipher::concurrentUse() const { return true; }
+
 bool SSL_Cipher::Enabled() { return true; }
 
 }  // namespace encfs
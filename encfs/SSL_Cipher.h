@@ -37,6 +37,7 @@ typedef struct evp_cipher_st EVP_CIPHER;
 namespace encfs {
 
 class SSLKey;
+struct SSLContexts;
 
 /*
     Implements Cipher interface for OpenSSL's ciphers.
@@ -113,6 +114,7 @@ class SSL_Cipher : public Cipher {
   virtual int keySize() const;
   virtual int encodedKeySize() const;
   virtual int cipherBlockSize() const;
+  virtual bool concurrentUse() const;
 
   virtual bool randomize(unsigned char *buf, int len, bool strongRandom) const;
 
@@ -143,7 +145,7 @@ class SSL_Cipher : public Cipher {
 
  private:
   void setIVec(unsigned char *ivec, uint64_t seed,
-               const std::shared_ptr<SSLKey> &key) const;
+               const std::shared_ptr<SSLKey> &key, SSLContexts *ctx) const;
 
   // deprecated - for backward compatibility
   void setIVec_old(unsigned char *ivec, unsigned int seed,
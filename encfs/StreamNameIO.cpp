@@ -65,10 +65,15 @@ static bool StreamIO_registered = NameIO::Register(
       bits.
 
     - Version 2.1 adds support for version 0 for EncFS 0.x compatibility.
+
+    - Version 3.0 chains each directory's names from a random IV stored in
+      the directory, rather than from the path.  The coding itself is the
+      same as 2.1, the version only keeps older releases from mounting such
+      a filesystem.
 */
 Interface StreamNameIO::CurrentInterface() {
-  // implement major version 2, 1, and 0
-  return Interface("nameio/stream", 2, 1, 2);
+  // implement major version 3, 2, 1, and 0
+  return Interface("nameio/stream", 3, 0, 3);
 }
 
 StreamNameIO::StreamNameIO(const Interface &iface,
@@ -90,6 +95,10 @@ int StreamNameIO::maxDecodedNameLen(int encodedStreamLen) const {
   return decLen256 - 2;
 }
 
+bool StreamNameIO::concurrentDecode() const {
+  return _cipher->concurrentUse();
+}
+
 int StreamNameIO::encodeName(const char *plaintextName, int length,
                              uint64_t *iv, char *encodedName,
                              int bufferLength) const {
@@ -137,7 +146,7 @@ int StreamNameIO::decodeName(const char *encodedName, int length, uint64_t *iv,
 
   if (decodedStreamLen <= 0) throw Error("Filename too small to decode");
 
-  BUFFER_INIT(tmpBuf, 32, (unsigned int)length);
+  BUFFER_INIT(tmpBuf, 256, (unsigned int)length);
 
   // decode into tmpBuf, because this step produces more data then we can fit
   // into the result buffer..
@@ -45,6 +45,8 @@ class StreamNameIO : public NameIO {
   virtual int maxEncodedNameLen(int plaintextNameLen) const;
   virtual int maxDecodedNameLen(int encodedNameLen) const;
 
+  virtual bool concurrentDecode() const;
+
   // hack to help with static builds
   static bool Enabled();
 
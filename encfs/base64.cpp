@@ -20,7 +20,17 @@
 
 #include "base64.h"
 
+#include <algorithm>
 #include <ctype.h>  // for toupper
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
 
 #include "Error.h"
 
@@ -59,53 +69,131 @@ void changeBase2(unsigned char *src, int srcLen, int src2Pow,
     Same as changeBase2, except the output is written over the input data.  The
     output is assumed to be large enough to accept the data.
 
-    Uses the stack to store output values.  Recurse every time a new value is
-    to be written, then write the value at the tail end of the recursion.
+    When unpacking (dst2Pow < src2Pow) output value k never needs an input
+    byte past index k, so the values are produced from the tail backwards.
+    When packing, the output never overtakes the input and a forward pass
+    suffices.  Both produce exactly the values (and value count) of the
+    original recursive implementation, including for out of range inputs.
 */
-static void changeBase2Inline(unsigned char *src, int srcLen, int src2Pow,
-                              int dst2Pow, bool outputPartialLastByte,
-                              unsigned long work, int workBits,
-                              unsigned char *outLoc) {
-  const int mask = (1 << dst2Pow) - 1;
-  if (!outLoc) outLoc = src;
 
-  // copy the new bits onto the high bits of the stream.
-  // The bits that fall off the low end are the output bits.
-  while (srcLen && workBits < dst2Pow) {
-    work |= ((unsigned long)(*src++)) << workBits;
-    workBits += src2Pow;
-    --srcLen;
+// number of values a recursive pass would have written
+static int inlineOutputCount(int srcLen, int src2Pow, int dst2Pow,
+                             bool outputPartialLastByte) {
+  if (srcLen == 0) return 1;
+  int bits = srcLen * src2Pow;
+  if (outputPartialLastByte) return (bits + dst2Pow - 1) / dst2Pow;
+  return ((srcLen - 1) * src2Pow) / dst2Pow + 1;
+}
+
+// 8 bit bytes to smaller values, working backwards from the last value.
+static void unpackBytes(unsigned char *buf, int srcLen, int dst2Pow,
+                        int outLen) {
+  const unsigned int mask = (1 << dst2Pow) - 1;
+  int groups = 0;
+  if (dst2Pow == 6)
+    groups = std::min(srcLen / 3, outLen / 4);
+  else if (dst2Pow == 5)
+    groups = std::min(srcLen / 5, outLen / 8);
+  const int groupOut = (dst2Pow == 6) ? 4 : 8;
+
+  // values past the last whole group, one at a time
+  for (int k = outLen - 1; k >= groups * groupOut; --k) {
+    int bit = k * dst2Pow;
+    int byte = bit >> 3;
+    int shift = bit & 7;
+    unsigned int v = (byte < srcLen) ? buf[byte] : 0;
+    if (shift + dst2Pow > 8 && byte + 1 < srcLen) v |= buf[byte + 1] << 8;
+    buf[k] = (unsigned char)((v >> shift) & mask);
   }
 
-  // we have at least one value that can be output
-  unsigned char outVal = (unsigned char) work & mask;
-  work >>= dst2Pow;
-  workBits -= dst2Pow;
-
-  if (srcLen) {
-    // more input left, so recurse
-    changeBase2Inline(src, srcLen, src2Pow, dst2Pow, outputPartialLastByte,
-                      work, workBits, outLoc + 1);
-    *outLoc = outVal;
-  } else {
-    // no input left, we can write remaining values directly
-    *outLoc++ = outVal;
-
-    // we could have a partial value left in the work buffer..
-    if (outputPartialLastByte) {
-      while (workBits > 0) {
-		  *outLoc++ = (unsigned char) work & mask;
-        work >>= dst2Pow;
-        workBits -= dst2Pow;
+  if (dst2Pow == 6) {
+    for (int g = groups - 1; g >= 0; --g) {
+      const unsigned char *in = buf + g * 3;
+      uint32_t w = in[0] | (in[1] << 8) | ((uint32_t)in[2] << 16);
+      unsigned char *out = buf + g * 4;
+      out[3] = (unsigned char)(w >> 18);
+      out[2] = (unsigned char)((w >> 12) & 0x3f);
+      out[1] = (unsigned char)((w >> 6) & 0x3f);
+      out[0] = (unsigned char)(w & 0x3f);
+    }
+  } else if (dst2Pow == 5) {
+    for (int g = groups - 1; g >= 0; --g) {
+      const unsigned char *in = buf + g * 5;
+      uint64_t w = 0;
+      for (int i = 4; i >= 0; --i) w = (w << 8) | in[i];
+      unsigned char *out = buf + g * 8;
+      for (int i = 7; i >= 0; --i)
+        out[i] = (unsigned char)((w >> (i * 5)) & 0x1f);
+    }
+  }
+}
+
+// small values to larger ones, out may be the same as src.  Values wider than
+// src2Pow overlap their neighbours exactly as they did in the recursive
+// version.
+static void packValues(const unsigned char *src, int srcLen, int src2Pow,
+                       unsigned char *out, int dst2Pow,
+                       bool outputPartialLastByte) {
+  const unsigned int mask = (1 << dst2Pow) - 1;
+  uint64_t work = 0;
+  int workBits = 0;
+
+  if (dst2Pow == 8 && (src2Pow == 6 || src2Pow == 5)) {
+    const int groupIn = (src2Pow == 6) ? 4 : 8;
+    const int groupOut = (src2Pow == 6) ? 3 : 5;
+    bool any = false;
+    while (srcLen >= groupIn) {
+      for (int i = 0; i < groupIn; ++i)
+        work |= (uint64_t)src[i] << (i * src2Pow);
+      src += groupIn;
+      srcLen -= groupIn;
+      for (int i = 0; i < groupOut; ++i) {
+        *out++ = (unsigned char)work;
+        work >>= 8;
       }
+      any = true;
+    }
+    // whole groups leave no pending bits, so nothing more to emit
+    if (any && !srcLen) return;
+  }
+
+  do {
+    while (srcLen && workBits < dst2Pow) {
+      work |= (uint64_t)(*src++) << workBits;
+      workBits += src2Pow;
+      --srcLen;
+    }
+    *out++ = (unsigned char)(work & mask);
+    work >>= dst2Pow;
+    workBits -= dst2Pow;
+  } while (srcLen);
+
+  if (outputPartialLastByte) {
+    while (workBits > 0) {
+      *out++ = (unsigned char)(work & mask);
+      work >>= dst2Pow;
+      workBits -= dst2Pow;
     }
   }
 }
 
 void changeBase2Inline(unsigned char *src, int srcLen, int src2Pow, int dst2Pow,
                        bool outputPartialLastByte) {
-  changeBase2Inline(src, srcLen, src2Pow, dst2Pow, outputPartialLastByte, 0, 0,
-                    0);
+  if (dst2Pow >= src2Pow) {
+    packValues(src, srcLen, src2Pow, src, dst2Pow, outputPartialLastByte);
+    return;
+  }
+
+  int outLen =
+      inlineOutputCount(srcLen, src2Pow, dst2Pow, outputPartialLastByte);
+  if (src2Pow == 8) {
+    unpackBytes(src, srcLen, dst2Pow, outLen);
+    return;
+  }
+
+  // unusual base pair, read from a copy of the input
+  std::vector<unsigned char> tmp(src, src + srcLen);
+  packValues(tmp.data(), srcLen, src2Pow, src, dst2Pow, outputPartialLastByte);
 }
 
 // character set for ascii b64:
@@ -114,55 +202,193 @@ void changeBase2Inline(unsigned char *src, int srcLen, int src2Pow, int dst2Pow,
 // do that because '/' is a reserved character, and it is useful not to have
 // '.' included in the encrypted names, so that it can be reserved for files
 // with special meaning.
-static const char B642AsciiTable[] = ",-0123456789";
-void B64ToAscii(unsigned char *in, int length) {
-  for (int offset = 0; offset < length; ++offset) {
-    int ch = in[offset];
-    if (ch > 11) {
+//
+// The translations below are table driven, with an SSE2 path for 16 byte
+// blocks where the processor has it.  Every byte value maps to the same
+// result as the original branchy loops, so malformed names fail the same
+// way they always did.
+namespace {
+
+struct AsciiTables {
+  unsigned char b64ToAscii[256];
+  unsigned char asciiToB64[256];
+  unsigned char b32ToAscii[256];
+  unsigned char asciiToB32[128];
+
+  AsciiTables() {
+    static const char B642AsciiTable[] = ",-0123456789";
+    static const unsigned char Ascii2B64Table[] =
+        "                                            01  23456789:;       ";
+    //  0123456789 123456789 123456789 123456789 123456789 123456789 1234
+    //  0         1         2         3         4         5         6
+    for (int ch = 0; ch < 256; ++ch) {
       if (ch > 37)
-        ch += 'a' - 38;
+        b64ToAscii[ch] = (unsigned char)(ch + 'a' - 38);
+      else if (ch > 11)
+        b64ToAscii[ch] = (unsigned char)(ch + 'A' - 12);
+      else
+        b64ToAscii[ch] = B642AsciiTable[ch];
+
+      if (ch >= 'a')
+        asciiToB64[ch] = (unsigned char)(ch + 38 - 'a');
+      else if (ch >= 'A')
+        asciiToB64[ch] = (unsigned char)(ch + 12 - 'A');
       else
-        ch += 'A' - 12;
-    } else
-      ch = B642AsciiTable[ch];
+        asciiToB64[ch] = (unsigned char)(Ascii2B64Table[ch] - '0');
 
-    in[offset] = ch;
+      b32ToAscii[ch] =
+          (unsigned char)((ch < 26) ? ch + 'A' : ch + '2' - 26);
+    }
+    // only the ASCII half; toupper above that depends on the locale
+    for (int ch = 0; ch < 128; ++ch) {
+      int lch = (ch >= 'a' && ch <= 'z') ? ch - 'a' + 'A' : ch;
+      asciiToB32[ch] =
+          (unsigned char)((lch >= 'A') ? lch - 'A' : lch + 26 - '2');
+    }
   }
+};
+
+const AsciiTables &tables() {
+  static const AsciiTables t;
+  return t;
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define HAVE_SSE2_CODING 1
+
+#if defined(_MSC_VER)
+#define SSE2_TARGET
+#else
+#define SSE2_TARGET __attribute__((target("sse2")))
+#endif
+
+bool detectSSE2() {
+#if defined(_M_X64) || defined(__x86_64__)
+  return true;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+#else
+  return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool haveSSE2() {
+  static const bool have = detectSSE2();
+  return have;
+}
+
+// unsigned a >= b, per byte
+SSE2_TARGET inline __m128i geU8(__m128i a, __m128i b) {
+  return _mm_cmpeq_epi8(_mm_max_epu8(a, b), a);
+}
+
+SSE2_TARGET inline __m128i splat(int v) { return _mm_set1_epi8((char)v); }
+
+SSE2_TARGET int b64ToAsciiSSE2(unsigned char *buf, int length) {
+  int done = 0;
+  for (; done + 16 <= length; done += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + done));
+    __m128i off = splat(',');
+    off = _mm_add_epi8(off, _mm_and_si128(geU8(v, splat(2)), splat(2)));
+    off = _mm_add_epi8(off, _mm_and_si128(geU8(v, splat(12)), splat(7)));
+    off = _mm_add_epi8(off, _mm_and_si128(geU8(v, splat(38)), splat(6)));
+    _mm_storeu_si128((__m128i *)(buf + done), _mm_add_epi8(v, off));
+  }
+  return done;
+}
+
+SSE2_TARGET int asciiToB64SSE2(unsigned char *out, const unsigned char *in,
+                               int length) {
+  int done = 0;
+  for (; done + 16 <= length; done += 16) {
+    __m128i ch = _mm_loadu_si128((const __m128i *)(in + done));
+    // letters
+    __m128i upper = geU8(ch, splat('A'));
+    __m128i letter = _mm_sub_epi8(
+        ch, _mm_add_epi8(splat('A' - 12),
+                         _mm_and_si128(geU8(ch, splat('a')), splat(6))));
+    // ',' and '-'
+    __m128i punct = _mm_or_si128(_mm_cmpeq_epi8(ch, splat(',')),
+                                 _mm_cmpeq_epi8(ch, splat('-')));
+    // '0' - '9'
+    __m128i digit = _mm_andnot_si128(geU8(ch, splat('9' + 1)),
+                                     geU8(ch, splat('0')));
+    __m128i low = _mm_or_si128(
+        _mm_and_si128(punct, _mm_sub_epi8(ch, splat(','))),
+        _mm_and_si128(digit, _mm_sub_epi8(ch, splat('0' - 2))));
+    low = _mm_or_si128(
+        low, _mm_andnot_si128(_mm_or_si128(punct, digit), splat(' ' - '0')));
+    __m128i r = _mm_or_si128(_mm_and_si128(upper, letter),
+                             _mm_andnot_si128(upper, low));
+    _mm_storeu_si128((__m128i *)(out + done), r);
+  }
+  return done;
+}
+
+SSE2_TARGET int b32ToAsciiSSE2(unsigned char *buf, int length) {
+  int done = 0;
+  for (; done + 16 <= length; done += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + done));
+    __m128i off = _mm_sub_epi8(
+        splat('A'), _mm_and_si128(geU8(v, splat(26)), splat('A' - '2' + 26)));
+    _mm_storeu_si128((__m128i *)(buf + done), _mm_add_epi8(v, off));
+  }
+  return done;
+}
+
+SSE2_TARGET int asciiToB32SSE2(unsigned char *out, const unsigned char *in,
+                               int length) {
+  int done = 0;
+  for (; done + 16 <= length; done += 16) {
+    __m128i ch = _mm_loadu_si128((const __m128i *)(in + done));
+    // leave anything outside ASCII to the scalar loop
+    if (_mm_movemask_epi8(ch)) break;
+    __m128i lower = _mm_andnot_si128(geU8(ch, splat('z' + 1)),
+                                     geU8(ch, splat('a')));
+    __m128i lch = _mm_sub_epi8(ch, _mm_and_si128(lower, splat('a' - 'A')));
+    __m128i off = _mm_add_epi8(
+        splat('2' - 26),
+        _mm_and_si128(geU8(lch, splat('A')), splat('A' - '2' + 26)));
+    _mm_storeu_si128((__m128i *)(out + done), _mm_sub_epi8(lch, off));
+  }
+  return done;
+}
+#endif
+
+}  // namespace
+
+void B64ToAscii(unsigned char *in, int length) {
+  int offset = 0;
+#ifdef HAVE_SSE2_CODING
+  if (haveSSE2()) offset = b64ToAsciiSSE2(in, length);
+#endif
+  const unsigned char *table = tables().b64ToAscii;
+  for (; offset < length; ++offset) in[offset] = table[in[offset]];
 }
 
-static const unsigned char Ascii2B64Table[] =
-    "                                            01  23456789:;       ";
-//  0123456789 123456789 123456789 123456789 123456789 123456789 1234
-//  0         1         2         3         4         5         6
 void AsciiToB64(unsigned char *in, int length) {
   return AsciiToB64(in, in, length);
 }
 
 void AsciiToB64(unsigned char *out, const unsigned char *in, int length) {
-  while (length--) {
-    unsigned char ch = *in++;
-    if (ch >= 'A') {
-      if (ch >= 'a')
-        ch += 38 - 'a';
-      else
-        ch += 12 - 'A';
-    } else
-      ch = Ascii2B64Table[ch] - '0';
-
-    *out++ = ch;
-  }
+  int offset = 0;
+#ifdef HAVE_SSE2_CODING
+  if (haveSSE2()) offset = asciiToB64SSE2(out, in, length);
+#endif
+  const unsigned char *table = tables().asciiToB64;
+  for (; offset < length; ++offset) out[offset] = table[in[offset]];
 }
 
 void B32ToAscii(unsigned char *buf, int len) {
-  for (int offset = 0; offset < len; ++offset) {
-    int ch = buf[offset];
-    if (ch >= 0 && ch < 26)
-      ch += 'A';
-    else
-      ch += '2' - 26;
-
-    buf[offset] = ch;
-  }
+  int offset = 0;
+#ifdef HAVE_SSE2_CODING
+  if (haveSSE2()) offset = b32ToAsciiSSE2(buf, len);
+#endif
+  const unsigned char *table = tables().b32ToAscii;
+  for (; offset < len; ++offset) buf[offset] = table[buf[offset]];
 }
 
 void AsciiToB32(unsigned char *in, int length) {
@@ -170,15 +396,23 @@ void AsciiToB32(unsigned char *in, int length) {
 }
 
 void AsciiToB32(unsigned char *out, const unsigned char *in, int length) {
-  while (length--) {
-    unsigned char ch = *in++;
-    int lch = toupper(ch);
-    if (lch >= 'A')
-      lch -= 'A';
-    else
-      lch += 26 - '2';
-
-    *out++ = (unsigned char)lch;
+  int offset = 0;
+#ifdef HAVE_SSE2_CODING
+  if (haveSSE2()) offset = asciiToB32SSE2(out, in, length);
+#endif
+  const unsigned char *table = tables().asciiToB32;
+  for (; offset < length; ++offset) {
+    unsigned char ch = in[offset];
+    if (ch < 128) {
+      out[offset] = table[ch];
+    } else {
+      int lch = toupper(ch);
+      if (lch >= 'A')
+        lch -= 'A';
+      else
+        lch += 26 - '2';
+      out[offset] = (unsigned char)lch;
+    }
   }
 }
 
@@ -50,6 +50,11 @@ void pthread_join(pthread_t thread, int)
   WaitForSingleObject(thread, INFINITE);
 }
 
+void pthread_detach(pthread_t thread)
+{
+  CloseHandle(thread);
+}
+
 
 #if !defined(USE_LEGACY_DOKAN)
 struct errentry
@@ -206,6 +211,118 @@ int unix::ftruncate(int fd, __int64 length)
   return truncate_handle(h, length);
 }
 
+/*
+    Backing files are always opened sparse (see my_open), so hole punching
+    maps onto FSCTL_SET_ZERO_DATA, which deallocates the range.  Plain
+    preallocation only grows the allocation size, it never shrinks it.
+*/
+int unix::fallocate(int fd, int mode, __int64 offset, __int64 length)
+{
+  //VLOG(1) << "NOTIFY -- unix::fallocate";
+  HANDLE h = (HANDLE)_get_osfhandle(fd);
+  if (h == INVALID_HANDLE_VALUE) {
+    errno = EBADF;
+    return -1;
+  }
+  if (offset < 0 || length <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  FILE_STANDARD_INFO info;
+  if (!GetFileInformationByHandleEx(h, FileStandardInfo, &info, sizeof(info))) {
+    errno = ERRNO_FROM_WIN32(GetLastError());
+    return -1;
+  }
+
+  __int64 end = offset + length;
+  if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+    // anything past the end of file already reads as zeros
+    FILE_ZERO_DATA_INFORMATION fzdi;
+    fzdi.FileOffset.QuadPart = offset;
+    fzdi.BeyondFinalZero.QuadPart =
+      end < info.EndOfFile.QuadPart ? end : info.EndOfFile.QuadPart;
+    DWORD returned;
+    if (offset < fzdi.BeyondFinalZero.QuadPart &&
+      !DeviceIoControl(h, FSCTL_SET_ZERO_DATA, &fzdi, sizeof(fzdi), NULL, 0,
+      &returned, NULL)) {
+      errno = ERRNO_FROM_WIN32(GetLastError());
+      return -1;
+    }
+  } else if (end > info.AllocationSize.QuadPart) {
+    FILE_ALLOCATION_INFO fai;
+    fai.AllocationSize.QuadPart = end;
+    if (!SetFileInformationByHandle(h, FileAllocationInfo, &fai, sizeof(fai))) {
+      errno = ERRNO_FROM_WIN32(GetLastError());
+      return -1;
+    }
+  }
+
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && end > info.EndOfFile.QuadPart) {
+    FILE_END_OF_FILE_INFO eof;
+    eof.EndOfFile.QuadPart = end;
+    if (!SetFileInformationByHandle(h, FileEndOfFileInfo, &eof, sizeof(eof))) {
+      errno = ERRNO_FROM_WIN32(GetLastError());
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+    Only read-only shared mappings are supported.  The mapping object is
+    closed right away, the view keeps it alive until munmap.
+*/
+void *unix::mmap(void *addr, size_t length, int prot, int flags, int fd,
+  __int64 offset)
+{
+  //VLOG(1) << "NOTIFY -- unix::mmap";
+  (void)addr;
+  if (prot != PROT_READ || flags != MAP_SHARED || length == 0) {
+    errno = EINVAL;
+    return MAP_FAILED;
+  }
+
+  HANDLE h = (HANDLE)_get_osfhandle(fd);
+  if (h == INVALID_HANDLE_VALUE) {
+    errno = EBADF;
+    return MAP_FAILED;
+  }
+
+  unsigned __int64 end = offset + length;
+  HANDLE m = CreateFileMappingW(h, NULL, PAGE_READONLY, (DWORD)(end >> 32),
+    (DWORD)end, NULL);
+  if (m == NULL) {
+    errno = ERRNO_FROM_WIN32(GetLastError());
+    return MAP_FAILED;
+  }
+
+  void *view = MapViewOfFile(m, FILE_MAP_READ, (DWORD)(offset >> 32),
+    (DWORD)offset, length);
+  int save_errno = ERRNO_FROM_WIN32(GetLastError());
+  CloseHandle(m);
+  if (view == NULL) {
+    errno = save_errno;
+    return MAP_FAILED;
+  }
+  return view;
+}
+
+int unix::munmap(void *addr, size_t length)
+{
+  //VLOG(1) << "NOTIFY -- unix::munmap";
+  (void)length;
+  if (!UnmapViewOfFile(addr)) {
+    errno = ERRNO_FROM_WIN32(GetLastError());
+    return -1;
+  }
+  return 0;
+}
+
 int unix::truncate(const char *path, __int64 length)
 {
   //VLOG(1) << "NOTIFY -- unix::truncate";
@@ -628,20 +745,110 @@ unix::rmdir(const char *path)
   return 0;
 }
 
+/*
+    st_dev is the serial number of the volume, which is what
+    GetFileInformationByHandle reports for an open file.  This looks it up
+    for a path when there is no handle, 0 if it can't be found.  Only the
+    volume root is looked up for each path, the serial is queried once per
+    root (a mount rarely spans more than one).
+*/
+struct VolumeSerial
+{
+  std::wstring root;
+  DWORD serial;
+};
+static SRWLOCK volumeSerialLock = SRWLOCK_INIT;
+static std::vector<VolumeSerial> volumeSerials;
+
+static DWORD
+volume_serial(const wchar_t *fn)
+{
+  wchar_t root[MAX_PATH];
+  if (!GetVolumePathNameW(fn, root, MAX_PATH))
+    return 0;
+
+  AcquireSRWLockShared(&volumeSerialLock);
+  for (size_t i = 0; i < volumeSerials.size(); ++i) {
+    if (volumeSerials[i].root == root) {
+      DWORD serial = volumeSerials[i].serial;
+      ReleaseSRWLockShared(&volumeSerialLock);
+      return serial;
+    }
+  }
+  ReleaseSRWLockShared(&volumeSerialLock);
+
+  VolumeSerial vs;
+  if (!GetVolumeInformationW(root, NULL, 0, &vs.serial, NULL, NULL, NULL, 0))
+    return 0;
+  vs.root = root;
+
+  AcquireSRWLockExclusive(&volumeSerialLock);
+  volumeSerials.push_back(vs);
+  ReleaseSRWLockExclusive(&volumeSerialLock);
+  return vs.serial;
+}
+
+static void
+fill_stat(struct stat_st *buffer, DWORD dev, DWORD attributes, uint64_t ino,
+  uint64_t size, const FILETIME *ftLastAccessTime,
+  const FILETIME *ftLastWriteTime, const FILETIME *ftCreationTime)
+{
+  unsigned mode;
+  if (attributes & FILE_ATTRIBUTE_DIRECTORY)
+    mode = _S_IFDIR | 0777;
+  else
+    mode = _S_IFREG | 0666;
+  // Set attributes of file/directory
+  if (attributes & FILE_ATTRIBUTE_READONLY)
+    mode &= ~0222;
+  // The following solution is not complete, Cygwin does not correctly detect such items as links...
+  // if (attributes & FILE_ATTRIBUTE_REPARSE_POINT)
+  //   mode |= S_IFLNK;
+
+  buffer->st_dev = buffer->st_rdev = dev;
+  buffer->st_ino = ino;
+  buffer->st_mode = mode;
+  buffer->st_nlink = 1;
+  buffer->st_uid = 0;
+  buffer->st_gid = 0;
+  buffer->st_size = size;
+
+#ifdef USE_LEGACY_DOKAN
+  buffer->st_atime = filetimeToUnixTime(ftLastAccessTime);
+  buffer->st_mtime = filetimeToUnixTime(ftLastWriteTime);
+  buffer->st_ctime = filetimeToUnixTime(ftCreationTime);
+#else
+  buffer->st_atim.tv_sec = filetimeToUnixTime(ftLastAccessTime);
+  buffer->st_mtim.tv_sec = filetimeToUnixTime(ftLastWriteTime);
+  buffer->st_ctim.tv_sec = filetimeToUnixTime(ftCreationTime);
+#endif
+}
+
+// longest converted path unix::stat keeps on the stack
+static const size_t StackPathLen = 1024;
+
 int
 unix::stat(const char *path, struct stat_st *buffer)
 {
   //VLOG(1) << "NOTIFY -- unix::stat";
-  std::wstring fn = utf8_to_wfn(path).c_str();
-  if (fn.length() && fn[fn.length() - 1] == L'\\')
-    fn.resize(fn.length() - 1);
+  // stat is on every lookup, so typical paths are converted on the stack
+  wchar_t buf[StackPathLen];
+  std::wstring longName;
+  wchar_t *fn = utf8_to_wfn_buf(path, buf, StackPathLen);
+  if (!fn) {
+    longName = utf8_to_wfn(path);
+    fn = &longName[0];
+  }
+  size_t fnLen = wcslen(fn);
+  if (fnLen && fn[fnLen - 1] == L'\\')
+    fn[fnLen - 1] = L'\0';
   if (strpbrk(path, "?*") != NULL) {
     errno = ENOENT;
     return -1;
   }
 
   // We need an active file handle in order to get the file index ID 
-  HANDLE hff = CreateFileW(fn.c_str(), GENERIC_READ,
+  HANDLE hff = CreateFileW(fn, GENERIC_READ,
     FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE,
     NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
 
@@ -661,15 +868,17 @@ unix::stat(const char *path, struct stat_st *buffer)
   FILETIME *ftLastWriteTime = &hfi.ftLastWriteTime;
   FILETIME *ftCreationTime = &hfi.ftCreationTime;
 
+  DWORD dev;
   if (hff != INVALID_HANDLE_VALUE && GetFileInformationByHandle(hff, &hfi)) {
     CloseHandle(hff);
+    dev = hfi.dwVolumeSerialNumber;
   }
   else {
     ftLastAccessTime = &wfd.ftLastAccessTime;
     ftLastWriteTime = &wfd.ftLastWriteTime;
     ftCreationTime = &wfd.ftCreationTime;
     // https://bugs.ruby-lang.org/issues/6845
-    hff = FindFirstFileW(fn.c_str(), &wfd);
+    hff = FindFirstFileW(fn, &wfd);
     if (hff != INVALID_HANDLE_VALUE) {
       FindClose(hff);
     }
@@ -677,44 +886,42 @@ unix::stat(const char *path, struct stat_st *buffer)
       errno = ERRNO_FROM_WIN32(GetLastError());
       return -1;
     }
+    dev = volume_serial(fn);
   }
 
-  int drive;
-  if (path[1] == ':')
-    drive = tolower(path[0]) - 'a';
-  else
-    drive = _getdrive() - 1;
+  fill_stat(buffer, dev, hfi.dwFileAttributes + wfd.dwFileAttributes,
+    (hfi.nFileIndexHigh + 0) * (((uint64_t)1) << 32) + (hfi.nFileIndexLow + 0),
+    (hfi.nFileSizeHigh + wfd.nFileSizeHigh) * (((uint64_t)1) << 32) + (hfi.nFileSizeLow + wfd.nFileSizeLow),
+    ftLastAccessTime, ftLastWriteTime, ftCreationTime);
 
+  return 0;
+}
 
-  unsigned mode;
-  if ((hfi.dwFileAttributes + wfd.dwFileAttributes) & FILE_ATTRIBUTE_DIRECTORY)
-    mode = _S_IFDIR | 0777;
-  else
-    mode = _S_IFREG | 0666;
-  // Set attributes of file/directory
-  if ((hfi.dwFileAttributes + wfd.dwFileAttributes) & FILE_ATTRIBUTE_READONLY)
-    mode &= ~0222;
-  // The following solution is not complete, Cygwin does not correctly detect such items as links...
-  // if ((hfi.dwFileAttributes + wfd.dwFileAttributes) & FILE_ATTRIBUTE_REPARSE_POINT)
-  //   mode |= S_IFLNK;
+/*
+    Same as stat, but works from an already open descriptor.  This avoids
+    reopening the file by name (and the path conversion that goes with it),
+    which matters on the read/write paths where we already hold a handle.
+*/
+int
+unix::fstat(int fd, struct stat_st *buffer)
+{
+  //VLOG(1) << "NOTIFY -- unix::fstat";
+  HANDLE h = (HANDLE)_get_osfhandle(fd);
+  if (h == INVALID_HANDLE_VALUE) {
+    errno = EBADF;
+    return -1;
+  }
 
-  buffer->st_dev = buffer->st_rdev = drive;
-  buffer->st_ino = (hfi.nFileIndexHigh + 0) * (((uint64_t)1) << 32) + (hfi.nFileIndexLow + 0);
-  buffer->st_mode = mode;
-  buffer->st_nlink = 1;
-  buffer->st_uid = 0;
-  buffer->st_gid = 0;
-  buffer->st_size = (hfi.nFileSizeHigh + wfd.nFileSizeHigh) * (((uint64_t)1) << 32) + (hfi.nFileSizeLow + wfd.nFileSizeLow);
+  BY_HANDLE_FILE_INFORMATION hfi;
+  if (!GetFileInformationByHandle(h, &hfi)) {
+    errno = ERRNO_FROM_WIN32(GetLastError());
+    return -1;
+  }
 
-#ifdef USE_LEGACY_DOKAN
-  buffer->st_atime = filetimeToUnixTime(ftLastAccessTime);
-  buffer->st_mtime = filetimeToUnixTime(ftLastWriteTime);
-  buffer->st_ctime = filetimeToUnixTime(ftCreationTime);
-#else
-  buffer->st_atim.tv_sec = filetimeToUnixTime(ftLastAccessTime);
-  buffer->st_mtim.tv_sec = filetimeToUnixTime(ftLastWriteTime);
-  buffer->st_ctim.tv_sec = filetimeToUnixTime(ftCreationTime);
-#endif
+  fill_stat(buffer, hfi.dwVolumeSerialNumber, hfi.dwFileAttributes,
+    hfi.nFileIndexHigh * (((uint64_t)1) << 32) + hfi.nFileIndexLow,
+    hfi.nFileSizeHigh * (((uint64_t)1) << 32) + hfi.nFileSizeLow,
+    &hfi.ftLastAccessTime, &hfi.ftLastWriteTime, &hfi.ftCreationTime);
 
   return 0;
 }
@@ -732,6 +939,7 @@ struct unix::DIR
   struct dirent ent;
   WIN32_FIND_DATAW wfd;
   int pos;
+  DWORD dev;  // st_dev of the entries
 };
 
 unix::DIR*
@@ -745,6 +953,7 @@ unix::opendir(const char *name)
   }
   memset(dir, 0, sizeof(*dir));
   std::wstring path = utf8_to_wfn(name);
+  dir->dev = volume_serial(path.c_str());
   if (path.length() > 0 && path[path.length() - 1] == L'\\')
     path += L"*";
   else
@@ -815,6 +1024,26 @@ skip:
   return &dir->ent;
 }
 
+/*
+    FindNextFile already returns the attributes, size and times of each
+    entry, so they come without opening the file (the fstatat of this port).
+    The find data has no file index, st_ino is left 0.
+*/
+int
+unix::readdirstat(unix::DIR* dir, struct stat_st *buffer)
+{
+  if (!dir || dir->pos <= 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  fill_stat(buffer, dir->dev, dir->wfd.dwFileAttributes, 0,
+    dir->wfd.nFileSizeHigh * (((uint64_t)1) << 32) + dir->wfd.nFileSizeLow,
+    &dir->wfd.ftLastAccessTime, &dir->wfd.ftLastWriteTime,
+    &dir->wfd.ftCreationTime);
+  return 0;
+}
+
 // Similar to utf8_to_wfn, but do not add fn prefixes 
 std::wstring
 nix_to_winw(const std::string& src)
@@ -829,26 +1058,35 @@ nix_to_winw(const std::string& src)
   return buf.data();
 }
 
-std::wstring
-utf8_to_wfn(const std::string& src)
+// utf8_to_wfn into a caller supplied buffer, NULL if it doesn't fit
+wchar_t *
+utf8_to_wfn_buf(const char *src, wchar_t *buf, size_t bufLen)
 {
-  //VLOG(1) << "NOTIFY -- utf8_to_wfn";
-  int len = src.length() + 1;
+  size_t len = strlen(src) + 1;
   const size_t addSpace = 6;
-  std::vector<wchar_t> buf(len + addSpace);
-  utf8_to_wchar_buf(src.c_str(), buf.data() + addSpace, len);
-  for (wchar_t *p = buf.data() + addSpace; *p; ++p)
+  if (len + addSpace > bufLen)
+    return NULL;
+  utf8_to_wchar_buf(src, buf + addSpace, (int)len);
+  for (wchar_t *p = buf + addSpace; *p; ++p)
     if (*p == L'/')
       *p = L'\\';
   char drive = tolower(buf[addSpace]);
   if (drive >= 'a' && drive <= 'z' && buf[addSpace + 1] == ':') {
-    memcpy(buf.data() + (addSpace - 4), L"\\\\?\\", 4 * sizeof(wchar_t));
-    return buf.data() + (addSpace - 4);
+    memcpy(buf + (addSpace - 4), L"\\\\?\\", 4 * sizeof(wchar_t));
+    return buf + (addSpace - 4);
   }
   else if (buf[addSpace] == L'\\' && buf[addSpace + 1] == L'\\') {
-    memcpy(buf.data() + (addSpace - 6), L"\\\\?\\UNC", 7 * sizeof(wchar_t));
-    return buf.data() + (addSpace - 6);
+    memcpy(buf + (addSpace - 6), L"\\\\?\\UNC", 7 * sizeof(wchar_t));
+    return buf + (addSpace - 6);
   }
-  return buf.data() + addSpace;
+  return buf + addSpace;
+}
+
+std::wstring
+utf8_to_wfn(const std::string& src)
+{
+  //VLOG(1) << "NOTIFY -- utf8_to_wfn";
+  std::vector<wchar_t> buf(src.length() + 1 + 6);
+  return utf8_to_wfn_buf(src.c_str(), buf.data(), buf.size());
 }
 
@@ -53,6 +53,7 @@
 #include "FileUtils.h"
 #include "fuse.h"
 #include "Mutex.h"
+#include "OpDispatch.h"
 
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
@@ -82,74 +83,17 @@ static bool isReadOnly(EncFS_Context *ctx) {
   return ctx->opts->readOnly;
 }
 
-// helper function -- apply a functor to a cipher path, given the plain path
-static int withCipherPath(const char *opName, const char *path,
-                          function<int(EncFS_Context *, const string &)> op,
+// dispatch within the context of the current FUSE request, see OpDispatch.h
+template <typename Op>
+static int withCipherPath(const char *opName, const char *path, Op op,
                           bool passReturnCode = false) {
-  EncFS_Context *ctx = context();
-
-  int res = -EIO;
-  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
-  if (!FSRoot) return res;
-
-  try {
-    string cyName = FSRoot->cipherPath(path);
-    VLOG(1) << "op: " << opName << " : " << cyName;
-
-    res = op(ctx, cyName);
-
-    if (res == -1) {
-      int eno = errno;
-      VLOG(1) << "op: " << opName << " error: " << strerror(eno);
-      res = -eno;
-    } else if (!passReturnCode) {
-      res = ESUCCESS;
-    }
-  } catch (encfs::Error &err) {
-    RLOG(ERROR) << "withCipherPath: error caught in " << opName << ": "
-                << err.what();
-  }
-  return res;
+  return withCipherPath(context(), opName, path, op, passReturnCode);
 }
 
-// helper function -- apply a functor to a node
+template <typename Op>
 static int withFileNode(const char *opName, const char *path,
-                        struct fuse_file_info *fi,
-                        function<int(FileNode *)> op) {
-  EncFS_Context *ctx = context();
-
-  int res = -EIO;
-  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
-  if (!FSRoot) return res;
-
-  try {
-
-    auto do_op = [&FSRoot, opName, &op](FileNode *fnode) {
-      rAssert(fnode != nullptr);
-      VLOG(1) << "op: " << opName << " : " << fnode->cipherName();
-
-      // check that we're not recursing into the mount point itself
-      if (FSRoot->touchesMountpoint(fnode->cipherName())) {
-        VLOG(1) << "op: " << opName << " error: Tried to touch mountpoint: '"
-                << fnode->cipherName() << "'";
-        return -EIO;
-      }
-      return op(fnode);
-    };
-
-    if (fi != nullptr && fi->fh != 0)
-      res = do_op(reinterpret_cast<FileNode *>(fi->fh));
-    else
-      res = do_op(FSRoot->lookupNode(path, opName).get());
-
-    if (res < 0) {
-      RLOG(DEBUG) << "op: " << opName << " error: " << strerror(-res);
-    }
-  } catch (encfs::Error &err) {
-    RLOG(ERROR) << "withFileNode: error caught in " << opName << ": "
-                << err.what();
-  }
-  return res;
+                        struct fuse_file_info *fi, Op op) {
+  return withFileNode(context(), opName, path, fi, op);
 }
 
 /*
@@ -190,8 +134,43 @@ int _do_getattr(FileNode *fnode, struct stat_st *stbuf) {
   return res;
 }
 
+// getattr by path, through the attribute cache (see AttrCache)
+static int cachedGetAttr(EncFS_Context *ctx, DirNode *FSRoot,
+                         const char *path, struct stat_st *stbuf) {
+  int res;
+  uint64_t generation;
+  if (ctx->attrCache.lookup(path, stbuf, &res, &generation)) return res;
+
+  res = FSRoot->getAttr(path, stbuf);
+  ctx->attrCache.insert(path, res, stbuf, generation);
+  return res;
+}
+
+// our own change to the contents or identity of a file, which its cached
+// attributes and its change token (see keep_cache in encfs_open) don't
+// survive
+static void contentsChanged(EncFS_Context *ctx, const char *path) {
+  ctx->attrCache.invalidate(path);
+  ctx->fileChanged(path);
+}
+
 int encfs_getattr(const char *path, struct stat_st *stbuf) {
-  return withFileNode("getattr", path, NULL, bind(_do_getattr, _1, stbuf));
+  EncFS_Context *ctx = context();
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) return res;
+
+  // unopened files are stat'ed without building a FileNode
+  try {
+    res = cachedGetAttr(ctx, FSRoot.get(), path, stbuf);
+    if (res < 0) {
+      RLOG(DEBUG) << "op: getattr error: " << strerror(-res);
+    }
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "error caught in getattr: " << err.what();
+  }
+  return res;
 }
 
 int encfs_fgetattr(const char *path, struct stat_st *stbuf,
@@ -233,6 +212,41 @@ int encfs_lock(const char * path, struct fuse_file_info * fi, int cmd, struct fl
   return res;
 }
 
+/*
+    opendir keeps the DirTraverse in fi->fh until releasedir, so a listing
+    which takes several readdir calls is only read and decoded once.  The
+    offset of an entry is the number of names up to and including it.
+*/
+int encfs_opendir(const char *path, struct fuse_file_info *finfo) {
+  EncFS_Context *ctx = context();
+
+  int res = ESUCCESS;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) return res;
+
+  try {
+    DirTraverse dt = FSRoot->openDir(path);
+    if (!dt.valid()) {
+      int eno = errno;
+      VLOG(1) << "opendir request invalid, path: '" << path << "'";
+      return eno ? -eno : -ENOENT;
+    }
+
+    finfo->fh = (uintptr_t) new DirTraverse(dt);
+    return ESUCCESS;
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "Error caught in opendir";
+    return -EIO;
+  }
+}
+
+int encfs_releasedir(const char *path, struct fuse_file_info *finfo) {
+  (void)path;
+  delete reinterpret_cast<DirTraverse *>(finfo->fh);
+  finfo->fh = 0;
+  return ESUCCESS;
+}
+
 int encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                   long long offset, struct fuse_file_info *finfo) {
   EncFS_Context *ctx = context();
@@ -242,29 +256,54 @@ int encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   if (!FSRoot) return res;
 
   try {
+    // without a handle from opendir, the directory is read for this call
+    DirTraverse *dt =
+        finfo ? reinterpret_cast<DirTraverse *>(finfo->fh) : nullptr;
+    std::unique_ptr<DirTraverse> unopened;
+    if (dt == nullptr) {
+      unopened.reset(new DirTraverse(FSRoot->openDir(path)));
+      dt = unopened.get();
+    } else if (offset < dt->tell()) {
+      // rewinddir, or seekdir back to an earlier entry
+      *dt = FSRoot->openDir(path);
+    }
 
-    DirTraverse dt = FSRoot->openDir(path);
+    VLOG(1) << "readdir on " << FSRoot->cipherPath(path) << " from "
+            << offset;
 
-    VLOG(1) << "readdir on " << FSRoot->cipherPath(path);
+    if (dt->valid()) {
+      // seekdir to a later entry
+      while (dt->tell() < offset && !dt->nextPlaintextName().empty()) {
+      }
 
-    if (dt.valid()) {
-      int fileType = 0;
-      ino_t inode = 0;
+      // attributes come with the listing (readdirplus), so that a getattr
+      // per entry isn't needed.  Open files may be ahead of their backing
+      // file and are asked directly, if there are any.
+      bool openFiles = ctx->openFileCount() > 0;
+      struct stat_st st;
+      bool fullAttr = false;
 
-      std::string name = dt.nextPlaintextName(&fileType, &inode);
+      std::string name = dt->nextPlaintextName(&st, &fullAttr);
       while (!name.empty()) {
-        struct stat_st st;
-        st.st_ino = inode;
-        st.st_mode = fileType << 12;
-
-// TODO: add offset support.
+        if (openFiles && fullAttr) {
+          string plainPath(path);
+          if (plainPath[plainPath.length() - 1] != '/') plainPath += '/';
+          plainPath += name;
+          std::shared_ptr<FileNode> node = ctx->lookupNode(plainPath.c_str());
+          if (node) node->getAttr(&st);
+        }
+
+        // a full buffer leaves the entry for the next call
 #if defined(fuse_fill_dir_flags)
-        if (filler(buf, name.c_str(), &st, 0, 0)) break;
+        if (filler(buf, name.c_str(), &st, dt->tell(), 0)) {
 #else
-        if (filler(buf, name.c_str(), &st, 0)) break;
+        if (filler(buf, name.c_str(), &st, dt->tell())) {
 #endif
+          dt->putBack();
+          break;
+        }
 
-        name = dt.nextPlaintextName(&fileType, &inode);
+        name = dt->nextPlaintextName(&st, &fullAttr);
       }
     } else {
       VLOG(1) << "readdir request invalid, path: '" << path << "'";
@@ -352,6 +391,7 @@ int encfs_mknod(const char *path, mode_t mode, dev_t rdev) {
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in mknod: " << err.what();
   }
+  contentsChanged(ctx, path);
   return res;
 }
 
@@ -387,6 +427,7 @@ int encfs_mkdir(const char *path, mode_t mode) {
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in mkdir: " << err.what();
   }
+  ctx->attrCache.invalidate(path);
   return res;
 }
 
@@ -406,19 +447,30 @@ int encfs_unlink(const char *path) {
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in unlink: " << err.what();
   }
+  contentsChanged(ctx, path);
   return res;
 }
 
-int _do_rmdir(EncFS_Context *, const string &cipherPath) {
-  return unix::rmdir(cipherPath.c_str());
-}
-
 int encfs_rmdir(const char *path) {
-  if (isReadOnly(NULL)) return -EROFS;
-  return withCipherPath("rmdir", path, bind(_do_rmdir, _1, _2));
+  EncFS_Context *ctx = context();
+
+  if (isReadOnly(ctx)) return -EROFS;
+
+  int res = -EIO;
+  std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
+  if (!FSRoot) return res;
+
+  try {
+    // DirNode drops its cached encodings below the removed directory
+    res = FSRoot->rmdir(path);
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "error caught in rmdir: " << err.what();
+  }
+  ctx->attrCache.invalidateTree(path);
+  return res;
 }
 
-int _do_readlink(EncFS_Context *ctx, const string &cyName, char *buf,
+int _do_readlink(EncFS_Context *ctx, const char *cyName, char *buf,
                  size_t size) {
   return -EINVAL;
 
@@ -427,7 +479,7 @@ int _do_readlink(EncFS_Context *ctx, const string &cyName, char *buf,
   std::shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) return res;
 
-  res = ::readlink(cyName.c_str(), buf, size - 1);
+  res = ::readlink(cyName, buf, size - 1);
 
   if (res == -1) return -errno;
 
@@ -515,6 +567,9 @@ int encfs_link(const char *from, const char *to) {
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in link: " << err.what();
   }
+  // the link count of from changes too
+  ctx->attrCache.invalidate(from);
+  contentsChanged(ctx, to);
   return res;
 }
 
@@ -532,21 +587,32 @@ int encfs_rename(const char *from, const char *to) {
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in rename: " << err.what();
   }
+  ctx->attrCache.invalidateTree(from);
+  ctx->attrCache.invalidateTree(to);
+  ctx->fileChanged(from);
+  ctx->fileChanged(to);
   return res;
 }
 
-int _do_chmod(EncFS_Context *, const string &cipherPath, mode_t mode) {
-  return unix::chmod(cipherPath.c_str(), mode);
+int _do_chmod(EncFS_Context *, const char *cipherPath, mode_t mode) {
+  return unix::chmod(cipherPath, mode);
 }
 
 int encfs_chmod(const char *path, mode_t mode) {
   if (isReadOnly(NULL)) return -EROFS;
-  return withCipherPath("chmod", path, bind(_do_chmod, _1, _2, mode));
+  int res = withCipherPath("chmod", path, bind(_do_chmod, _1, _2, mode));
+  context()->attrCache.invalidate(path);
+
+  // open nodes cache whether they are writable
+  std::shared_ptr<FileNode> node = context()->lookupNode(path);
+  if (node) node->clearModeCache();
+
+  return res;
 }
 
-int _do_chown(EncFS_Context *, const string &cyName, uid_t u, gid_t g) {
+int _do_chown(EncFS_Context *, const char *cyName, uid_t u, gid_t g) {
 #if 0
-  int res = lchown(cyName.c_str(), u, g);
+  int res = lchown(cyName, u, g);
   return (res == -1) ? -errno : ESUCCESS;
 #endif
   return ESUCCESS;
@@ -554,35 +620,60 @@ int _do_chown(EncFS_Context *, const string &cyName, uid_t u, gid_t g) {
 
 int encfs_chown(const char *path, uid_t uid, gid_t gid) {
   if (isReadOnly(NULL)) return -EROFS;
-  return withCipherPath("chown", path, bind(_do_chown, _1, _2, uid, gid));
+  int res = withCipherPath("chown", path, bind(_do_chown, _1, _2, uid, gid));
+  context()->attrCache.invalidate(path);
+  return res;
 }
 
 int _do_truncate(FileNode *fnode, FUSE_OFF_T size) { return fnode->truncate(size); }
 
 int encfs_truncate(const char *path, long long size) {
   if (isReadOnly(NULL)) return -EROFS;
-  return withFileNode("truncate", path, NULL, bind(_do_truncate, _1, size));
+  int res =
+      withFileNode("truncate", path, NULL, bind(_do_truncate, _1, size));
+  contentsChanged(context(), path);
+  return res;
 }
 
 int encfs_ftruncate(const char *path, long long size, struct fuse_file_info *fi) {
   if (isReadOnly(NULL)) return -EROFS;
-  return withFileNode("ftruncate", path, fi, bind(_do_truncate, _1, size));
+  int res = withFileNode("ftruncate", path, fi, bind(_do_truncate, _1, size));
+  contentsChanged(context(), path);
+  return res;
+}
+
+// Only registered for FUSE 2.9 and later, so never called under Dokany (see
+// main.cpp).
+int _do_fallocate(FileNode *fnode, int mode, FUSE_OFF_T offset,
+                  FUSE_OFF_T length) {
+  return fnode->allocate(mode, offset, length);
 }
 
-int _do_utime(EncFS_Context *, const string &cyName, struct utimbuf *buf) {
-  int res = unix::utime(cyName.c_str(), buf);
+int encfs_fallocate(const char *path, int mode, long long offset,
+                    long long length, struct fuse_file_info *fi) {
+  if (isReadOnly(NULL)) return -EROFS;
+  int res = withFileNode("fallocate", path, fi,
+                         bind(_do_fallocate, _1, mode, offset, length));
+  contentsChanged(context(), path);
+  return res;
+}
+
+int _do_utime(EncFS_Context *, const char *cyName, struct utimbuf *buf) {
+  int res = unix::utime(cyName, buf);
   return (res == -1) ? -errno : ESUCCESS;
 }
 
 int encfs_utime(const char *path, struct utimbuf *buf) {
   if (isReadOnly(NULL)) return -EROFS;
-  return withCipherPath("utime", path, bind(_do_utime, _1, _2, buf));
+  int res = withCipherPath("utime", path, bind(_do_utime, _1, _2, buf));
+  context()->attrCache.invalidate(path);
+  return res;
 }
 
-int _do_utimens(EncFS_Context *, const string &cyName,
+int _do_utimens(EncFS_Context *, const char *cyName,
                 const struct timespec ts[2]) {
 #ifdef HAVE_UTIMENSAT
-  int res = utimensat(AT_FDCWD, cyName.c_str(), ts, AT_SYMLINK_NOFOLLOW);
+  int res = utimensat(AT_FDCWD, cyName, ts, AT_SYMLINK_NOFOLLOW);
 #else
   struct timeval tv[2];
   tv[0].tv_sec = ts[0].tv_sec;
@@ -590,14 +681,16 @@ int _do_utimens(EncFS_Context *, const string &cyName,
   tv[1].tv_sec = ts[1].tv_sec;
   tv[1].tv_usec = ts[1].tv_nsec / 1000;
 
-  int res = unix::utimes(cyName.c_str(), tv);
+  int res = unix::utimes(cyName, tv);
 #endif
   return (res == -1) ? -errno : ESUCCESS;
 }
 
 int encfs_utimens(const char *path, const struct timespec ts[2]) {
   if (isReadOnly(NULL)) return -EROFS;
-  return withCipherPath("utimens", path, bind(_do_utimens, _1, _2, ts));
+  int res = withCipherPath("utimens", path, bind(_do_utimens, _1, _2, ts));
+  context()->attrCache.invalidate(path);
+  return res;
 }
 
 /* Returns 1 for true, 0 for false and -errno on error */
@@ -607,22 +700,20 @@ int isFileReadOnly(const char *path) {
   shared_ptr<DirNode> FSRoot = ctx->getRoot(&res);
   if (!FSRoot) return true;
 
-  shared_ptr<FileNode> node = FSRoot->lookupNode(path, "open");
-  if (node) {
-    struct stat_st stbuf;
-    int res = node->getAttr(&stbuf);
-    if (res != 0) {
-      RLOG(DEBUG) << "isFileReadOnly failed: getAttr error";
-      return -errno;
-    }
-
-    //rAssert(res == 0);
-    //VLOG(1) << "Mode: %lo (octal)\n", (unsigned long)stbuf.st_mode;
+  struct stat_st stbuf;
+  try {
+    res = cachedGetAttr(ctx, FSRoot.get(), path, &stbuf);
+  } catch (encfs::Error &err) {
+    RLOG(ERROR) << "error caught in isFileReadOnly: " << err.what();
+  }
+  if (res != 0) {
+    RLOG(DEBUG) << "isFileReadOnly failed: getAttr error";
+    return res;
+  }
 
-    // No write permissions? 
-    if (S_ISREG(stbuf.st_mode) && !(_S_IWRITE & stbuf.st_mode)) {
-      return 1;
-    }
+  // No write permissions? 
+  if (S_ISREG(stbuf.st_mode) && !(_S_IWRITE & stbuf.st_mode)) {
+    return 1;
   }
 
   return 0;
@@ -654,6 +745,19 @@ int encfs_open(const char *path, struct fuse_file_info *file) {
               << file->flags;
 
       if (res >= 0) {
+        // the kernel's page cache of the file is still good if nothing
+        // changed it since it was last closed.  Only trusted while the
+        // backing watcher reports outside changes: mtimes have one second
+        // resolution, so a same-size rewrite within that second looks
+        // unchanged.  Dokany's FUSE wrapper doesn't read keep_cache (the
+        // Dokan driver manages the Windows cache itself), so there this
+        // only matters to FUSE builds.
+        struct stat_st st;
+        if (!ctx->opts->noCache && ctx->backingWatched &&
+            !(file->flags & O_TRUNC) && fnode->getAttr(&st) == 0 &&
+            ctx->unchangedSinceClose(path, st))
+          file->keep_cache = 1;
+
         file->fh =
             reinterpret_cast<uintptr_t>(ctx->putNode(path, std::move(fnode)));
         res = ESUCCESS;
@@ -662,6 +766,7 @@ int encfs_open(const char *path, struct fuse_file_info *file) {
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in open: " << err.what();
   }
+  if (file->flags & (O_CREAT | O_TRUNC)) contentsChanged(ctx, path);
 
   return res;
 }
@@ -710,7 +815,11 @@ int encfs_release(const char *path, struct fuse_file_info *finfo) {
   EncFS_Context *ctx = context();
 
   try {
-    ctx->eraseNode(path, reinterpret_cast<FileNode *>(finfo->fh));
+    FileNode *fnode = reinterpret_cast<FileNode *>(finfo->fh);
+    struct stat_st st;
+    if (fnode->getAttr(&st) == 0) ctx->fileClosed(path, st);
+
+    ctx->eraseNode(path, fnode);
     return ESUCCESS;
   } catch (encfs::Error &err) {
     RLOG(ERROR) << "error caught in release: " << err.what();
@@ -729,26 +838,36 @@ int encfs_read(const char *path, char *buf, size_t size, long long offset,
 }
 
 int _do_fsync(FileNode *fnode, int dataSync) {
+  if (fnode->isReadOnly()) return -EROFS;
   return fnode->sync(dataSync != 0);
 }
 
 int encfs_fsync(const char *path, int dataSync, struct fuse_file_info *file) {
-  if (isReadOnly(NULL) || isFileReadOnly(path) == 1) return -EROFS;
+  if (isReadOnly(NULL)) return -EROFS;
   return withFileNode("fsync", path, file, bind(_do_fsync, _1, dataSync));
 }
 
-int _do_write(FileNode *fnode, unsigned char *ptr, size_t size, FUSE_OFF_T offset) {
-  if (fnode->write(offset, ptr, size))
-    return size;
-  else
-    return -EIO;
+int _do_write(EncFS_Context *ctx, FileNode *fnode, unsigned char *ptr,
+              size_t size, FUSE_OFF_T offset) {
+  if (fnode->isReadOnly()) return -EROFS;
+  if (!fnode->write(offset, ptr, size)) return -EIO;
+
+  // a write leaves the directory alone, and only the first one since the
+  // attributes were last asked for has anything to drop
+  if (fnode->markAttrChanged()) {
+    ctx->attrCache.invalidatePath(fnode->plaintextName());
+    ctx->fileChanged(fnode->plaintextName());
+  }
+  return size;
 }
 
 int encfs_write(const char *path, const char *buf, size_t size, long long offset,
                 struct fuse_file_info *file) {
-  if (isReadOnly(NULL) || isFileReadOnly(path) == 1) return -EROFS;
-  return withFileNode("write", path, file,
-                      bind(_do_write, _1, (unsigned char *)buf, size, offset));
+  if (isReadOnly(NULL)) return -EROFS;
+  EncFS_Context *ctx = context();
+  return withFileNode(ctx, "write", path, file,
+                      bind(_do_write, ctx, _1, (unsigned char *)buf, size,
+                           offset));
 }
 
 // statfs works even if encfs is detached..
@@ -777,36 +896,41 @@ int encfs_statfs(const char *path, struct statvfs *st) {
 #ifdef HAVE_XATTR
 
 #ifdef XATTR_ADD_OPT
-int _do_setxattr(EncFS_Context *, const string &cyName, const char *name,
+int _do_setxattr(EncFS_Context *, const char *cyName, const char *name,
                  const char *value, size_t size, uint32_t pos) {
   int options = 0;
-  return ::setxattr(cyName.c_str(), name, value, size, pos, options);
+  return ::setxattr(cyName, name, value, size, pos, options);
 }
 int encfs_setxattr(const char *path, const char *name, const char *value,
                    size_t size, int flags, uint32_t position) {
   if (isReadOnly(NULL)) return -EROFS;
   (void)flags;
-  return withCipherPath("setxattr", path, bind(_do_setxattr, _1, _2, name,
-                                               value, size, position));
+  int res = withCipherPath("setxattr", path, bind(_do_setxattr, _1, _2, name,
+                                                  value, size, position));
+  context()->attrCache.invalidate(path);
+  return res;
 }
 #else
-int _do_setxattr(EncFS_Context *, const string &cyName, const char *name,
+int _do_setxattr(EncFS_Context *, const char *cyName, const char *name,
                  const char *value, size_t size, int flags) {
-  return ::setxattr(cyName.c_str(), name, value, size, flags);
+  return ::setxattr(cyName, name, value, size, flags);
 }
 int encfs_setxattr(const char *path, const char *name, const char *value,
                    size_t size, int flags) {
   if (isReadOnly(NULL)) return -EROFS;
-  return withCipherPath("setxattr", path,
-                        bind(_do_setxattr, _1, _2, name, value, size, flags));
+  int res =
+      withCipherPath("setxattr", path,
+                     bind(_do_setxattr, _1, _2, name, value, size, flags));
+  context()->attrCache.invalidate(path);
+  return res;
 }
 #endif
 
 #ifdef XATTR_ADD_OPT
-int _do_getxattr(EncFS_Context *, const string &cyName, const char *name,
+int _do_getxattr(EncFS_Context *, const char *cyName, const char *name,
                  void *value, size_t size, uint32_t pos) {
   int options = 0;
-  return ::getxattr(cyName.c_str(), name, value, size, pos, options);
+  return ::getxattr(cyName, name, value, size, pos, options);
 }
 int encfs_getxattr(const char *path, const char *name, char *value, size_t size,
                    uint32_t position) {
@@ -815,9 +939,9 @@ int encfs_getxattr(const char *path, const char *name, char *value, size_t size,
       bind(_do_getxattr, _1, _2, name, (void *)value, size, position), true);
 }
 #else
-int _do_getxattr(EncFS_Context *, const string &cyName, const char *name,
+int _do_getxattr(EncFS_Context *, const char *cyName, const char *name,
                  void *value, size_t size) {
-  return ::getxattr(cyName.c_str(), name, value, size);
+  return ::getxattr(cyName, name, value, size);
 }
 int encfs_getxattr(const char *path, const char *name, char *value,
                    size_t size) {
@@ -827,13 +951,13 @@ int encfs_getxattr(const char *path, const char *name, char *value,
 }
 #endif
 
-int _do_listxattr(EncFS_Context *, const string &cyName, char *list,
+int _do_listxattr(EncFS_Context *, const char *cyName, char *list,
                   size_t size) {
 #ifdef XATTR_ADD_OPT
   int options = 0;
-  int res = ::listxattr(cyName.c_str(), list, size, options);
+  int res = ::listxattr(cyName, list, size, options);
 #else
-  int res = ::listxattr(cyName.c_str(), list, size);
+  int res = ::listxattr(cyName, list, size);
 #endif
   return (res == -1) ? -errno : res;
 }
@@ -843,12 +967,12 @@ int encfs_listxattr(const char *path, char *list, size_t size) {
                         bind(_do_listxattr, _1, _2, list, size), true);
 }
 
-int _do_removexattr(EncFS_Context *, const string &cyName, const char *name) {
+int _do_removexattr(EncFS_Context *, const char *cyName, const char *name) {
 #ifdef XATTR_ADD_OPT
   int options = 0;
-  int res = ::removexattr(cyName.c_str(), name, options);
+  int res = ::removexattr(cyName, name, options);
 #else
-  int res = ::removexattr(cyName.c_str(), name);
+  int res = ::removexattr(cyName, name);
 #endif
   return (res == -1) ? -errno : res;
 }
@@ -856,8 +980,10 @@ int _do_removexattr(EncFS_Context *, const string &cyName, const char *name) {
 int encfs_removexattr(const char *path, const char *name) {
   if (isReadOnly(NULL)) return -EROFS;
 
-  return withCipherPath("removexattr", path,
-                        bind(_do_removexattr, _1, _2, name));
+  int res = withCipherPath("removexattr", path,
+                           bind(_do_removexattr, _1, _2, name));
+  context()->attrCache.invalidate(path);
+  return res;
 }
 
 #endif  // HAVE_XATTR
@@ -888,9 +1014,11 @@ static int encfs_win_set_attributes(const char *fn, uint32_t attr)
     return res;
 
   std::wstring path = utf8_to_wfn(FSRoot->cipherPath(fn));
-  if (SetFileAttributesW(path.c_str(), attr))
-    return 0;
-  return -ERRNO_FROM_WIN32(GetLastError());
+  res = 0;
+  if (!SetFileAttributesW(path.c_str(), attr))
+    res = -ERRNO_FROM_WIN32(GetLastError());
+  ctx->attrCache.invalidate(fn);
+  return res;
 }
 
 static int _do_win_set_times(FileNode *fnode, const FILETIME *create, const FILETIME *access, const FILETIME *modified)
@@ -910,7 +1038,7 @@ static int _do_win_set_times(FileNode *fnode, const FILETIME *create, const FILE
   return res;
 }
 
-static int encfs_win_set_times(const char *path, struct fuse_file_info *fi, const FILETIME *create, const FILETIME *access, const FILETIME *modified)
+static int win_set_times(const char *path, struct fuse_file_info *fi, const FILETIME *create, const FILETIME *access, const FILETIME *modified)
 {
   if (!fi || !fi->fh)
   {
@@ -938,6 +1066,13 @@ static int encfs_win_set_times(const char *path, struct fuse_file_info *fi, cons
     create, access, modified));
 }
 
+static int encfs_win_set_times(const char *path, struct fuse_file_info *fi, const FILETIME *create, const FILETIME *access, const FILETIME *modified)
+{
+  int res = win_set_times(path, fi, create, access, modified);
+  context()->attrCache.invalidate(path);
+  return res;
+}
+
 void win_encfs_oper_init(fuse_operations &encfs_oper)
 {
   encfs_oper.win_set_times = encfs_win_set_times;
@@ -75,6 +75,8 @@ int encfs_lock(const char * path, struct fuse_file_info * fi, int cmd,
 struct flock * locks);
 int encfs_readlink(const char *path, char *buf, size_t size);
 int encfs_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler);
+int encfs_opendir(const char *path, struct fuse_file_info *finfo);
+int encfs_releasedir(const char *path, struct fuse_file_info *finfo);
 int encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                   long long offset, struct fuse_file_info *finfo);
 int encfs_mknod(const char *path, mode_t mode, dev_t rdev);
@@ -88,6 +90,8 @@ int encfs_chmod(const char *path, mode_t mode);
 int encfs_chown(const char *path, uid_t uid, gid_t gid);
 int encfs_truncate(const char *path, long long size);
 int encfs_ftruncate(const char *path, long long size, struct fuse_file_info *fi);
+int encfs_fallocate(const char *path, int mode, long long offset,
+                    long long length, struct fuse_file_info *fi);
 int encfs_utime(const char *path, struct utimbuf *buf);
 int encfs_open(const char *path, struct fuse_file_info *info);
 int encfs_create(const char *path, mode_t mode, struct fuse_file_info *info);
@@ -748,13 +748,7 @@ static int ckpasswdAutomaticly(int argc, char **argv) {
   return do_chpasswd(true, false, true, argc, argv);
 }
 
-namespace encfs {
-	void init_mpool_mutex();
-}
-
 int main(int argc, char **argv) {
-  encfs::init_mpool_mutex();
-  
   START_EASYLOGGINGPP(argc, argv);
   encfs::initLogging();
 
@@ -19,6 +19,7 @@
 #define ELPP_CUSTOM_COUT std::cerr
 
 #include "encfs.h"
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
@@ -35,8 +36,10 @@
 #include <time.h>
 #include "unistd.h"
 #include <signal.h>
+#include <vector>
 
 #include "Context.h"
+#include "DirNode.h"
 #include "Error.h"
 #include "FileUtils.h"
 #include "MemoryPool.h"
@@ -57,6 +60,10 @@
 #define LONG_OPT_NOCACHE 514
 #define LONG_OPT_REQUIRE_MAC 515
 #define LONG_OPT_FORKED 516
+#define LONG_OPT_ATTR_TIMEOUT 517
+#define LONG_OPT_NEGATIVE_TIMEOUT 518
+#define LONG_OPT_NOWATCH 519
+#define LONG_OPT_POOL_LIMIT 520
 
 using namespace std;
 using namespace encfs;
@@ -67,6 +74,8 @@ INITIALIZE_EASYLOGGINGPP
 // Allow signal handlers to access mount context 
 std::shared_ptr<EncFS_Context> saved_ctx = NULL;
 
+std::string wchar_to_utf8_cstr(const wchar_t *str);
+
 namespace encfs {
 
 class DirNode;
@@ -156,6 +165,20 @@ static void usage(const char *name) {
             "\t\t\t(encfs must be run as root)\n")
        << _("  --reverse\t\t"
             "reverse encryption\n")
+       << _("  --attr-timeout=SECONDS\t"
+            "cache file attributes (default 1)\n"
+            "  --negative-timeout=SECONDS\n"
+            "\t\t\tcache names which don't exist (default 1)\n"
+            "  --nocache\t\t"
+            "disable caching, for changes made to rootDir\n"
+            "\t\t\tbehind encfs' back\n"
+            "  --nowatch\t\t"
+            "don't watch rootDir for changes made behind\n"
+            "\t\t\tencfs' back (cached attributes then only\n"
+            "\t\t\tcatch up when they expire)\n"
+            "  --pool-limit=MB\t"
+            "memory kept for reuse by the block buffer\n"
+            "\t\t\tpool (default 4)\n")
 
        // xgroup(usage)
        << _("  --extpass=program\tUse external program for password prompt\n"
@@ -248,6 +271,11 @@ static bool processArgs(int argc, char *argv[],
       {"annotate", 0, 0,
        LONG_OPT_ANNOTATE},                  // Print annotation lines to stderr
       {"nocache", 0, 0, LONG_OPT_NOCACHE},  // disable caching
+      {"attr-timeout", 1, 0, LONG_OPT_ATTR_TIMEOUT},  // getattr cache TTL
+      {"negative-timeout", 1, 0,
+       LONG_OPT_NEGATIVE_TIMEOUT},  // missing name cache TTL
+      {"nowatch", 0, 0, LONG_OPT_NOWATCH},  // don't watch rootDir
+      {"pool-limit", 1, 0, LONG_OPT_POOL_LIMIT},  // memory pool high water
       {"verbose", 0, 0, 'v'},               // verbose mode
       {"version", 0, 0, 'V'},               // version
       {"reverse", 0, 0, 'r'},               // reverse encryption
@@ -349,6 +377,20 @@ static bool processArgs(int argc, char *argv[],
          * Fallout unknown, disabling for safety */
         PUSHARG("-oentry_timeout=0");
         break;
+      case LONG_OPT_ATTR_TIMEOUT:
+        out->opts->attrTimeout = (int)(strtod(optarg, (char **)NULL) * 1000);
+        break;
+      case LONG_OPT_NEGATIVE_TIMEOUT:
+        out->opts->negativeTimeout =
+            (int)(strtod(optarg, (char **)NULL) * 1000);
+        break;
+      case LONG_OPT_NOWATCH:
+        out->opts->watchBacking = false;
+        break;
+      case LONG_OPT_POOL_LIMIT:
+        out->opts->poolLimit = strtol(optarg, (char **)NULL, 10);
+        if (out->opts->poolLimit < 0) out->opts->poolLimit = 0;
+        break;
       case 'm':
         out->opts->mountOnDemand = true;
         break;
@@ -393,6 +435,13 @@ static bool processArgs(int argc, char *argv[],
     }
   }
 
+  // --nocache also disables our own getattr cache, whatever timeouts were
+  // given
+  if (out->opts->noCache) {
+    out->opts->attrTimeout = 0;
+    out->opts->negativeTimeout = 0;
+  }
+
   if (!out->isThreaded) PUSHARG("-s");
 
   // Make Dokany think we're always in foreground mode
@@ -518,6 +567,11 @@ static bool processArgs(int argc, char *argv[],
 }
 
 static void *idleMonitor(void *);
+static void logCacheStats(EncFS_Context *ctx);
+#if defined(WIN32)
+static void startBackingWatcher(EncFS_Context *ctx);
+static void stopBackingWatcher();
+#endif
 
 void *encfs_init(fuse_conn_info *conn) {
   EncFS_Context *ctx = (EncFS_Context *)fuse_get_context()->private_data;
@@ -530,20 +584,23 @@ void *encfs_init(fuse_conn_info *conn) {
     //encfs::rlogAction = el::base::DispatchAction::SysLog;
   }
 
-  // if an idle timeout is specified, then setup a thread to monitor the
-  // filesystem.
-  if (ctx->args->idleTimeout > 0) {
-    VLOG(1) << "starting idle monitoring thread";
-    ctx->running = true;
-
-    int res = pthread_create(&ctx->monitorThread, 0, idleMonitor, (void *)ctx);
-    if (res != 0) {
-      RLOG(ERROR) << "error starting idle monitor thread, "
-                     "res = "
-                  << res << ", errno = " << errno;
-    }
+  // setup a thread to monitor the filesystem, which releases cached memory
+  // when it is idle, and unmounts it if an idle timeout is specified.
+  VLOG(1) << "starting idle monitoring thread";
+  ctx->running = true;
+
+  int res = pthread_create(&ctx->monitorThread, 0, idleMonitor, (void *)ctx);
+  if (res != 0) {
+    ctx->running = false;
+    RLOG(ERROR) << "error starting idle monitor thread, "
+                   "res = "
+                << res << ", errno = " << errno;
   }
 
+#if defined(WIN32)
+  if (ctx->opts->watchBacking) startBackingWatcher(ctx);
+#endif
+
   if (ctx->args->isDaemon && oldStderr >= 0) {
     VLOG(1) << "Closing stderr";
     close(oldStderr);
@@ -556,10 +613,6 @@ void *encfs_init(fuse_conn_info *conn) {
 void encfs_destroy(void *_ctx) {}
 
 #if defined(WIN32)
-  namespace encfs {
-    void init_mpool_mutex();
-  }
-
   // Predef signal handler 
   BOOL WINAPI signal_callback_handler(DWORD dwType);
 #endif 
@@ -581,7 +634,6 @@ int main(int argc, char *argv[]) {
   FreeLibrary(hinstLib);
 
   SetConsoleCP(65001); // set utf-8
-  encfs::init_mpool_mutex();
 
   // Register signal handler
   if (!SetConsoleCtrlHandler((PHANDLER_ROUTINE)signal_callback_handler, TRUE)) {
@@ -729,15 +781,14 @@ int main(int argc, char *argv[]) {
   encfs_oper.listxattr = encfs_listxattr;
   encfs_oper.removexattr = encfs_removexattr;
 #endif  // HAVE_XATTR
-  // encfs_oper.opendir = encfs_opendir;
-  // encfs_oper.readdir = encfs_readdir;
-  // encfs_oper.releasedir = encfs_releasedir;
   // encfs_oper.fsyncdir = encfs_fsyncdir;
   encfs_oper.init = encfs_init;
   encfs_oper.destroy = encfs_destroy;
   // encfs_oper.access = encfs_access;
 #ifndef USE_LEGACY_DOKAN
+  encfs_oper.opendir = encfs_opendir;
   encfs_oper.readdir = encfs_readdir;
+  encfs_oper.releasedir = encfs_releasedir;
   encfs_oper.create = encfs_create;
 #else
   encfs_oper.getdir = encfs_getdir;  // deprecated for readdir
@@ -746,6 +797,12 @@ int main(int argc, char *argv[]) {
   encfs_oper.fgetattr = encfs_fgetattr;
   // encfs_oper.lock = encfs_lock;
   encfs_oper.utimens = encfs_utimens;
+  // not reached on this port: the build selects the 2.6 API, and Dokany's
+  // wrapper has no callback which forwards preallocation or hole punching.
+  // BlockFileIO::allocate is still used to store zero blocks as holes.
+#if FUSE_VERSION >= 29
+  encfs_oper.fallocate = encfs_fallocate;
+#endif
   // encfs_oper.bmap = encfs_bmap;
 
 #ifdef WIN32
@@ -775,6 +832,9 @@ int main(int argc, char *argv[]) {
     ctx->setRoot(rootInfo->root);
     ctx->args = encfsArgs;
     ctx->opts = encfsArgs->opts;
+    ctx->attrCache.setTTL(encfsArgs->opts->attrTimeout,
+                          encfsArgs->opts->negativeTimeout);
+    MemoryPool::setHighWaterMark((uint64_t)encfsArgs->opts->poolLimit << 20);
 
     if (encfsArgs->isThreaded == false && encfsArgs->idleTimeout > 0) {
       // xgroup(usage)
@@ -857,7 +917,7 @@ int main(int argc, char *argv[]) {
       RLOG(ERROR) << "Internal error: Caught unexpected exception";
     }
 
-    if (ctx->args->idleTimeout > 0) {
+    if (ctx->running) {
       ctx->running = false;
       // wake up the thread if it is waiting..
       VLOG(1) << "waking up monitoring thread";
@@ -868,6 +928,11 @@ int main(int argc, char *argv[]) {
       pthread_join(ctx->monitorThread, 0);
       VLOG(1) << "join done";
     }
+
+#if defined(WIN32)
+    stopBackingWatcher();
+#endif
+    logCacheStats(ctx.get());
   }
 
   // cleanup so that we can check for leaked resources..
@@ -881,8 +946,9 @@ int main(int argc, char *argv[]) {
 }
 
 /*
-    Idle monitoring thread.  This is only used when idle monitoring is enabled.
-    It will cause the filesystem to be automatically unmounted (causing us to
+    Idle monitoring thread.  When the filesystem goes idle, the buffers kept
+    by the memory pool are released.  If idle monitoring is enabled, it will
+    also cause the filesystem to be automatically unmounted (causing us to
     commit suicide) if the filesystem stays idle too long.  Idle time is only
     checked if there are no open files, as I don't want to risk problems by
     having the filesystem unmounted from underneath open files!
@@ -890,6 +956,21 @@ int main(int argc, char *argv[]) {
 const int ActivityCheckInterval = 10;
 static bool unmountFS(EncFS_Context *ctx);
 
+static void logCacheStats(EncFS_Context *ctx) {
+  std::shared_ptr<DirNode> root = ctx->currentRoot();
+  if (root) {
+    PathCache::Stats st = root->pathCacheStats();
+    uint64_t lookups = st.hits + st.misses;
+    VLOG(1) << "path cache: " << st.entries << " entries, " << st.hits
+            << " hits of " << lookups << " lookups ("
+            << (lookups ? 100 * st.hits / lookups : 0) << "%)";
+  }
+
+  MemoryPool::Stats st = MemoryPool::stats();
+  VLOG(1) << "memory pool: " << st.allocations << " allocations, " << st.hits
+          << " reused, " << st.bytesHeld << " bytes held";
+}
+
 static void *idleMonitor(void *_arg) {
   EncFS_Context *ctx = (EncFS_Context *)_arg;
   std::shared_ptr<EncFS_Args> arg = ctx->args;
@@ -907,7 +988,12 @@ static void *idleMonitor(void *_arg) {
     else
       idleCycles = 0;
 
-    if (idleCycles >= timeoutCycles) {
+    if (idleCycles == 1) {
+      logCacheStats(ctx);
+      MemoryPool::trim();
+    }
+
+    if (arg->idleTimeout > 0 && idleCycles >= timeoutCycles) {
       int openCount = ctx->openFileCount();
       if (openCount == 0) {
 	    VLOG(1) << "Preparing to unmount due to inactivity: "
@@ -925,8 +1011,9 @@ static void *idleMonitor(void *_arg) {
       }
     }
 
-    VLOG(1) << "idle cycle count: " << idleCycles << ", timeout after "
-            << timeoutCycles;
+    if (arg->idleTimeout > 0)
+      VLOG(1) << "idle cycle count: " << idleCycles << ", timeout after "
+              << timeoutCycles;
 
     struct timeval currentTime;
     gettimeofday(&currentTime, 0);
@@ -961,6 +1048,129 @@ static bool unmountFS(EncFS_Context *ctx) {
 }
 
 #ifdef WIN32
+/*
+    Backing store watcher.  Sync tools, other programs, or the source of a
+    reverse mount can change rootDir behind our back.  The watcher picks
+    those changes up with ReadDirectoryChangesW and drops whatever we cached
+    about the plaintext paths involved, so cached attributes don't outlive
+    the backing files they came from.  Our own changes show up here too,
+    which costs a cache miss at most.
+*/
+static HANDLE watchStopEvent = NULL;
+static pthread_t watchThread;
+
+static void *backingWatcher(void *_arg) {
+  EncFS_Context *ctx = (EncFS_Context *)_arg;
+
+  HANDLE dir = CreateFileW(
+      utf8_to_wfn(ctx->rootCipherDir).c_str(), FILE_LIST_DIRECTORY,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+      OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+  if (dir == INVALID_HANDLE_VALUE) {
+    RLOG(WARNING) << "unable to watch " << ctx->rootCipherDir
+                  << " for changes, error " << GetLastError();
+    return 0;
+  }
+
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  HANDLE events[2] = {watchStopEvent, ov.hEvent};
+
+  // FILE_NOTIFY_INFORMATION records are DWORD aligned
+  std::vector<DWORD> buf(16 * 1024);
+  const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME |
+                       FILE_NOTIFY_CHANGE_DIR_NAME |
+                       FILE_NOTIFY_CHANGE_ATTRIBUTES |
+                       FILE_NOTIFY_CHANGE_SIZE |
+                       FILE_NOTIFY_CHANGE_LAST_WRITE |
+                       FILE_NOTIFY_CHANGE_CREATION;
+
+  VLOG(1) << "watching " << ctx->rootCipherDir << " for changes";
+  ctx->backingWatched = true;
+  for (;;) {
+    ResetEvent(ov.hEvent);
+    if (!ReadDirectoryChangesW(dir, buf.data(), buf.size() * sizeof(DWORD),
+                               TRUE, filter, NULL, &ov, NULL)) {
+      RLOG(WARNING) << "watching for changes failed, error "
+                    << GetLastError();
+      break;
+    }
+
+    DWORD got = 0;
+    DWORD woken = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+    if (woken != WAIT_OBJECT_0 + 1) {
+      CancelIo(dir);
+      GetOverlappedResult(dir, &ov, &got, TRUE);
+      break;
+    }
+    if (!GetOverlappedResult(dir, &ov, &got, FALSE)) {
+      if (GetLastError() != ERROR_NOTIFY_ENUM_DIR) {
+        RLOG(WARNING) << "watching for changes failed, error "
+                      << GetLastError();
+        break;
+      }
+      got = 0;
+    }
+
+    if (got == 0) {
+      // more changes than fit in the buffer, we don't know which
+      ctx->backingChanged("", true);
+      continue;
+    }
+
+    const char *next = (const char *)buf.data();
+    for (;;) {
+      const FILE_NOTIFY_INFORMATION *info =
+          (const FILE_NOTIFY_INFORMATION *)next;
+      std::wstring wname(info->FileName,
+                         info->FileNameLength / sizeof(WCHAR));
+      std::string name = wchar_to_utf8_cstr(wname.c_str());
+      std::replace(name.begin(), name.end(), '\\', '/');
+
+      bool removed = info->Action == FILE_ACTION_REMOVED ||
+                     info->Action == FILE_ACTION_RENAMED_OLD_NAME;
+      try {
+        ctx->backingChanged(name.c_str(), removed);
+      } catch (encfs::Error &err) {
+        RLOG(ERROR) << "error caught in backing watcher: " << err.what();
+        ctx->backingChanged("", true);
+      }
+
+      if (info->NextEntryOffset == 0) break;
+      next += info->NextEntryOffset;
+    }
+  }
+
+  // changes from here on go unseen, so closed files can't be trusted
+  ctx->backingWatched = false;
+  ctx->forgetClosedFiles();
+
+  CloseHandle(ov.hEvent);
+  CloseHandle(dir);
+  VLOG(1) << "backing watcher exiting";
+  return 0;
+}
+
+static void startBackingWatcher(EncFS_Context *ctx) {
+  watchStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  int res = pthread_create(&watchThread, 0, backingWatcher, (void *)ctx);
+  if (res != 0) {
+    RLOG(ERROR) << "error starting backing watcher thread, res = " << res;
+    CloseHandle(watchStopEvent);
+    watchStopEvent = NULL;
+  }
+}
+
+static void stopBackingWatcher() {
+  if (watchStopEvent == NULL) return;
+
+  SetEvent(watchStopEvent);
+  pthread_join(watchThread, 0);
+  CloseHandle(watchStopEvent);
+  watchStopEvent = NULL;
+}
+
 // This function will be called when ctrl-c (SIGINT) signal is sent 
 BOOL WINAPI signal_callback_handler(DWORD dwType)
 {
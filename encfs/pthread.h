@@ -40,6 +40,7 @@ void pthread_mutex_unlock(pthread_mutex_t *mtx);
 
 int pthread_create(pthread_t *thread, int, void *(*start_routine)(void*), void *arg);
 void pthread_join(pthread_t thread, int);
+void pthread_detach(pthread_t thread);
 
 int my_open(const char *fn, int flags);
 
@@ -47,6 +48,22 @@ int my_open(const char *fn, int flags);
 typedef int ssize_t;
 #endif
 
+// fallocate() modes, as on Linux
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#define FALLOC_FL_ZERO_RANGE 0x10
+#endif
+
+#ifndef EOPNOTSUPP
+#define EOPNOTSUPP 130
+#endif
+
+// mmap() subset: read-only shared mappings
+#define PROT_READ 0x1
+#define MAP_SHARED 0x01
+#define MAP_FAILED ((void *)-1)
+
 namespace unix {
 int fsync(int fd);
 int fdatasync(int fd);
@@ -56,6 +73,10 @@ ssize_t pwrite(int fd, const void *buf, size_t count, __int64 offset);
 
 int truncate(const char *path, __int64 length);
 int ftruncate(int fd, __int64 length);
+int fallocate(int fd, int mode, __int64 offset, __int64 length);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           __int64 offset);
+int munmap(void *addr, size_t length);
 int statvfs(const char *path, struct statvfs *buf);
 int utimes(const char *filename, const struct timeval times[2]);
 int utime(const char *filename, struct utimbuf *times);
@@ -68,6 +89,7 @@ int rename(const char *oldpath, const char *newpath);
 int unlink(const char *path);
 int rmdir(const char *path);
 int stat(const char *path, struct stat_st *buffer);
+int fstat(int fd, struct stat_st *buffer);
 static inline int lstat(const char *path, struct stat_st *buffer) {
 	return unix::stat(path, buffer);
 }
@@ -88,10 +110,13 @@ struct DIR;
 DIR *opendir(const char *name);
 int closedir(DIR* dir);
 struct dirent* readdir(DIR* dir);
+// attributes of the entry last returned by readdir, from the listing itself
+int readdirstat(DIR* dir, struct stat_st *buffer);
 };
 
 std::wstring nix_to_winw(const std::string& src);
 std::wstring utf8_to_wfn(const std::string& src);
+wchar_t *utf8_to_wfn_buf(const char *src, wchar_t *buf, size_t bufLen);
 
 #define mlock(a,b) do { } while(0)
 #define munlock(a,b) do { } while(0)
@@ -16,28 +16,45 @@
  *
  */
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
 #include <list>
 #include <memory>
+#include <new>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <time.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 #include "BlockNameIO.h"
 #include "Cipher.h"
 #include "CipherKey.h"
+#include "Context.h"
 #include "DirNode.h"
 #include "Error.h"
 #include "FSConfig.h"
+#include "FileNode.h"
 #include "FileUtils.h"
 #include "Interface.h"
 #include "MemoryPool.h"
+#include "Mutex.h"
 #include "NameIO.h"
+#include "NullNameIO.h"
+#include "OpDispatch.h"
 #include "Range.h"
+#include "RawFileIO.h"
 #include "StreamNameIO.h"
+#include "base64.h"
 #include "internal/easylogging++.h"
 
 #define NO_DES
@@ -53,6 +70,18 @@ INITIALIZE_EASYLOGGINGPP
 
 const int FSBlockSize = 256;
 
+// count heap allocations, for checking the allocation free paths
+static std::atomic<unsigned long> gNewCalls(0);
+
+void *operator new(size_t size) {
+  ++gNewCalls;
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
 static int checkErrorPropogation(const std::shared_ptr<Cipher> &cipher,
                                  int size, int byteToChange,
                                  const CipherKey &key) {
@@ -94,6 +123,169 @@ static int checkErrorPropogation(const std::shared_ptr<Cipher> &cipher,
   return numByteErrors;
 }
 
+struct PoolHolder {
+  pthread_mutex_t hold;
+  std::atomic<bool> ready;
+};
+
+// leaves a block in this thread's cache, and keeps the thread alive until
+// the hold mutex is released
+static void *holdPoolBlock(void *arg) {
+  PoolHolder *holder = (PoolHolder *)arg;
+  MemoryPool::release(MemoryPool::allocate(FSBlockSize));
+  holder->ready = true;
+  Lock lock(holder->hold);
+  return 0;
+}
+
+static bool testMemoryPool(bool verbose) {
+  MemoryPool::Stats before = MemoryPool::stats();
+
+  // a released block is cleared, and handed out again for the same class
+  MemBlock mb = MemoryPool::allocate(FSBlockSize - 8);
+  memset(mb.data, 0x55, FSBlockSize - 8);
+  unsigned char *data = mb.data;
+  MemoryPool::release(mb);
+
+  mb = MemoryPool::allocate(FSBlockSize);
+  if (mb.data != data) {
+    if (verbose) cerr << "released block not reused\n";
+    return false;
+  }
+  for (int i = 0; i < FSBlockSize - 8; ++i) {
+    if (mb.data[i] != 0) {
+      if (verbose) cerr << "released block not cleared\n";
+      return false;
+    }
+  }
+  MemoryPool::release(mb);
+
+  MemoryPool::Stats after = MemoryPool::stats();
+  if (after.allocations != before.allocations + 2 ||
+      after.hits != before.hits + 1) {
+    if (verbose) cerr << "unexpected pool counters\n";
+    return false;
+  }
+
+  // nothing is kept above the high water mark
+  MemoryPool::setHighWaterMark(0);
+  if (MemoryPool::stats().bytesHeld != 0) {
+    if (verbose) cerr << "pool not trimmed\n";
+    return false;
+  }
+  mb = MemoryPool::allocate(FSBlockSize);
+  MemoryPool::release(mb);
+  bool trimmed = (MemoryPool::stats().bytesHeld == 0);
+  MemoryPool::setHighWaterMark(4 * 1024 * 1024);
+  if (!trimmed) {
+    if (verbose) cerr << "block kept above high water mark\n";
+    return false;
+  }
+
+  // trim reaches blocks cached by other threads
+  PoolHolder holder;
+  pthread_mutex_init(&holder.hold, 0);
+  holder.ready = false;
+  pthread_mutex_lock(&holder.hold);
+  pthread_t thread;
+  pthread_create(&thread, 0, holdPoolBlock, &holder);
+  while (!holder.ready) std::this_thread::yield();
+  bool held = (MemoryPool::stats().bytesHeld != 0);
+  MemoryPool::trim();
+  trimmed = (MemoryPool::stats().bytesHeld == 0);
+  pthread_mutex_unlock(&holder.hold);
+  pthread_join(thread, 0);
+  pthread_mutex_destroy(&holder.hold);
+  if (!held || !trimmed) {
+    if (verbose) cerr << "other thread's cache not trimmed\n";
+    return false;
+  }
+
+  return true;
+}
+
+// Encodes a test pattern of the given length the way the name coders do.
+static string encodeAscii(int len, int dst2Pow) {
+  unsigned char buf[512];
+  for (int i = 0; i < len; ++i) buf[i] = (unsigned char)(i * 37 + 11);
+  int outLen = (dst2Pow == 6) ? B256ToB64Bytes(len) : B256ToB32Bytes(len);
+  changeBase2Inline(buf, len, 8, dst2Pow, true);
+  if (dst2Pow == 6)
+    B64ToAscii(buf, outLen);
+  else
+    B32ToAscii(buf, outLen);
+  return string((char *)buf, outLen);
+}
+
+static bool testBase64(bool verbose) {
+  // output of the original recursive coder, which names on disk depend on
+  struct {
+    int len;
+    const char *b64;
+    const char *b32;
+  } known[] = {
+      {1, "9,", "LA"},
+      {7, "9,HJux7ld1", "LAMKF55TEO2B"},
+      {20, "9,HJux7ldvkAMpbc5nS2qg3UZeA", "LAMKF55TEO25QZAL5TIPMWHCWZWAYSKZ"},
+  };
+  for (auto &k : known) {
+    if (encodeAscii(k.len, 6) != k.b64 || encodeAscii(k.len, 5) != k.b32) {
+      if (verbose) cerr << "encoding changed for length " << k.len << "\n";
+      return false;
+    }
+  }
+
+  // random data round trips through both alphabets at every name length
+  unsigned char orig[256];
+  unsigned char buf[512];
+  for (int len = 0; len <= 255; ++len) {
+    for (int i = 0; i < len; ++i) orig[i] = (unsigned char)rand();
+    for (int pow2 = 5; pow2 <= 6; ++pow2) {
+      memcpy(buf, orig, len);
+      int encLen = (pow2 == 6) ? B256ToB64Bytes(len) : B256ToB32Bytes(len);
+      changeBase2Inline(buf, len, 8, pow2, true);
+      if (pow2 == 6) {
+        B64ToAscii(buf, encLen);
+        AsciiToB64(buf, encLen);
+      } else {
+        B32ToAscii(buf, encLen);
+        AsciiToB32(buf, encLen);
+      }
+      changeBase2Inline(buf, encLen, pow2, 8, false);
+      if (len && memcmp(buf, orig, len) != 0) {
+        if (verbose)
+          cerr << "base" << (1 << pow2) << " round trip failed, length "
+               << len << "\n";
+        return false;
+      }
+    }
+  }
+
+  // benchmark across name lengths, encoding and decoding a name each time
+  if (verbose) {
+    const int lengths[] = {8, 32, 64, 128, 255};
+    const int iterations = 20000;
+    for (int len : lengths) {
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < iterations; ++i) {
+        memcpy(buf, orig, len);
+        int encLen = B256ToB64Bytes(len);
+        changeBase2Inline(buf, len, 8, 6, true);
+        B64ToAscii(buf, encLen);
+        AsciiToB64(buf, encLen);
+        changeBase2Inline(buf, encLen, 6, 8, false);
+      }
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
+      cerr << "\n  " << len << " bytes: "
+           << (double)elapsed.count() * 1000 / iterations << " ns / name";
+    }
+    cerr << "\n";
+  }
+
+  return true;
+}
+
 const char TEST_ROOTDIR[] = "/foo";
 
 static bool testNameCoding(DirNode &dirNode, bool verbose) {
@@ -128,9 +320,266 @@ static bool testNameCoding(DirNode &dirNode, bool verbose) {
     orig++;
   }
 
+  // a second encoding of each path is served from the path cache, and must
+  // be identical to the first
+  PathCache::Stats before = dirNode.pathCacheStats();
+  int count = 0;
+  for (orig = name; *orig; ++orig, ++count) {
+    string first = dirNode.cipherPathWithoutRoot(*orig);
+    string second = dirNode.cipherPathWithoutRoot(*orig);
+    if (first != second || first != dirNode.relativeCipherPath(*orig)) {
+      if (verbose) cerr << "   cached path differs for " << *orig << "\n";
+      return false;
+    }
+  }
+  PathCache::Stats after = dirNode.pathCacheStats();
+
+  // a new name in a known directory only misses on itself, the directory
+  // prefix comes from the cache
+  dirNode.cipherPathWithoutRoot("/foo/bar/blah2");
+  PathCache::Stats sibling = dirNode.pathCacheStats();
+  if (sibling.misses != after.misses + 1 || sibling.hits != after.hits + 1) {
+    if (verbose) cerr << "   directory prefix not reused\n";
+    return false;
+  }
+  if (dirNode.cipherPathWithoutRoot("/foo/bar/blah2") !=
+      dirNode.relativeCipherPath("/foo/bar/blah2")) {
+    if (verbose) cerr << "   prefix coded path differs\n";
+    return false;
+  }
+
+  // the buffer form gives the same path, or fails cleanly if it can't fit
+  char buf[PathBufferSize];
+  string full = dirNode.cipherPath("/foo/bar/blah2");
+  int len = dirNode.cipherPath("/foo/bar/blah2", buf, sizeof(buf));
+  if (len != (int)full.length() || full != buf ||
+      dirNode.cipherPath("/foo/bar/blah2", buf, len) != -1) {
+    if (verbose) cerr << "   buffer coded path differs\n";
+    return false;
+  }
+  if (verbose) {
+    cerr << "   path cache hits " << after.hits << ", misses " << after.misses
+         << "\n";
+  }
+  if (after.hits - before.hits < (uint64_t)count) {
+    if (verbose) cerr << "   path cache not used\n";
+    return false;
+  }
+
   return true;
 }
 
+// a batch decode must give the same names, in the same order, as decoding
+// one by one
+static bool testDecodeNames(const std::shared_ptr<NameIO> &naming,
+                            bool verbose) {
+  const uint64_t dirIV = 0x1234567890abcdefULL;
+  std::vector<string> plain, encoded, decoded;
+  for (int i = 0; i < 1000; ++i) {
+    std::ostringstream name;
+    name << "entry-" << i;
+    uint64_t iv = dirIV;
+    plain.push_back(name.str());
+    encoded.push_back(naming->encodePath(name.str().c_str(), &iv));
+  }
+  encoded.push_back("not a valid name");
+  plain.push_back(string());
+
+  naming->decodeNames(encoded, dirIV, &decoded);
+  if (decoded != plain) {
+    if (verbose) cerr << "   batch decode mismatch\n";
+    return false;
+  }
+
+  return true;
+}
+
+struct DecodeArgs {
+  const NameIO *naming;
+  const std::vector<string> *encoded;
+  const std::vector<string> *expected;
+  bool failed;
+};
+
+static void *decodeBatches(void *arg) {
+  DecodeArgs *args = (DecodeArgs *)arg;
+  std::vector<string> decoded;
+  for (int i = 0; i < 20 && !args->failed; ++i) {
+    args->naming->decodeNames(*args->encoded, 0, &decoded);
+    if (decoded != *args->expected) args->failed = true;
+  }
+  return NULL;
+}
+
+struct BlockCodeArgs {
+  const Cipher *cipher;
+  CipherKey key;
+  const std::vector<unsigned char> *plain;
+  const std::vector<unsigned char> *encoded;
+  int blockSize;
+  bool failed;
+};
+
+// encodes and decodes every block with the shared key, many times over
+static void *codeBlocks(void *arg) {
+  BlockCodeArgs *args = (BlockCodeArgs *)arg;
+  const int bs = args->blockSize;
+  std::vector<unsigned char> buf(bs);
+  int blocks = (int)args->plain->size() / bs;
+  for (int round = 0; round < 50 && !args->failed; ++round) {
+    for (int i = 0; i < blocks; ++i) {
+      memcpy(&buf[0], &(*args->plain)[i * bs], bs);
+      args->cipher->blockEncode(&buf[0], bs, i, args->key);
+      if (memcmp(&buf[0], &(*args->encoded)[i * bs], bs) != 0)
+        args->failed = true;
+      args->cipher->blockDecode(&buf[0], bs, i, args->key);
+      if (memcmp(&buf[0], &(*args->plain)[i * bs], bs) != 0)
+        args->failed = true;
+    }
+  }
+  return NULL;
+}
+
+// Names are decoded on the thread pool when the cipher lets callers share a
+// key.  Several directories decoded at once share the pool, and the key is
+// used by several threads at once.
+static bool testPooledDecode(const std::shared_ptr<Cipher> &cipher,
+                             bool verbose) {
+  CipherKey key = cipher->newRandomKey();
+  StreamNameIO naming(StreamNameIO::CurrentInterface(), cipher, key);
+  if (!naming.concurrentDecode()) {
+    if (verbose) cerr << "cipher doesn't allow concurrent decoding\n";
+    return false;
+  }
+
+  std::vector<string> encoded, expected;
+  for (int i = 0; i < 2000; ++i) {
+    std::ostringstream name;
+    name << "pooled-" << i;
+    uint64_t iv = 0;
+    encoded.push_back(naming.encodePath(name.str().c_str(), &iv));
+    expected.push_back(name.str());
+  }
+
+  const int threads = 4;
+  pthread_t thread[threads];
+  DecodeArgs args[threads];
+  for (int i = 0; i < threads; ++i) {
+    DecodeArgs a = {&naming, &encoded, &expected, false};
+    args[i] = a;
+    pthread_create(&thread[i], 0, decodeBatches, &args[i]);
+  }
+  bool ok = true;
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(thread[i], 0);
+    if (args[i].failed) ok = false;
+  }
+  if (!ok) {
+    if (verbose) cerr << "pooled batch decode mismatch\n";
+    return false;
+  }
+
+  // block coding with a shared key gives what a single thread gets
+  const int bs = FSBlockSize;
+  const int blocks = 16;
+  std::vector<unsigned char> plain(bs * blocks), blockEncoded;
+  for (size_t i = 0; i < plain.size(); ++i) plain[i] = (unsigned char)(i * 7);
+  blockEncoded = plain;
+  for (int i = 0; i < blocks; ++i)
+    cipher->blockEncode(&blockEncoded[i * bs], bs, i, key);
+
+  BlockCodeArgs codeArgs[threads];
+  for (int i = 0; i < threads; ++i) {
+    BlockCodeArgs a = {cipher.get(), key, &plain, &blockEncoded, bs, false};
+    codeArgs[i] = a;
+    pthread_create(&thread[i], 0, codeBlocks, &codeArgs[i]);
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(thread[i], 0);
+    if (codeArgs[i].failed) ok = false;
+  }
+  if (!ok && verbose) cerr << "concurrent block coding mismatch\n";
+
+  return ok;
+}
+
+// Removes a directory and everything in it.
+static void removeTree(const string &path) {
+  unix::DIR *dir = unix::opendir(path.c_str());
+  if (dir != NULL) {
+    std::vector<string> names;
+    struct unix::dirent *de;
+    while ((de = unix::readdir(dir)) != NULL) {
+      if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+        names.push_back(path + "/" + de->d_name);
+    }
+    unix::closedir(dir);
+
+    for (const string &name : names) {
+      struct stat_st st;
+      if (unix::lstat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+        removeTree(name);
+      else
+        unix::unlink(name.c_str());
+    }
+  }
+  unix::rmdir(path.c_str());
+}
+
+// A new directory for a test to work in, made like mkdtemp(): mkdir() fails
+// on an existing name, so the directory is never shared with another
+// process.  It is removed, along with anything left in it, when the TempDir
+// goes away.
+class TempDir {
+ public:
+  explicit TempDir(bool verbose);
+  ~TempDir() {
+    if (valid()) removeTree(_path);
+  }
+
+  // false if no directory could be made
+  bool valid() const { return !_path.empty(); }
+  const string &path() const { return _path; }
+
+ private:
+  TempDir(const TempDir &src);             // not allowed
+  TempDir &operator=(const TempDir &src);  // not allowed
+
+  string _path;
+};
+
+TempDir::TempDir(bool verbose) {
+  const char *tmp = getenv("TMPDIR");
+  if (!tmp) tmp = getenv("TEMP");
+  if (!tmp) tmp = "/tmp";
+
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    std::ostringstream name;
+    name << tmp << "/encfs-test-" << std::hex << rand() << rand();
+    if (unix::mkdir(name.str().c_str(), 0700) == 0) {
+      _path = name.str();
+      return;
+    }
+    if (errno != EEXIST) break;
+  }
+  if (verbose) cerr << "unable to create a temporary directory\n";
+}
+
+// Volume configuration shared by the file and directory tests: a new key,
+// the test block size and stream coded names.
+static FSConfigPtr newFSConfig(const std::shared_ptr<Cipher> &cipher) {
+  FSConfigPtr fsCfg = FSConfigPtr(new FSConfig);
+  fsCfg->cipher = cipher;
+  fsCfg->key = cipher->newRandomKey();
+  fsCfg->config.reset(new EncFSConfig);
+  fsCfg->config->blockSize = FSBlockSize;
+  fsCfg->opts.reset(new EncFS_Opts);
+  fsCfg->opts->mountPoint = "/encfs-test-mount/";
+  fsCfg->nameCoding.reset(
+      new StreamNameIO(StreamNameIO::CurrentInterface(), cipher, fsCfg->key));
+  return fsCfg;
+}
+
 bool runTests(const std::shared_ptr<Cipher> &cipher, bool verbose) {
   // create a random key
   if (verbose) {
@@ -172,19 +621,22 @@ bool runTests(const std::shared_ptr<Cipher> &cipher, bool verbose) {
     cfg.cipherIface = cipher->interface();
     cfg.keySize = 8 * cipher->keySize();
     cfg.blockSize = FSBlockSize;
+    cfg.directoryIV = true;
     cfg.assignKeyData(keyBuf, encodedKeySize);
 
     // save config
-    auto name = std::tmpnam(nullptr);
+    TempDir tmpDir(verbose);
+    rAssert(tmpDir.valid());
+    string name = tmpDir.path() + "/config";
     {
-      auto ok = writeV6Config(name, &cfg);
+      auto ok = writeV6Config(name.c_str(), &cfg);
       rAssert(ok == true);
     }
 
     // read back in and check everything..
     EncFSConfig cfg2;
     {
-      auto ok = readV6Config(name, &cfg2, nullptr);
+      auto ok = readV6Config(name.c_str(), &cfg2, nullptr);
       rAssert(ok == true);
     }
 
@@ -192,6 +644,7 @@ bool runTests(const std::shared_ptr<Cipher> &cipher, bool verbose) {
     rAssert(cfg.cipherIface.implements(cfg2.cipherIface));
     rAssert(cfg.keySize == cfg2.keySize);
     rAssert(cfg.blockSize == cfg2.blockSize);
+    rAssert(cfg.directoryIV == cfg2.directoryIV);
 
     // try decoding key..
 
@@ -229,6 +682,7 @@ bool runTests(const std::shared_ptr<Cipher> &cipher, bool verbose) {
     DirNode dirNode(NULL, TEST_ROOTDIR, fsCfg);
 
     if (!testNameCoding(dirNode, verbose)) return false;
+    if (!testDecodeNames(fsCfg->nameCoding, verbose)) return false;
   }
 
   if (verbose)
@@ -364,6 +818,1208 @@ bool runTests(const std::shared_ptr<Cipher> &cipher, bool verbose) {
   return true;
 }
 
+struct StressArgs {
+  FileNode *node;
+  int blocks;
+  int iterations;
+  bool writer;
+  unsigned int seed;
+  bool failed;
+};
+
+// Writers fill whole blocks with a single byte value, readers check that
+// every block they see still consists of a single value.
+static void *stressFileNode(void *arg) {
+  StressArgs *args = (StressArgs *)arg;
+  unsigned char buf[FSBlockSize];
+
+  for (int i = 0; i < args->iterations && !args->failed; ++i) {
+    args->seed = args->seed * 1103515245 + 12345;
+    int block = (args->seed >> 8) % args->blocks;
+    FUSE_OFF_T offset = (FUSE_OFF_T)block * FSBlockSize;
+
+    if (args->writer) {
+      memset(buf, (args->seed >> 16) & 0xff, FSBlockSize);
+      if (!args->node->write(offset, buf, FSBlockSize)) args->failed = true;
+    } else {
+      if (args->node->read(offset, buf, FSBlockSize) != FSBlockSize) {
+        args->failed = true;
+        break;
+      }
+      for (int j = 1; j < FSBlockSize; ++j) {
+        if (buf[j] != buf[0]) {
+          cerr << "torn block " << block << " at byte " << j << "\n";
+          args->failed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+struct UnalignedArgs {
+  FileNode *node;
+  FUSE_OFF_T start;
+  FUSE_OFF_T length;
+  int id;
+  int passes;
+  unsigned int seed;
+  bool failed;
+};
+
+// what a byte of a writer's range holds after the given pass
+static unsigned char unalignedByte(FUSE_OFF_T pos, int id, int pass) {
+  return (unsigned char)(pos * 7 + id * 31 + pass * 101 + 1);
+}
+
+// Writers own neighbouring byte ranges which don't start or end on block
+// boundaries, so blocks at the edges are shared with the next writer.  Each
+// pass rewrites the whole range in randomly sized pieces, most of which
+// straddle a block boundary.
+static void *writeUnaligned(void *arg) {
+  UnalignedArgs *args = (UnalignedArgs *)arg;
+  unsigned char buf[2 * FSBlockSize];
+
+  for (int pass = 0; pass < args->passes && !args->failed; ++pass) {
+    FUSE_OFF_T done = 0;
+    while (done < args->length) {
+      args->seed = args->seed * 1103515245 + 12345;
+      FUSE_OFF_T len = 1 + (args->seed >> 8) % (FSBlockSize + FSBlockSize / 2);
+      if (len > args->length - done) len = args->length - done;
+
+      FUSE_OFF_T offset = args->start + done;
+      for (FUSE_OFF_T i = 0; i < len; ++i)
+        buf[i] = unalignedByte(offset + i, args->id, pass);
+      if (!args->node->write(offset, buf, len)) {
+        args->failed = true;
+        break;
+      }
+      done += len;
+    }
+  }
+
+  return NULL;
+}
+
+// Runs the block stress threads, then the unaligned writers, on an open
+// file of the given number of blocks.
+static bool stressNode(FileNode &node, int blocks, bool verbose) {
+  unsigned char buf[FSBlockSize];
+  memset(buf, 0x42, FSBlockSize);
+  for (int i = 0; i < blocks; ++i)
+    node.write((FUSE_OFF_T)i * FSBlockSize, buf, FSBlockSize);
+
+  const int threads = 8;
+  pthread_t thread[threads];
+  StressArgs args[threads];
+  for (int i = 0; i < threads; ++i) {
+    StressArgs a = {&node, blocks, 2000, (i % 2) == 0, (unsigned int)rand(),
+                    false};
+    args[i] = a;
+    pthread_create(&thread[i], 0, stressFileNode, &args[i]);
+  }
+  bool ok = true;
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(thread[i], 0);
+    if (args[i].failed) ok = false;
+  }
+  if (!ok) return false;
+
+  if (node.getSize() != blocks * FSBlockSize) {
+    if (verbose) cerr << "file size changed to " << node.getSize() << "\n";
+    return false;
+  }
+
+  // unaligned writes to neighbouring ranges, then every byte is checked
+  const int writers = 4;
+  const FUSE_OFF_T start = 11;
+  const FUSE_OFF_T length = 3 * FSBlockSize + 37;
+  const int passes = 20;
+  UnalignedArgs wargs[writers];
+  for (int i = 0; i < writers; ++i) {
+    UnalignedArgs a = {&node,  start + i * length, length, i,
+                       passes, (unsigned int)rand(), false};
+    wargs[i] = a;
+    pthread_create(&thread[i], 0, writeUnaligned, &wargs[i]);
+  }
+  for (int i = 0; i < writers; ++i) {
+    pthread_join(thread[i], 0);
+    if (wargs[i].failed) ok = false;
+  }
+  if (!ok) return false;
+
+  std::vector<unsigned char> data(blocks * FSBlockSize);
+  if (node.read(0, data.data(), data.size()) != (ssize_t)data.size()) {
+    if (verbose) cerr << "short read after unaligned writes\n";
+    return false;
+  }
+  for (FUSE_OFF_T pos = start; pos < start + writers * length; ++pos) {
+    int id = (int)((pos - start) / length);
+    if (data[pos] != unalignedByte(pos, id, passes - 1)) {
+      if (verbose) cerr << "lost unaligned write at byte " << pos << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool testConcurrentIO(const std::shared_ptr<Cipher> &cipher,
+                             bool verbose) {
+  FSConfigPtr fsCfg = newFSConfig(cipher);
+  fsCfg->config->uniqueIV = true;
+
+  TempDir tmpDir(verbose);
+  if (!tmpDir.valid()) return false;
+  string name = tmpDir.path() + "/stress";
+  bool ok = false;
+  {
+    FileNode node(NULL, fsCfg, "/stress", name.c_str());
+    if (node.mknod(0600, 0) < 0 || node.open(O_RDWR) < 0) {
+      if (verbose) cerr << "unable to create " << name << "\n";
+    } else {
+      ok = stressNode(node, 16, verbose);
+    }
+  }
+
+  return ok;
+}
+
+// Compares a file with the contents it is expected to have.
+static bool sameContents(const FileNode &node,
+                         const std::vector<unsigned char> &expected) {
+  if (node.getSize() != (FUSE_OFF_T)expected.size()) return false;
+  std::vector<unsigned char> buf(expected.size() + 1);
+  ssize_t len = node.read(0, buf.data(), buf.size());
+  return len == (ssize_t)expected.size() &&
+         std::equal(expected.begin(), expected.end(), buf.begin());
+}
+
+// Runs a file test through the cipher layer alone, and with block MACs on
+// top of it, on volumes with unique IVs which allow holes.  The test is
+// called with the volume and its number of MAC bytes, and removes what it
+// created.
+template <typename Test>
+static bool withMACLayouts(const std::shared_ptr<Cipher> &cipher, Test test) {
+  for (int macBytes = 0; macBytes <= 8; macBytes += 8) {
+    FSConfigPtr fsCfg = newFSConfig(cipher);
+    fsCfg->config->uniqueIV = true;
+    fsCfg->config->allowHoles = true;
+    fsCfg->config->blockMACBytes = macBytes;
+    if (!test(fsCfg, macBytes)) return false;
+  }
+  return true;
+}
+
+// Preallocation, punched holes and zeroed ranges, with edges inside blocks,
+// through the cipher layer alone and with block MACs on top of it.
+static bool testAllocate(const std::shared_ptr<Cipher> &cipher,
+                         bool verbose) {
+  TempDir tmpDir(verbose);
+  if (!tmpDir.valid()) return false;
+  string name = tmpDir.path() + "/allocate";
+
+  return withMACLayouts(cipher, [&](const FSConfigPtr &fsCfg, int macBytes) {
+    // the size of a block as the topmost layer sees it
+    const FUSE_OFF_T bs = FSBlockSize - macBytes;
+
+    std::vector<unsigned char> expected(3 * bs + bs / 2);
+    for (size_t i = 0; i < expected.size(); ++i)
+      expected[i] = (unsigned char)(i % 251 + 1);
+
+    // each step is a mode, offset and length, and the size afterwards
+    struct {
+      int mode;
+      FUSE_OFF_T offset, length, size;
+    } steps[] = {
+        // reserve space past the end without changing the size
+        {FALLOC_FL_KEEP_SIZE, 3 * bs + bs / 2, bs, 3 * bs + bs / 2},
+        // preallocate past the end, which reads back as zeros
+        {0, 3 * bs + bs / 2, 2 * bs, 5 * bs + bs / 2},
+        // a partial block at each edge, one full block between
+        {FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 10, 2 * bs + 5,
+         5 * bs + bs / 2},
+        // both edges within one block
+        {FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 3 * bs + 3, 7,
+         5 * bs + bs / 2},
+        // zeroing over the partial last block extends the file
+        {FALLOC_FL_ZERO_RANGE, 5 * bs + bs / 2 - 3, bs, 6 * bs + bs / 2 - 3},
+    };
+
+    FileNode node(NULL, fsCfg, "/allocate", name.c_str());
+    bool ok = node.mknod(0600, 0) == 0 && node.open(O_RDWR) >= 0 &&
+         node.write(0, expected.data(), expected.size());
+    for (auto &step : steps) {
+      if (!ok) break;
+      if (node.allocate(step.mode, step.offset, step.length) != 0) {
+        if (verbose) cerr << "allocate failed at " << step.offset << "\n";
+        ok = false;
+        break;
+      }
+      if (!(step.mode & FALLOC_FL_KEEP_SIZE) ||
+          (step.mode & FALLOC_FL_PUNCH_HOLE)) {
+        FUSE_OFF_T end = min(step.offset + step.length, step.size);
+        expected.resize(max((FUSE_OFF_T)expected.size(), end));
+        std::fill(expected.begin() + step.offset, expected.begin() + end, 0);
+      }
+      if (!sameContents(node, expected)) {
+        if (verbose)
+          cerr << "unexpected contents after allocate at " << step.offset
+               << " (" << macBytes << " MAC bytes)\n";
+        ok = false;
+      }
+    }
+
+    // holes read back as zeros once nothing of the file is cached
+    if (ok) {
+      FileNode reopened(NULL, fsCfg, "/allocate", name.c_str());
+      if (reopened.open(O_RDONLY) < 0 || !sameContents(reopened, expected)) {
+        if (verbose) cerr << "holes not read back as zeros\n";
+        ok = false;
+      }
+    }
+
+    // invalid mode combinations are refused, as by fallocate(2)
+    if (ok && (node.allocate(FALLOC_FL_PUNCH_HOLE, 0, bs) != -EOPNOTSUPP ||
+               node.allocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE |
+                                 FALLOC_FL_KEEP_SIZE,
+                             0, bs) != -EINVAL ||
+               !sameContents(node, expected))) {
+      if (verbose) cerr << "invalid allocate mode accepted\n";
+      ok = false;
+    }
+
+    // punching a hole needs holes to be allowed
+    fsCfg->config->allowHoles = false;
+    if (ok) {
+      FileNode noHoles(NULL, fsCfg, "/allocate", name.c_str());
+      if (noHoles.open(O_RDWR) < 0 ||
+          noHoles.allocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                           bs) != -EOPNOTSUPP) {
+        if (verbose) cerr << "hole punched without holes allowed\n";
+        ok = false;
+      }
+    }
+    unix::unlink(name.c_str());
+    return ok;
+  });
+}
+
+// A full block of zeros is stored as a hole instead of being encoded, except
+// where it would straddle a partial last block, and reads back as zeros
+// through the cipher layer and through block MACs.
+static bool testHoleWrites(const std::shared_ptr<Cipher> &cipher,
+                           bool verbose) {
+  TempDir tmpDir(verbose);
+  if (!tmpDir.valid()) return false;
+  string name = tmpDir.path() + "/holes";
+  const int headerSize = 8;
+
+  return withMACLayouts(cipher, [&](const FSConfigPtr &fsCfg, int macBytes) {
+    const FUSE_OFF_T bs = FSBlockSize - macBytes;
+
+    // true if plaintext block i is stored as all zeros in the backing file
+    RawFileIO raw(name);
+    auto isHole = [&](FUSE_OFF_T block) {
+      unsigned char buf[FSBlockSize];
+      IORequest req;
+      req.offset = headerSize + block * FSBlockSize;
+      req.dataLen = FSBlockSize;
+      req.data = buf;
+      return raw.read(req) == FSBlockSize &&
+             std::all_of(buf, buf + FSBlockSize,
+                         [](unsigned char c) { return c == 0; });
+    };
+
+    std::vector<unsigned char> expected(3 * bs, 0x33);
+    std::vector<unsigned char> zeros(bs, 0);
+
+    FileNode node(NULL, fsCfg, "/holes", name.c_str());
+    bool ok = node.mknod(0600, 0) == 0 && node.open(O_RDWR) >= 0 &&
+         node.write(0, expected.data(), expected.size()) &&
+         raw.open(O_RDONLY) >= 0;
+
+    // within the file, and appended at a block aligned end of file
+    if (ok) {
+      ok = node.write(bs, zeros.data(), bs) &&
+           node.write(3 * bs, zeros.data(), bs);
+      std::fill(expected.begin() + bs, expected.begin() + 2 * bs, 0);
+      expected.insert(expected.end(), zeros.begin(), zeros.end());
+    }
+    if (ok && (!isHole(1) || !isHole(3) || isHole(0) || isHole(2))) {
+      if (verbose) cerr << "zero block not stored as a hole\n";
+      ok = false;
+    }
+
+    // a zero block over a partial last block is encoded as usual
+    if (ok) {
+      unsigned char tail[10];
+      memset(tail, 0x44, sizeof(tail));
+      ok = node.write(4 * bs, tail, sizeof(tail)) &&
+           node.write(4 * bs, zeros.data(), bs);
+      expected.insert(expected.end(), zeros.begin(), zeros.end());
+    }
+    if (ok && isHole(4)) {
+      if (verbose) cerr << "zero block straddling the end made a hole\n";
+      ok = false;
+    }
+
+    if (ok) {
+      FileNode reopened(NULL, fsCfg, "/holes", name.c_str());
+      if (reopened.open(O_RDONLY) < 0 || !sameContents(reopened, expected)) {
+        if (verbose)
+          cerr << "holes not read back as zeros (" << macBytes
+               << " MAC bytes)\n";
+        ok = false;
+      }
+    }
+    unix::unlink(name.c_str());
+    return ok;
+  });
+}
+
+// Reads on a read-only mount come from a mapping of the backing file, which
+// starts after the file header and is remapped when the file grows.
+static bool testMappedRead(const std::shared_ptr<Cipher> &cipher,
+                           bool verbose) {
+  TempDir tmpDir(verbose);
+  if (!tmpDir.valid()) return false;
+  string name = tmpDir.path() + "/mapped";
+
+  FSConfigPtr fsCfg = newFSConfig(cipher);
+  fsCfg->config->uniqueIV = true;
+  FSConfigPtr roCfg(new FSConfig(*fsCfg));
+  roCfg->opts.reset(new EncFS_Opts);
+  roCfg->opts->readOnly = true;
+
+  std::vector<unsigned char> expected(2 * FSBlockSize + 17);
+  for (size_t i = 0; i < expected.size(); ++i)
+    expected[i] = (unsigned char)(i % 253 + 1);
+
+  FileNode writer(NULL, fsCfg, "/mapped", name.c_str());
+  bool ok = writer.mknod(0600, 0) == 0 && writer.open(O_RDWR) >= 0 &&
+            writer.write(0, expected.data(), expected.size());
+
+  FileNode reader(NULL, roCfg, "/mapped", name.c_str());
+  if (ok && (reader.open(O_RDONLY) < 0 || !sameContents(reader, expected))) {
+    if (verbose) cerr << "mapped read differs from written data\n";
+    ok = false;
+  }
+
+  // the raw file, header included, reads the same mapped or not
+  RawFileIO raw(name), plain(name);
+  raw.setMapped(true);
+  unsigned char mapped[FSBlockSize], unmapped[FSBlockSize];
+  auto sameBlock = [&](FUSE_OFF_T offset) {
+    IORequest req;
+    req.offset = offset;
+    req.dataLen = FSBlockSize;
+    req.data = mapped;
+    ssize_t len = raw.read(req);
+    req.data = unmapped;
+    return len > 0 && plain.read(req) == len &&
+           memcmp(mapped, unmapped, len) == 0;
+  };
+  if (ok) {
+    ok = raw.open(O_RDONLY) >= 0 && plain.open(O_RDONLY) >= 0 &&
+         sameBlock(0) && sameBlock(8) && sameBlock(FSBlockSize + 3);
+    if (ok && raw.mappedSize() != raw.getSize()) {
+      if (verbose) cerr << "reads not served from a mapping\n";
+      ok = false;
+    }
+  }
+
+  // growing the file remaps it on the next read past the old end
+  FUSE_OFF_T oldSize = raw.mappedSize();
+  if (ok) {
+    std::vector<unsigned char> more(FSBlockSize, 0x5a);
+    ok = writer.write(expected.size(), more.data(), more.size());
+    expected.insert(expected.end(), more.begin(), more.end());
+  }
+  if (ok && (!sameBlock(oldSize - 1) || raw.mappedSize() <= oldSize)) {
+    if (verbose) cerr << "file not remapped after it grew\n";
+    ok = false;
+  }
+  if (ok) {
+    // (the first reader has the old last block cached)
+    FileNode grown(NULL, roCfg, "/mapped", name.c_str());
+    if (grown.open(O_RDONLY) < 0 || !sameContents(grown, expected)) {
+      if (verbose) cerr << "grown file read back wrong\n";
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+// The open file map as it was before sharding: one lock, and a std::string
+// key built for every lookup.  Only used as the benchmark baseline.
+struct SingleLockMap {
+  pthread_mutex_t mutex;
+  std::unordered_map<string, std::shared_ptr<FileNode>> files;
+
+  std::shared_ptr<FileNode> lookupNode(const char *path) {
+    Lock lock(mutex);
+    auto it = files.find(string(path));
+    return (it == files.end()) ? std::shared_ptr<FileNode>() : it->second;
+  }
+};
+
+struct LookupArgs {
+  EncFS_Context *ctx;
+  SingleLockMap *baseline;  // looked up instead of ctx if set
+  const std::vector<string> *paths;
+  int files;
+  int iterations;
+  unsigned int seed;
+  bool failed;
+};
+
+// Mimics getattr on a busy mount: every call looks up the open file map,
+// about half of them for paths which aren't open.
+static void *lookupOpenFiles(void *arg) {
+  LookupArgs *args = (LookupArgs *)arg;
+
+  for (int i = 0; i < args->iterations; ++i) {
+    args->seed = args->seed * 1103515245 + 12345;
+    int idx = (args->seed >> 8) % args->paths->size();
+    const char *path = (*args->paths)[idx].c_str();
+
+    std::shared_ptr<FileNode> node = args->baseline
+                                         ? args->baseline->lookupNode(path)
+                                         : args->ctx->lookupNode(path);
+    if ((idx < args->files) != (node != nullptr) ||
+        (node && strcmp(node->plaintextName(), path) != 0)) {
+      args->failed = true;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+// Runs lookups from several threads at once, returns the time taken in
+// milliseconds.  *ok is cleared if any lookup found the wrong node.
+static long timeLookups(EncFS_Context *ctx, SingleLockMap *baseline,
+                        const std::vector<string> &paths, int files,
+                        int threads, int iterations, bool *ok) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<pthread_t> thread(threads);
+  std::vector<LookupArgs> args(threads);
+  for (int i = 0; i < threads; ++i) {
+    LookupArgs a = {ctx, baseline, &paths, files, iterations,
+                    (unsigned int)rand(), false};
+    args[i] = a;
+    pthread_create(&thread[i], 0, lookupOpenFiles, &args[i]);
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(thread[i], 0);
+    if (args[i].failed) *ok = false;
+  }
+  return (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+static bool testOpenFileMap(const std::shared_ptr<Cipher> &cipher,
+                            bool verbose) {
+  FSConfigPtr fsCfg = newFSConfig(cipher);
+
+  const int files = 256;
+  const int threads = 8;
+  const int iterations = 200000;
+
+  EncFS_Context ctx;
+  std::vector<string> paths;
+  for (int i = 0; i < 2 * files; ++i) {
+    std::ostringstream name;
+    name << "/dir" << (i % 7) << "/file" << i;
+    paths.push_back(name.str());
+  }
+  for (int i = 0; i < files; ++i) {
+    std::shared_ptr<FileNode> node(
+        new FileNode(NULL, fsCfg, paths[i].c_str(), paths[i].c_str()));
+    ctx.putNode(paths[i].c_str(), std::move(node));
+  }
+  if (ctx.openFileCount() != files) {
+    if (verbose) cerr << "open file count " << ctx.openFileCount() << "\n";
+    return false;
+  }
+
+  // rename moves the entry, renaming back restores it
+  ctx.renameNode(paths[0].c_str(), "/renamed");
+  bool renamed = !ctx.lookupNode(paths[0].c_str()) &&
+                 ctx.lookupNode("/renamed") != nullptr;
+  ctx.renameNode("/renamed", paths[0].c_str());
+  if (!renamed || !ctx.lookupNode(paths[0].c_str()) ||
+      ctx.openFileCount() != files) {
+    if (verbose) cerr << "rename of open file failed\n";
+    return false;
+  }
+
+  // contention benchmark: the sharded map against a single locked one
+  SingleLockMap baseline;
+  pthread_mutex_init(&baseline.mutex, 0);
+  for (int i = 0; i < files; ++i)
+    baseline.files[paths[i]] = ctx.lookupNode(paths[i].c_str());
+
+  bool ok = true;
+  long sharded = timeLookups(&ctx, NULL, paths, files, threads, iterations,
+                             &ok);
+  long single = timeLookups(&ctx, &baseline, paths, files, threads,
+                            iterations, &ok);
+  if (verbose) {
+    cerr << threads * iterations << " lookups from " << threads
+         << " threads: " << sharded << " ms sharded, " << single
+         << " ms with a single lock\n";
+  }
+  baseline.files.clear();
+  pthread_mutex_destroy(&baseline.mutex);
+
+  for (int i = 0; i < files; ++i)
+    ctx.eraseNode(paths[i].c_str(), NULL);
+  if (ctx.openFileCount() != 0) {
+    if (verbose) cerr << "open files left after erase\n";
+    ok = false;
+  }
+
+  return ok;
+}
+
+// Runs an operation through the dispatch layer a number of times, returns
+// the average number of heap allocations per call.
+template <typename Op>
+static double allocationsPerOp(EncFS_Context *ctx, const char *opName,
+                               const char *path, struct fuse_file_info *fi,
+                               Op op, int *failures) {
+  const int iterations = 1000;
+
+  // once to warm up caches and pools
+  if (withFileNode(ctx, opName, path, fi, op) < 0) ++*failures;
+
+  unsigned long before = gNewCalls;
+  for (int i = 0; i < iterations; ++i)
+    if (withFileNode(ctx, opName, path, fi, op) < 0) ++*failures;
+
+  return (double)(gNewCalls - before) / iterations;
+}
+
+// Same as allocationsPerOp, for a path operation on the backing file
+template <typename Op>
+static double allocationsPerLookup(EncFS_Context *ctx, const char *path,
+                                   Op op, int *failures) {
+  const int iterations = 1000;
+
+  // the first lookup fills the path cache
+  if (withCipherPath(ctx, "lookup", path, op) < 0) ++*failures;
+
+  unsigned long before = gNewCalls;
+  for (int i = 0; i < iterations; ++i)
+    if (withCipherPath(ctx, "lookup", path, op) < 0) ++*failures;
+
+  return (double)(gNewCalls - before) / iterations;
+}
+
+static bool testOpAllocations(const std::shared_ptr<Cipher> &cipher,
+                              bool verbose) {
+  FSConfigPtr fsCfg = newFSConfig(cipher);
+  fsCfg->config->uniqueIV = true;
+
+  TempDir rootDir(verbose);
+  if (!rootDir.valid()) return false;
+
+  EncFS_Context ctx;
+  ctx.opts = fsCfg->opts;
+  ctx.setRoot(
+      std::shared_ptr<DirNode>(new DirNode(&ctx, rootDir.path() + "/",
+                                           fsCfg)));
+
+  bool ok = true;
+  {
+    int res = -EIO;
+    std::shared_ptr<DirNode> root = ctx.getRoot(&res);
+    std::shared_ptr<FileNode> node = root->lookupNode("/bench", "test");
+    if (node->mknod(0600, 0) < 0) ok = false;
+    node = root->openNode("/bench", "test", O_RDWR, &res);
+    if (!node) ok = false;
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    if (ok) {
+      fi.fh = reinterpret_cast<uintptr_t>(
+          ctx.putNode("/bench", std::move(node)));
+    }
+
+    unsigned char buf[4096];
+    memset(buf, 0x17, sizeof(buf));
+    int failures = 0;
+    struct stat_st stbuf;
+
+    double writes = allocationsPerOp(&ctx, "write", "/bench", &fi,
+        [&buf](FileNode *fnode) {
+          return fnode->write(0, buf, sizeof(buf)) ? (int)sizeof(buf) : -EIO;
+        }, &failures);
+    double reads = allocationsPerOp(&ctx, "read", "/bench", &fi,
+        [&buf](FileNode *fnode) {
+          return (int)fnode->read(0, buf, sizeof(buf));
+        }, &failures);
+    double getattrs = allocationsPerOp(&ctx, "fgetattr", "/bench", &fi,
+        [&stbuf](FileNode *fnode) { return fnode->getAttr(&stbuf); },
+        &failures);
+
+    // only the first write after a getattr drops cached attributes
+    if (ok) {
+      FileNode *fnode = reinterpret_cast<FileNode *>(fi.fh);
+      bool first = fnode->markAttrChanged();
+      bool second = fnode->markAttrChanged();
+      fnode->getAttr(&stbuf);
+      if (!first || second || !fnode->markAttrChanged()) {
+        if (verbose) cerr << "attribute change not tracked per getattr\n";
+        ok = false;
+      }
+    }
+
+    // paths of files which aren't open, a few levels down
+    const char *dirs[] = {"/bench-directory", "/bench-directory/level two",
+                          "/bench-directory/level two/level three"};
+    for (const char *dir : dirs)
+      if (root->mkdir(dir, 0700) < 0) ok = false;
+    const char *deepPath = dirs[2];
+    double lookups = allocationsPerLookup(&ctx, deepPath,
+        [&stbuf](EncFS_Context *, const char *cyName) {
+          return unix::stat(cyName, &stbuf);
+        }, &failures);
+    root->getAttr(deepPath, &stbuf);
+    unsigned long before = gNewCalls;
+    for (int i = 0; i < 1000; ++i)
+      if (root->getAttr(deepPath, &stbuf) < 0) ++failures;
+    double pathGetattrs = (double)(gNewCalls - before) / 1000;
+    for (int i = 2; i >= 0; --i) root->rmdir(dirs[i]);
+
+    if (verbose) {
+      cerr << "allocations per op: write " << writes << ", read " << reads
+           << ", getattr " << getattrs << ", path lookup " << lookups
+           << ", path getattr " << pathGetattrs << "\n";
+    }
+    if (failures != 0) {
+      if (verbose) cerr << failures << " operations failed\n";
+      ok = false;
+    }
+    if (writes != 0 || reads != 0 || getattrs != 0) ok = false;
+    if (lookups != 0 || pathGetattrs != 0) ok = false;
+
+    if (fi.fh != 0)
+      ctx.eraseNode("/bench", reinterpret_cast<FileNode *>(fi.fh));
+  }
+  ctx.setRoot(std::shared_ptr<DirNode>());
+
+  return ok;
+}
+
+// Lists a directory twice, the second listing comes from the decoded name
+// cache and has to match the first.  Adding a file must show up.
+static bool testDirListing(const std::shared_ptr<Cipher> &cipher,
+                           bool verbose) {
+  FSConfigPtr fsCfg = newFSConfig(cipher);
+  fsCfg->nameCoding->setChainedNameIV(true);
+
+  TempDir rootDir(verbose);
+  if (!rootDir.valid()) return false;
+
+  DirNode dirNode(NULL, rootDir.path() + "/", fsCfg);
+  bool ok = dirNode.mkdir("/dir", 0700) == 0;
+
+  std::list<string> created;
+  auto list = [&dirNode](std::list<string> *names) {
+    DirTraverse dt = dirNode.openDir("/dir");
+    if (!dt.valid()) return false;
+    for (string name = dt.nextPlaintextName(); !name.empty();
+         name = dt.nextPlaintextName()) {
+      if (name != "." && name != "..") names->push_back(name);
+    }
+    names->sort();
+    return true;
+  };
+
+  for (int i = 0; ok && i < 3; ++i) {
+    std::ostringstream name;
+    name << "/dir/file" << i;
+    ok = dirNode.lookupNode(name.str().c_str(), "test")->mknod(0600, 0) == 0;
+    created.push_back(name.str().substr(5));
+  }
+
+  std::list<string> first, second;
+  if (ok) ok = list(&first) && list(&second);
+  if (ok && (first != created || second != created)) {
+    if (verbose) cerr << "listing does not match created files\n";
+    ok = false;
+  }
+
+  // a name put back, as readdir does when the reply is full, comes again
+  if (ok) {
+    DirTraverse dt = dirNode.openDir("/dir");
+    string first = dt.nextPlaintextName();
+    string second = dt.nextPlaintextName();
+    dt.putBack();
+    if (dt.tell() != 1 || dt.nextPlaintextName() != second ||
+        dt.tell() != 2 || first.empty()) {
+      if (verbose) cerr << "put back name not returned again\n";
+      ok = false;
+    }
+  }
+
+  // attributes from the listing match getAttr, sizes without the header
+  if (ok) {
+    std::shared_ptr<FileNode> node = dirNode.lookupNode("/dir/file0", "test");
+    unsigned char data[100] = {0};
+    ok = node->open(O_RDWR) >= 0 && node->write(0, data, sizeof(data));
+  }
+  if (ok) {
+    DirTraverse dt = dirNode.openDir("/dir");
+    struct stat_st st, expected;
+    bool fullAttr = false;
+    for (string name = dt.nextPlaintextName(&st, &fullAttr);
+         ok && !name.empty(); name = dt.nextPlaintextName(&st, &fullAttr)) {
+      if (!fullAttr || name == "." || name == "..") continue;
+      ok = dirNode.getAttr(("/dir/" + name).c_str(), &expected) == 0;
+      if (ok && (st.st_size != expected.st_size ||
+                 (st.st_mode & S_IFMT) != (expected.st_mode & S_IFMT))) {
+        if (verbose) cerr << "listing attributes differ for " << name << "\n";
+        ok = false;
+      }
+    }
+  }
+
+  // entries are always read from the backing directory, a new one shows up
+  // whether or not the cache was refreshed
+  std::list<string> third;
+  if (ok) {
+    ok = dirNode.lookupNode("/dir/file3", "test")->mknod(0600, 0) == 0;
+    created.push_back("file3");
+    if (ok) ok = list(&third);
+    if (ok && third != created) {
+      if (verbose) cerr << "new file missing from listing\n";
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+// Renames a directory tree on a chained IV volume, then replays a journal
+// left behind by an interrupted rename.
+static bool testRecursiveRename(const std::shared_ptr<Cipher> &cipher,
+                                bool verbose) {
+  FSConfigPtr fsCfg = newFSConfig(cipher);
+  fsCfg->nameCoding->setChainedNameIV(true);
+
+  TempDir rootDir(verbose);
+  if (!rootDir.valid()) return false;
+  string journal = rootDir.path() + "/.encfs6.rename";
+
+  const int dirs = 4;
+  const int subdirs = 3;
+  const int files = 5;
+  auto tree = [&](const string &top, std::vector<string> *paths) {
+    for (int d = 0; d < dirs; ++d) {
+      std::ostringstream dir;
+      dir << top << "/dir" << d;
+      paths->push_back(dir.str());
+      for (int s = 0; s < subdirs; ++s) {
+        std::ostringstream sub;
+        sub << dir.str() << "/sub" << s;
+        paths->push_back(sub.str());
+        for (int f = 0; f < files; ++f) {
+          std::ostringstream file;
+          file << sub.str() << "/file" << f;
+          paths->push_back(file.str());
+        }
+      }
+    }
+  };
+  std::vector<string> before, after;
+  tree("/top", &before);
+  tree("/moved", &after);
+
+  bool ok;
+  {
+    DirNode dirNode(NULL, rootDir.path() + "/", fsCfg);
+    ok = dirNode.mkdir("/top", 0700) == 0;
+    for (size_t i = 0; ok && i < before.size(); ++i) {
+      if (before[i].find("/file") != string::npos)
+        ok = dirNode.lookupNode(before[i].c_str(), "test")->mknod(0600, 0) ==
+             0;
+      else
+        ok = dirNode.mkdir(before[i].c_str(), 0700) == 0;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (ok && dirNode.rename("/top", "/moved") != 0) {
+      if (verbose) cerr << "rename failed\n";
+      ok = false;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    if (verbose) {
+      cerr << before.size() << " descendants renamed in " << elapsed.count()
+           << " ms\n";
+    }
+
+    struct stat_st st;
+    for (size_t i = 0; ok && i < after.size(); ++i) {
+      if (dirNode.getAttr(after[i].c_str(), &st) != 0) {
+        if (verbose) cerr << after[i] << " missing after rename\n";
+        ok = false;
+      }
+    }
+    if (ok && dirNode.getAttr("/top", &st) == 0) {
+      if (verbose) cerr << "old directory left behind\n";
+      ok = false;
+    }
+    if (ok && unix::stat(journal.c_str(), &st) == 0) {
+      if (verbose) cerr << "rename journal left behind\n";
+      ok = false;
+    }
+  }
+
+  // a complete journal is replayed when the next DirNode is created
+  string fromName = rootDir.path() + "/resumeFrom";
+  string toName = rootDir.path() + "/resumeTo";
+  int fd = unix::open(fromName.c_str(), O_CREAT | O_WRONLY, 0600);
+  if (fd >= 0) unix::close(fd);
+  string contents = "encfs rename journal 1\nresumeFrom\tresumeTo\nend\n";
+  fd = unix::open(journal.c_str(), O_CREAT | O_WRONLY, 0600);
+  if (fd >= 0) {
+    unix::pwrite(fd, contents.data(), contents.length(), 0);
+    unix::close(fd);
+  }
+  {
+    DirNode dirNode(NULL, rootDir.path() + "/", fsCfg);
+  }
+  struct stat_st st;
+  if (ok && (unix::stat(fromName.c_str(), &st) == 0 ||
+             unix::stat(toName.c_str(), &st) != 0 ||
+             unix::stat(journal.c_str(), &st) == 0)) {
+    if (verbose) cerr << "interrupted rename not resumed\n";
+    ok = false;
+  }
+  unix::unlink(toName.c_str());
+
+  // a rename which can't be made keeps the journal, as does a volume whose
+  // file headers depend on their path
+  fd = unix::open(fromName.c_str(), O_CREAT | O_WRONLY, 0600);
+  if (fd >= 0) unix::close(fd);
+  contents = "encfs rename journal 1\nresumeFrom\tmissing/resumeTo\nend\n";
+  for (int externalIV = 0; ok && externalIV < 2; ++externalIV) {
+    if (externalIV)
+      contents = "encfs rename journal 1\nresumeFrom\tresumeTo\nend\n";
+    fd = unix::open(journal.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd >= 0) {
+      unix::pwrite(fd, contents.data(), contents.length(), 0);
+      unix::close(fd);
+    }
+    fsCfg->config->externalIVChaining = externalIV != 0;
+    {
+      DirNode dirNode(NULL, rootDir.path() + "/", fsCfg);
+    }
+    if (unix::stat(journal.c_str(), &st) != 0 ||
+        unix::stat(fromName.c_str(), &st) != 0) {
+      if (verbose) cerr << "journal of an unfinished rename removed\n";
+      ok = false;
+    }
+  }
+
+  // the pending journal isn't listed, not even with plaintext names.  (The
+  // volume still has external IV chaining, so it isn't replayed here.)
+  if (ok) {
+    std::shared_ptr<NameIO> coding = fsCfg->nameCoding;
+    fsCfg->nameCoding.reset(new NullNameIO());
+    {
+      DirNode dirNode(NULL, rootDir.path() + "/", fsCfg);
+      DirTraverse dt = dirNode.openDir("/");
+      bool listed = false;
+      for (string name = dt.nextPlaintextName(); !name.empty();
+           name = dt.nextPlaintextName()) {
+        if (name == ".encfs6.rename") ok = false;
+        if (name == "resumeFrom") listed = true;
+      }
+      if (!ok || !listed) {
+        if (verbose) cerr << "rename journal listed\n";
+        ok = false;
+      }
+    }
+    fsCfg->nameCoding = coding;
+  }
+  fsCfg->config->externalIVChaining = false;
+
+  return ok;
+}
+
+// With per-directory IVs, renaming a directory only renames the directory,
+// and a new DirNode finds the contents through the stored IVs.
+static bool testDirectoryIV(const std::shared_ptr<Cipher> &cipher,
+                            bool verbose) {
+  FSConfigPtr fsCfg = newFSConfig(cipher);
+  fsCfg->config->directoryIV = true;
+  fsCfg->nameCoding->setChainedNameIV(true);
+
+  TempDir rootDir(verbose);
+  if (!rootDir.valid()) return false;
+
+  // the name of a path within its backing directory
+  auto leaf = [](const string &path) {
+    return path.substr(path.rfind('/') + 1);
+  };
+
+  bool ok;
+  struct stat_st st;
+  {
+    DirNode dirNode(NULL, rootDir.path() + "/", fsCfg);
+    ok = dirNode.mkdir("/a", 0700) == 0 && dirNode.mkdir("/a/b", 0700) == 0;
+    if (ok) ok = dirNode.lookupNode("/a/b/f", "test")->mknod(0600, 0) == 0;
+    if (ok && dirNode.hasDirectoryNameDependency()) {
+      if (verbose) cerr << "names still depend on the parent path\n";
+      ok = false;
+    }
+
+    string ivFile = dirNode.cipherPath("/a") + "/.encfs6.diriv";
+    if (ok && unix::stat(ivFile.c_str(), &st) != 0) {
+      if (verbose) cerr << "directory IV not stored\n";
+      ok = false;
+    }
+
+    // the IV file isn't part of the listing
+    if (ok) {
+      DirTraverse dt = dirNode.openDir("/a/b");
+      std::list<string> names;
+      for (string name = dt.nextPlaintextName(); !name.empty();
+           name = dt.nextPlaintextName()) {
+        if (name != "." && name != "..") names.push_back(name);
+      }
+      if (names.size() != 1 || names.front() != "f") {
+        if (verbose) cerr << "unexpected listing of /a/b\n";
+        ok = false;
+      }
+    }
+
+    // b and f are coded with the IV of a, which moves along with it
+    string bName = leaf(dirNode.cipherPath("/a/b"));
+    string fName = leaf(dirNode.cipherPath("/a/b/f"));
+    if (ok) ok = dirNode.rename("/a", "/c") == 0;
+    if (ok && (leaf(dirNode.cipherPath("/c/b")) != bName ||
+               leaf(dirNode.cipherPath("/c/b/f")) != fName ||
+               dirNode.getAttr("/c/b/f", &st) != 0)) {
+      if (verbose) cerr << "contents changed by directory rename\n";
+      ok = false;
+    }
+  }
+
+  {
+    EncFS_Context ctx;
+    ctx.attrCache.setTTL(60000, 60000);
+    std::shared_ptr<DirNode> root(
+        new DirNode(&ctx, rootDir.path() + "/", fsCfg));
+    ctx.setRoot(root);
+    DirNode &dirNode = *root;
+    if (ok && dirNode.getAttr("/c/b/f", &st) != 0) {
+      if (verbose) cerr << "directory IV not read back\n";
+      ok = false;
+    }
+
+    // changes made behind our back are decoded through the stored IVs and
+    // drop the cached attributes of the plaintext path
+    string cyName = dirNode.cipherPathWithoutRoot("/c/b/f");
+    if (ok && dirNode.plainPath(cyName.c_str()) != "/c/b/f") {
+      if (verbose) cerr << "path not decoded with directory IVs\n";
+      ok = false;
+    }
+    if (ok && dirNode.relativeCipherPath("/c/b/f") != cyName) {
+      if (verbose) cerr << "relative path not coded with directory IVs\n";
+      ok = false;
+    }
+    uint64_t generation;
+    int res;
+    const char *cachedPaths[] = {"/c/b/f", "/c"};
+    for (const char *path : cachedPaths) {
+      ctx.attrCache.lookup(path, &st, &res, &generation);
+      ctx.attrCache.insert(path, 0, &st, generation);
+    }
+    ctx.backingChanged(cyName.c_str(), false);
+    if (ok && (ctx.attrCache.lookup("/c/b/f", &st, &res, &generation) ||
+               !ctx.attrCache.lookup("/c", &st, &res, &generation))) {
+      if (verbose) cerr << "backing change not mapped to its path\n";
+      ok = false;
+    }
+    if (ok && dirNode.rmdir("/c/b") != -ENOTEMPTY) {
+      if (verbose) cerr << "non-empty directory removed\n";
+      ok = false;
+    }
+    dirNode.unlink("/c/b/f");
+    if (ok && (dirNode.rmdir("/c/b") != 0 || dirNode.rmdir("/c") != 0)) {
+      if (verbose) cerr << "unable to remove directory with IV\n";
+      ok = false;
+    }
+    ctx.setRoot(std::shared_ptr<DirNode>());
+  }
+  if (unix::rmdir(rootDir.path().c_str()) != 0) {
+    if (verbose) cerr << "backing files left behind\n";
+    ok = false;
+  }
+
+  // filesystems without directory IVs keep the previous coding version
+  Interface current = StreamNameIO::CurrentInterface();
+  Interface plain = NameIO::ConfigInterface(current, false);
+  if (ok &&
+      (plain.current() != current.current() - 1 || !current.implements(plain))) {
+    if (verbose) cerr << "unexpected interface without directory IVs\n";
+    ok = false;
+  }
+
+  return ok;
+}
+
+// Hits, negative entries, invalidation of a path and its parent and of a
+// tree, expiry, and getattrs which raced with an invalidation.
+static bool testAttrCache(bool verbose) {
+  AttrCache cache;
+  cache.setTTL(60000, 60000);
+
+  struct stat_st st;
+  memset(&st, 0, sizeof(st));
+  st.st_size = 1234;
+  const char *paths[] = {"/", "/dir", "/dir/file", "/dir/sub",
+                         "/dir/sub/file", "/dirx"};
+  for (const char *path : paths) {
+    uint64_t generation;
+    int res;
+    cache.lookup(path, &st, &res, &generation);
+    cache.insert(path, 0, &st, generation);
+  }
+  uint64_t generation;
+  int res = 0;
+  cache.lookup("/missing", &st, &res, &generation);
+  cache.insert("/missing", -ENOENT, NULL, generation);
+
+  auto cached = [&cache](const char *path) {
+    struct stat_st stbuf;
+    uint64_t generation;
+    int res;
+    return cache.lookup(path, &stbuf, &res, &generation);
+  };
+
+  struct stat_st stbuf;
+  memset(&stbuf, 0, sizeof(stbuf));
+  unsigned long before = gNewCalls;
+  bool hit = cache.lookup("/dir/file", &stbuf, &res, &generation);
+  if (gNewCalls != before || !hit || res != 0 || stbuf.st_size != 1234) {
+    if (verbose) cerr << "cache hit failed\n";
+    return false;
+  }
+  if (!cache.lookup("/missing", &stbuf, &res, &generation) ||
+      res != -ENOENT) {
+    if (verbose) cerr << "negative entry failed\n";
+    return false;
+  }
+
+  // errors other than ENOENT aren't cached
+  cache.lookup("/denied", &st, &res, &generation);
+  cache.insert("/denied", -EACCES, NULL, generation);
+  if (cached("/denied")) {
+    if (verbose) cerr << "error result was cached\n";
+    return false;
+  }
+
+  cache.invalidate("/dir/file");
+  if (cached("/dir/file") || cached("/dir") || !cached("/") ||
+      !cached("/dir/sub")) {
+    if (verbose) cerr << "invalidate dropped the wrong entries\n";
+    return false;
+  }
+
+  cache.invalidateTree("/dir/sub");
+  if (cached("/dir/sub") || cached("/dir/sub/file") || !cached("/dirx") ||
+      !cached("/")) {
+    if (verbose) cerr << "invalidateTree dropped the wrong entries\n";
+    return false;
+  }
+
+  // a result from before an invalidation doesn't get stored
+  cache.lookup("/dir/file", &st, &res, &generation);
+  cache.invalidate("/dir/file");
+  cache.insert("/dir/file", 0, &st, generation);
+  if (cached("/dir/file")) {
+    if (verbose) cerr << "stale result was stored\n";
+    return false;
+  }
+
+  cache.setTTL(10, 0);
+  cache.lookup("/dir/file", &st, &res, &generation);
+  cache.insert("/dir/file", 0, &st, generation);
+  cache.lookup("/missing", &st, &res, &generation);
+  cache.insert("/missing", -ENOENT, NULL, generation);
+  if (!cached("/dir/file") || cached("/missing")) {
+    if (verbose) cerr << "TTLs not applied\n";
+    return false;
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  if (cached("/dir/file")) {
+    if (verbose) cerr << "entry did not expire\n";
+    return false;
+  }
+
+  return true;
+}
+
+// A file is unchanged since its last close until its attributes differ,
+// or it is changed through us.
+static bool testChangeTokens(bool verbose) {
+  EncFS_Context ctx;
+
+  struct stat_st st;
+  memset(&st, 0, sizeof(st));
+  st.st_size = 100;
+  st.st_ino = 7;
+  if (ctx.unchangedSinceClose("/file", st)) {
+    if (verbose) cerr << "file which was never closed is unchanged\n";
+    return false;
+  }
+
+  ctx.fileClosed("/file", st);
+  if (!ctx.unchangedSinceClose("/file", st)) {
+    if (verbose) cerr << "closed file not unchanged\n";
+    return false;
+  }
+
+  struct stat_st grown = st;
+  grown.st_size = 200;
+  if (ctx.unchangedSinceClose("/file", grown)) {
+    if (verbose) cerr << "size change not seen\n";
+    return false;
+  }
+
+  // writes within the same second leave the backing attributes alone
+  ctx.fileChanged("/file");
+  if (ctx.unchangedSinceClose("/file", st)) {
+    if (verbose) cerr << "change through us not seen\n";
+    return false;
+  }
+  ctx.fileClosed("/file", st);
+  if (!ctx.unchangedSinceClose("/file", st)) {
+    if (verbose) cerr << "close after change not recorded\n";
+    return false;
+  }
+
+  ctx.forgetClosedFiles();
+  if (ctx.unchangedSinceClose("/file", st)) {
+    if (verbose) cerr << "closed files not forgotten\n";
+    return false;
+  }
+
+  return true;
+}
+
 static bool testCipherSize(const string &name, int keySize, int blockSize,
                            bool verbose) {
   cerr << name << ", key length " << keySize << ", block size " << blockSize
@@ -405,6 +2061,20 @@ int main(int argc, char *argv[]) {
 
   srand(time(0));
 
+  cerr << "Testing memory pool: ";
+  if (!testMemoryPool(true)) {
+    cerr << "FAILED\n";
+    return 1;
+  }
+  cerr << "OK\n";
+
+  cerr << "Testing base64 / base32 name coding: ";
+  if (!testBase64(true)) {
+    cerr << "FAILED\n";
+    return 1;
+  }
+  cerr << "OK\n";
+
   // get a list of the available algorithms
   std::list<Cipher::CipherAlgorithm> algorithms = Cipher::GetAlgorithmList();
   std::list<Cipher::CipherAlgorithm>::const_iterator it;
@@ -444,6 +2114,90 @@ int main(int argc, char *argv[]) {
          << FSBlockSize << ":\n";
 
     runTests(cipher, true);
+
+    cerr << "Testing pooled name decoding: ";
+    if (!testPooledDecode(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing concurrent block IO: ";
+    if (!testConcurrentIO(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing allocate and hole punching: ";
+    if (!testAllocate(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing zero blocks stored as holes: ";
+    if (!testHoleWrites(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing mapped reads: ";
+    if (!testMappedRead(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing operation allocations: ";
+    if (!testOpAllocations(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing directory listing: ";
+    if (!testDirListing(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing recursive rename: ";
+    if (!testRecursiveRename(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing per-directory IVs: ";
+    if (!testDirectoryIV(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing attribute cache: ";
+    if (!testAttrCache(true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing change tokens: ";
+    if (!testChangeTokens(true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
+
+    cerr << "Testing open file map: ";
+    if (!testOpenFileMap(cipher, true)) {
+      cerr << "FAILED\n";
+      return 1;
+    }
+    cerr << "OK\n";
   }
 
   MemoryPool::destroyAll();
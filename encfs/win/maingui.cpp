@@ -317,7 +317,7 @@ static void createConfig(const std::string& rootDir, bool paranoid, const char*
   config->cipherIface = cipher->getInterface();
   config->keySize = keySize;
   config->blockSize = blockSize;
-  config->nameIface = nameIOIface;
+  config->nameIface = NameIO::ConfigInterface(nameIOIface, false);
   config->creator = "EncFS " VERSION;
   config->subVersion = V6SubVersion;
   config->blockMACBytes = blockMACBytes;